@@ -0,0 +1,54 @@
+#!/bin/sh
+# Generates a media tree for benchmarks: FILES placeholder files spread over nested directories of
+# up to FANOUT entries each, plus a few real clips made from GStreamer test sources in clips/.
+#
+#   bench/gen-media.sh DIR [FILES] [FANOUT]
+#
+# The placeholders are empty, so only listings, search and metadata probing see them. Load and seek
+# benchmarks need the clips, e.g. wsbench --clip DIR/clips/video.mkv --clip DIR/clips/audio.ogg
+set -e
+
+DIR=${1:?usage: $0 DIR [FILES] [FANOUT]}
+FILES=${2:-1000}
+FANOUT=${3:-100}
+CLIP_SECONDS=${CLIP_SECONDS:-120}
+
+mkdir -p "$DIR/clips"
+
+# Placeholders, named like the files of a real library
+awk -v files="$FILES" -v fanout="$FANOUT" -v dir="$DIR" 'BEGIN {
+	split("mkv mp4 avi mp3 flac ogg jpg nfo srt", extensions, " ")
+	for(i = 0; i < files; i++) {
+		path = dir
+		for(n = int(i / fanout); n > 0; n = int(n / fanout))
+			path = path "/dir" (n % fanout)
+		printf "%s/Episode %06d.%s\n", path, i, extensions[i % 9 + 1]
+	}
+}' | while IFS= read -r file; do
+	parent=${file%/*}
+	[ -d "$parent" ] || mkdir -p "$parent"
+	: > "$file"
+done
+
+# Clips, encoded with whatever this GStreamer has
+FRAMES=$((CLIP_SECONDS * 25))
+BUFFERS=$((CLIP_SECONDS * 44100 / 1024))
+if [ ! -f "$DIR/clips/video.mkv" ]; then
+	if gst-inspect-1.0 x264enc > /dev/null 2>&1; then
+		VIDEO_ENCODER="x264enc tune=zerolatency key-int-max=50 ! h264parse"
+	else
+		VIDEO_ENCODER="vp8enc keyframe-max-dist=50 deadline=1"
+	fi
+	gst-launch-1.0 -q \
+		videotestsrc num-buffers=$FRAMES pattern=smpte ! video/x-raw,width=1280,height=720,framerate=25/1 ! \
+		timeoverlay ! $VIDEO_ENCODER ! queue ! mux. \
+		audiotestsrc num-buffers=$BUFFERS samplesperbuffer=1024 wave=sine ! audioconvert ! vorbisenc ! queue ! mux. \
+		matroskamux name=mux ! filesink location="$DIR/clips/video.mkv"
+fi
+if [ ! -f "$DIR/clips/audio.ogg" ]; then
+	gst-launch-1.0 -q \
+		audiotestsrc num-buffers=$BUFFERS samplesperbuffer=1024 wave=ticks ! audioconvert ! vorbisenc ! oggmux ! \
+		filesink location="$DIR/clips/audio.ogg"
+fi
+
+echo "$FILES files below $DIR, clips in $DIR/clips"
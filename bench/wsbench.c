@@ -0,0 +1,459 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+
+#include "../src/wire.h"
+
+
+/* Drives a running banana-player (best started with --headless) through its websocket from many
+ * clients at once and reports how long it takes to answer them. Every client but the first walks
+ * the directory tree at random. The first one loads the clips given with --clip in turn and seeks
+ * around in each of them. Every client receives the status broadcasts, which carry the time they
+ * were taken. The resident memory of the player is sampled from /metrics all along, so long runs
+ * show whether it keeps growing. */
+
+
+#define OP_TIMEOUT_MS 10000 /* loads and seeks that take longer than this count as failed */
+#define SEEKS_PER_LOAD 4
+
+
+typedef enum {
+	OP_NONE,
+	OP_LOAD,
+	OP_SEEK
+} Operation;
+
+typedef struct _Bench {
+	GMainLoop *   loop;
+	SoupSession * session;
+	gchar *       url;         /* of the websocket */
+	gchar *       metrics_url;
+	gchar **      clips;       /* uris */
+	gchar **      protocols;   /* websocket subprotocols to ask for, NULL for none */
+	gint          think_ms;    /* pause of each client between two requests */
+
+	GArray *      browse;      /* latencies in milliseconds */
+	GArray *      load;
+	GArray *      seek;
+	GArray *      fanout;
+	GArray *      rss;         /* resident memory samples, in bytes */
+	gint64        started;     /* monotonic time the first client connected */
+	gint          connected;
+	guint         failures;
+	gboolean      stopping;
+} Bench;
+
+typedef struct _BenchClient {
+	Bench *                   bench;
+	gint                      id;
+	SoupWebsocketConnection * connection;
+	gchar *                   root;     /* path of the first listing the player sent */
+	gchar *                   here;     /* directory to browse next */
+	gchar *                   waiting;  /* path of the listing we asked for, NULL if none */
+	gint64                    sent;     /* monotonic time of the pending request */
+
+	/* Playback, only driven by the first client. The player counts loads and completed seeks in
+	 * its status, which tells when ours are through. */
+	gboolean                  started;  /* the counters are known, loads can begin */
+	Operation                 op;
+	guint                     clip;     /* next clip to load */
+	gint64                    loads;
+	gint64                    seeks;
+	gint64                    before;   /* count of loads or seeks when the pending one was sent */
+	gint                      seeks_left;
+} BenchClient;
+
+
+static void client_next(BenchClient * client);
+
+
+static gdouble elapsed_ms(gint64 since) {
+	return (g_get_monotonic_time() - since) / 1000.0;
+}
+
+
+static void client_send(BenchClient * client, JsonBuilder * builder) {
+	JsonGenerator * generator = json_generator_new();
+	JsonNode *      root      = json_builder_get_root(builder);
+	json_generator_set_root(generator, root);
+	gchar * text = json_generator_to_data(generator, NULL);
+	soup_websocket_connection_send_text(client->connection, text);
+	g_free(text);
+	json_node_unref(root);
+	g_object_unref(generator);
+	g_object_unref(builder);
+}
+
+
+static void client_browse(BenchClient * client, const gchar * path) {
+	g_free(client->waiting);
+	client->waiting = g_strdup(path);
+	client->sent    = g_get_monotonic_time();
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "browse");
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, path);
+		json_builder_set_member_name(builder, "offset");
+		json_builder_add_int_value(builder, 0);
+		json_builder_set_member_name(builder, "limit");
+		json_builder_add_int_value(builder, 200);
+	json_builder_end_object(builder);
+	client_send(client, builder);
+}
+
+
+static void client_load(BenchClient * client) {
+	Bench * bench = client->bench;
+	gchar * path  = g_filename_from_uri(bench->clips[client->clip], NULL, NULL);
+	client->op         = OP_LOAD;
+	client->sent       = g_get_monotonic_time();
+	client->before     = client->loads;
+	client->seeks_left = SEEKS_PER_LOAD;
+	client->clip       = (client->clip + 1) % g_strv_length(bench->clips);
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "load");
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, path);
+	json_builder_end_object(builder);
+	client_send(client, builder);
+	g_free(path);
+}
+
+
+static void client_seek(BenchClient * client) {
+	client->op     = OP_SEEK;
+	client->sent   = g_get_monotonic_time();
+	client->before = client->seeks;
+	client->seeks_left--;
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "seek");
+		json_builder_set_member_name(builder, "percent");
+		json_builder_add_double_value(builder, g_random_double_range(0, 90));
+	json_builder_end_object(builder);
+	client_send(client, builder);
+}
+
+
+static gboolean client_next_cb(BenchClient * client) {
+	client_next(client);
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Fires once the player took too long for a load or seek, so the run goes on regardless */
+static gboolean client_timeout_cb(BenchClient * client) {
+	if(client->op != OP_NONE && elapsed_ms(client->sent) >= OP_TIMEOUT_MS) {
+		g_printerr("[BENCH] %s timed out\n", client->op == OP_LOAD ? "load" : "seek");
+		client->bench->failures++;
+		client->op = OP_NONE;
+		client_next(client);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+
+/* Issues the next request of the client */
+static void client_next(BenchClient * client) {
+	Bench * bench = client->bench;
+	if(bench->stopping || client->connection == NULL)
+		return;
+
+	if(client->id > 0)
+		client_browse(client, client->here);
+	else if(client->seeks_left > 0)
+		client_seek(client);
+	else
+		client_load(client);
+}
+
+
+static void client_schedule(BenchClient * client) {
+	g_timeout_add(client->bench->think_ms, (GSourceFunc)client_next_cb, client);
+}
+
+
+static void on_status(BenchClient * client, JsonObject * object) {
+	Bench * bench = client->bench;
+	if(json_object_has_member(object, "time")) {
+		gdouble latency = (g_get_real_time() - json_object_get_int_member(object, "time")) / 1000.0;
+		g_array_append_val(bench->fanout, latency);
+	}
+	if(json_object_has_member(object, "loads"))
+		client->loads = json_object_get_int_member(object, "loads");
+	if(json_object_has_member(object, "seeks"))
+		client->seeks = json_object_get_int_member(object, "seeks");
+	if(client->id == 0 && bench->clips != NULL && !client->started) {
+		client->started = TRUE;
+		client_next(client);
+		return;
+	}
+
+	/* A load is through once its first frame is out and the pipeline is playing */
+	gboolean done    = FALSE;
+	gdouble  latency = elapsed_ms(client->sent);
+	if(client->op == OP_LOAD)
+		done = client->loads > client->before && json_object_get_int_member(object, "ttff") >= 0 && g_strcmp0(json_object_get_string_member(object, "state"), "playing") == 0;
+	else if(client->op == OP_SEEK)
+		done = client->seeks > client->before;
+	if(done) {
+		g_array_append_val(client->op == OP_LOAD ? bench->load : bench->seek, latency);
+		client->op = OP_NONE;
+		client_schedule(client);
+	}
+}
+
+
+/* Goes on into a random subdirectory, and back to the root now and then and at the leaves */
+static void on_browse_page(BenchClient * client, JsonObject * object) {
+	const gchar * path = json_object_get_string_member(object, "path");
+	if(client->root == NULL) {
+		client->root = g_strdup(path);
+		client->here = g_strdup(path);
+		if(client->id > 0)
+			client_schedule(client);
+		return;
+	}
+	if(client->waiting == NULL || g_strcmp0(path, client->waiting) != 0)
+		return;
+
+	gdouble latency = elapsed_ms(client->sent);
+	g_array_append_val(client->bench->browse, latency);
+	g_clear_pointer(&client->waiting, g_free);
+
+	GPtrArray * directories = g_ptr_array_new();
+	JsonArray * entries     = json_object_get_array_member(object, "entries");
+	for(guint i = 0; i < json_array_get_length(entries); i++) {
+		JsonObject * entry = json_array_get_object_element(entries, i);
+		if(json_object_has_member(entry, "directory"))
+			g_ptr_array_add(directories, (gpointer)json_object_get_string_member(entry, "name"));
+	}
+
+	g_free(client->here);
+	if(directories->len > 0 && g_random_int_range(0, 8) > 0)
+		client->here = g_strdup_printf("%s%s/", path, (gchar *)g_ptr_array_index(directories, g_random_int_range(0, directories->len)));
+	else
+		client->here = g_strdup(client->root);
+	g_ptr_array_free(directories, TRUE);
+	client_schedule(client);
+}
+
+
+static void client_message_cb(SoupWebsocketConnection * connection, gint type, GBytes * message, BenchClient * client) {
+	/* Acknowledge every frame, like a client that wants to be sent no more than it can take */
+	soup_websocket_connection_send_text(connection, "{\"type\":\"ack\"}");
+
+	JsonNode * node = NULL;
+	if(type == SOUP_WEBSOCKET_DATA_BINARY)
+		node = wire_msgpack_decode(message, NULL);
+	else {
+		JsonParser *  parser = json_parser_new();
+		gsize         size;
+		const gchar * text   = g_bytes_get_data(message, &size);
+		if(json_parser_load_from_data(parser, text, size, NULL))
+			node = json_node_ref(json_parser_get_root(parser));
+		g_object_unref(parser);
+	}
+	if(node == NULL)
+		return;
+
+	if(JSON_NODE_HOLDS_OBJECT(node)) {
+		JsonObject *  object = json_node_get_object(node);
+		const gchar * kind   = json_object_get_string_member(object, "type");
+		if(g_strcmp0(kind, "status") == 0)
+			on_status(client, object);
+		else if(g_strcmp0(kind, "browse-page") == 0)
+			on_browse_page(client, object);
+	}
+	json_node_unref(node);
+}
+
+
+static void client_closed_cb(SoupWebsocketConnection * connection, BenchClient * client) {
+	if(!client->bench->stopping) {
+		g_printerr("[BENCH] client %d was disconnected\n", client->id);
+		client->bench->failures++;
+	}
+	g_clear_object(&client->connection);
+}
+
+
+static void client_connected_cb(SoupSession * session, GAsyncResult * result, BenchClient * client) {
+	Bench *  bench = client->bench;
+	GError * error = NULL;
+	client->connection = soup_session_websocket_connect_finish(session, result, &error);
+	if(client->connection == NULL) {
+		g_printerr("[BENCH] client %d cannot connect: %s\n", client->id, error->message);
+		g_error_free(error);
+		bench->failures++;
+		return;
+	}
+	/* Listings of huge directories are larger than the default limit of 128 KiB */
+	soup_websocket_connection_set_max_incoming_payload_size(client->connection, 0);
+	g_signal_connect(client->connection, "message", (GCallback)client_message_cb, client);
+	g_signal_connect(client->connection, "closed" , (GCallback)client_closed_cb , client);
+
+	if(bench->connected++ == 0)
+		bench->started = g_get_monotonic_time();
+	if(client->id == 0 && bench->clips != NULL)
+		g_timeout_add(1000, (GSourceFunc)client_timeout_cb, client);
+}
+
+
+static void rss_cb(SoupSession * session, SoupMessage * msg, Bench * bench) {
+	if(msg->status_code != SOUP_STATUS_OK)
+		return;
+
+	gchar *       text = g_strndup(msg->response_body->data, msg->response_body->length);
+	const gchar * line = strstr(text, "\nprocess_resident_memory_bytes ");
+	if(line != NULL) {
+		gdouble rss = g_ascii_strtod(line + strlen("\nprocess_resident_memory_bytes "), NULL);
+		g_array_append_val(bench->rss, rss);
+		g_print("[BENCH] %5.0fs  rss %.1f MB\n", elapsed_ms(bench->started) / 1000.0, rss / (1 << 20));
+	}
+	g_free(text);
+}
+
+
+static gboolean sample_rss_cb(Bench * bench) {
+	soup_session_queue_message(bench->session, soup_message_new("GET", bench->metrics_url), (SoupSessionCallback)rss_cb, bench);
+	return G_SOURCE_CONTINUE;
+}
+
+
+static gboolean stop_cb(Bench * bench) {
+	bench->stopping = TRUE;
+	g_main_loop_quit(bench->loop);
+	return G_SOURCE_REMOVE;
+}
+
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+	gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/* Nearest-rank percentile of the sorted samples */
+static gdouble percentile(GArray * samples, gdouble p) {
+	gint rank = (gint)ceil(p / 100.0 * samples->len) - 1;
+	return g_array_index(samples, gdouble, CLAMP(rank, 0, (gint)samples->len - 1));
+}
+
+
+static void report(const gchar * name, GArray * samples) {
+	if(samples->len == 0) {
+		g_print("%-16s      no samples\n", name);
+		return;
+	}
+	g_array_sort(samples, compare_doubles);
+	g_print("%-16s %7u  p50 %8.2f ms  p99 %8.2f ms  max %8.2f ms\n", name, samples->len, percentile(samples, 50), percentile(samples, 99), g_array_index(samples, gdouble, samples->len - 1));
+}
+
+
+int main(int argc, char * argv[]) {
+	gchar *  host           = g_strdup("127.0.0.1:3001");
+	gint     clients        = 50;
+	gint     duration       = 60;
+	gint     sample_seconds = 10;
+	gchar ** clips          = NULL;
+	gchar *  protocol       = NULL;
+	Bench    bench;
+	memset(&bench, 0, sizeof(bench));
+	bench.think_ms = 200;
+
+	GOptionEntry entries[] = {
+		{ "host",     0, 0, G_OPTION_ARG_STRING,         &host,           "Address of the player, default 127.0.0.1:3001", "HOST:PORT" },
+		{ "clients",  0, 0, G_OPTION_ARG_INT,            &clients,        "Concurrent websocket clients, default 50", "N" },
+		{ "duration", 0, 0, G_OPTION_ARG_INT,            &duration,       "Length of the run, default 60", "SECONDS" },
+		{ "think-ms", 0, 0, G_OPTION_ARG_INT,            &bench.think_ms, "Pause of each client between requests, default 200", "MS" },
+		{ "sample",   0, 0, G_OPTION_ARG_INT,            &sample_seconds, "Interval of memory samples, default 10", "SECONDS" },
+		{ "clip",     0, 0, G_OPTION_ARG_FILENAME_ARRAY, &clips,          "Clip to load and seek in, may be repeated", "FILE" },
+		{ "protocol", 0, 0, G_OPTION_ARG_STRING,         &protocol,       "Websocket subprotocol, " WIRE_PROTOCOL_JSON " or " WIRE_PROTOCOL_MSGPACK ", default none", "NAME" },
+		{ NULL }
+	};
+	GError * error = NULL;
+	GOptionContext * option_context = g_option_context_new("- load test for banana-player");
+	g_option_context_add_main_entries(option_context, entries, NULL);
+	if(!g_option_context_parse(option_context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(option_context);
+	if(clients < 1) {
+		g_printerr("At least one client is needed.\n");
+		return 1;
+	}
+
+	/* The player reports absolute uris, and loads absolute paths */
+	if(clips != NULL) {
+		for(gchar ** clip = clips; *clip != NULL; clip++) {
+			gchar * absolute = g_canonicalize_filename(*clip, NULL);
+			g_free(*clip);
+			*clip = g_filename_to_uri(absolute, NULL, NULL);
+			g_free(absolute);
+		}
+		bench.clips = clips;
+	}
+
+	if(protocol != NULL)
+		bench.protocols = g_strsplit(protocol, ",", -1);
+
+	bench.loop        = g_main_loop_new(NULL, FALSE);
+	bench.session     = soup_session_new_with_options(SOUP_SESSION_MAX_CONNS, clients + 8, SOUP_SESSION_MAX_CONNS_PER_HOST, clients + 8, NULL);
+	bench.url         = g_strdup_printf("ws://%s/ws", host);
+	bench.metrics_url = g_strdup_printf("http://%s/metrics", host);
+	bench.browse      = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	bench.load        = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	bench.seek        = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	bench.fanout      = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	bench.rss         = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	bench.started     = g_get_monotonic_time();
+
+	BenchClient * all = g_new0(BenchClient, clients);
+	for(gint i = 0; i < clients; i++) {
+		all[i].bench = &bench;
+		all[i].id    = i;
+		SoupMessage * msg = soup_message_new("GET", bench.url);
+		soup_session_websocket_connect_async(bench.session, msg, NULL, bench.protocols, NULL, (GAsyncReadyCallback)client_connected_cb, &all[i]);
+		g_object_unref(msg);
+	}
+
+	sample_rss_cb(&bench);
+	g_timeout_add_seconds(MAX(sample_seconds, 1), (GSourceFunc)sample_rss_cb, &bench);
+	g_timeout_add_seconds(duration, (GSourceFunc)stop_cb, &bench);
+	g_main_loop_run(bench.loop);
+
+	g_print("\n%d clients, %d seconds, %u failures\n", bench.connected, duration, bench.failures);
+	report("browse"        , bench.browse);
+	report("load->playing" , bench.load);
+	report("seek->done"    , bench.seek);
+	report("status fan-out", bench.fanout);
+	if(bench.rss->len >= 2) {
+		gdouble first  = g_array_index(bench.rss, gdouble, 0);
+		gdouble last   = g_array_index(bench.rss, gdouble, bench.rss->len - 1);
+		g_print("memory           %.1f MB -> %.1f MB, %+.1f MB (%+.1f MB/hour)\n", first / (1 << 20), last / (1 << 20), (last - first) / (1 << 20), (last - first) / (1 << 20) * 3600.0 / duration);
+	}
+
+	for(gint i = 0; i < clients; i++) {
+		if(all[i].connection != NULL)
+			soup_websocket_connection_close(all[i].connection, SOUP_WEBSOCKET_CLOSE_NORMAL, NULL);
+		g_free(all[i].root);
+		g_free(all[i].here);
+		g_free(all[i].waiting);
+	}
+	return bench.failures > 0 ? 2 : 0;
+}
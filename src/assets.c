@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include "assets.h"
+
+
+#define ASSET_RECHECK_INTERVAL (2 * G_TIME_SPAN_SECOND) /* how often a cached file is stat'ed again */
+#define ASSET_MAX_AGE          86400                    /* seconds clients may reuse anything but html */
+
+
+typedef enum {
+	ENCODING_IDENTITY,
+	ENCODING_GZIP,
+	ENCODING_BROTLI,
+	ENCODING_COUNT
+} Encoding;
+
+static const char * const encoding_names[ENCODING_COUNT] = { NULL, "gzip", "br" };
+
+
+typedef struct _Asset {
+	gchar *  file_path;
+	gchar *  content_type;
+	gchar *  cache_control;
+	gchar *  last_modified;
+	time_t   mtime;
+	off_t    size;
+	gint64   checked_at;              /* monotonic time of the last stat() */
+
+	GBytes * bodies[ENCODING_COUNT];  /* NULL if there is no such variant */
+	gchar *  etags [ENCODING_COUNT];
+} Asset;
+
+
+struct _AssetCache {
+	gchar *      root;
+	GHashTable * assets; /* request path -> Asset */
+};
+
+
+static void asset_free(Asset * asset) {
+	for(int i = 0; i < ENCODING_COUNT; i++) {
+		if(asset->bodies[i])
+			g_bytes_unref(asset->bodies[i]);
+		g_free(asset->etags[i]);
+	}
+	g_free(asset->file_path);
+	g_free(asset->content_type);
+	g_free(asset->cache_control);
+	g_free(asset->last_modified);
+	g_slice_free(Asset, asset);
+}
+
+
+static GBytes * read_file(const gchar * path) {
+	gchar * contents;
+	gsize   length;
+	if(!g_file_get_contents(path, &contents, &length, NULL))
+		return NULL;
+	return g_bytes_new_take(contents, length);
+}
+
+
+static GBytes * gzip_bytes(GBytes * input) {
+	GZlibCompressor * compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, 9);
+	GInputStream *    source     = g_memory_input_stream_new_from_bytes(input);
+	GInputStream *    stream     = g_converter_input_stream_new(source, G_CONVERTER(compressor));
+	GOutputStream *   output     = g_memory_output_stream_new_resizable();
+
+	GBytes * result = NULL;
+	if(g_output_stream_splice(output, stream, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, NULL) >= 0)
+		result = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(output));
+
+	g_object_unref(output);
+	g_object_unref(stream);
+	g_object_unref(source);
+	g_object_unref(compressor);
+	return result;
+}
+
+
+static gboolean is_compressible(const gchar * mime_type) {
+	return g_str_has_prefix(mime_type, "text/")
+	    || g_str_has_suffix(mime_type, "javascript")
+	    || g_str_has_suffix(mime_type, "json")
+	    || g_str_has_suffix(mime_type, "xml")
+	    || g_strcmp0(mime_type, "image/x-icon") == 0
+	    || g_strcmp0(mime_type, "image/vnd.microsoft.icon") == 0;
+}
+
+
+/* Uses `file_path'.gz or `file_path'.br if it exists and is not older than the file itself */
+static GBytes * read_precompressed(const gchar * file_path, const gchar * suffix, time_t mtime) {
+	gchar * path = g_strconcat(file_path, suffix, NULL);
+
+	struct stat st;
+	GBytes * result = NULL;
+	if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= mtime)
+		result = read_file(path);
+
+	g_free(path);
+	return result;
+}
+
+
+static Asset * asset_load(const gchar * file_path, const struct stat * st) {
+	GBytes * body = read_file(file_path);
+	if(body == NULL)
+		return NULL;
+
+	Asset * asset = g_slice_new0(Asset);
+	asset->file_path  = g_strdup(file_path);
+	asset->mtime      = st->st_mtime;
+	asset->size       = st->st_size;
+	asset->checked_at = g_get_monotonic_time();
+
+	gchar * content_type = g_content_type_guess(file_path, g_bytes_get_data(body, NULL), g_bytes_get_size(body), NULL);
+	asset->content_type = g_content_type_get_mime_type(content_type);
+	g_free(content_type);
+	if(asset->content_type == NULL)
+		asset->content_type = g_strdup("application/octet-stream");
+
+	/* html is the entry point and must pick up new versions, everything else may be reused for a while */
+	if(g_str_has_prefix(asset->content_type, "text/html"))
+		asset->cache_control = g_strdup("no-cache");
+	else
+		asset->cache_control = g_strdup_printf("public, max-age=%d", ASSET_MAX_AGE);
+
+	SoupDate * date = soup_date_new_from_time_t(st->st_mtime);
+	asset->last_modified = soup_date_to_string(date, SOUP_DATE_HTTP);
+	soup_date_free(date);
+
+	asset->bodies[ENCODING_IDENTITY] = body;
+	if(is_compressible(asset->content_type)) {
+		asset->bodies[ENCODING_GZIP  ] = read_precompressed(file_path, ".gz", st->st_mtime);
+		asset->bodies[ENCODING_BROTLI] = read_precompressed(file_path, ".br", st->st_mtime);
+		if(asset->bodies[ENCODING_GZIP] == NULL)
+			asset->bodies[ENCODING_GZIP] = gzip_bytes(body);
+	}
+
+	/* Strong ETags must differ between encodings of the same file */
+	gchar * checksum = g_compute_checksum_for_bytes(G_CHECKSUM_SHA1, body);
+	for(int i = 0; i < ENCODING_COUNT; i++) {
+		if(asset->bodies[i] == NULL)
+			continue;
+		if(i != ENCODING_IDENTITY && g_bytes_get_size(asset->bodies[i]) >= g_bytes_get_size(body)) {
+			g_bytes_unref(asset->bodies[i]);
+			asset->bodies[i] = NULL;
+			continue;
+		}
+		asset->etags[i] = i == ENCODING_IDENTITY ? g_strdup_printf("\"%s\"", checksum) : g_strdup_printf("\"%s-%s\"", checksum, encoding_names[i]);
+	}
+	g_free(checksum);
+
+	return asset;
+}
+
+
+AssetCache * asset_cache_new(const gchar * root) {
+	AssetCache * cache = g_slice_new0(AssetCache);
+	cache->root   = g_strdup(root);
+	cache->assets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)asset_free);
+	return cache;
+}
+
+
+void asset_cache_free(AssetCache * cache) {
+	g_hash_table_destroy(cache->assets);
+	g_free(cache->root);
+	g_slice_free(AssetCache, cache);
+}
+
+
+/* Returns the cached asset for `path', (re)loading it if it is new or changed on disk. On failure
+ * NULL is returned and the response status is set. */
+static Asset * asset_cache_lookup(AssetCache * cache, SoupMessage * msg, const char * path) {
+	Asset * asset = g_hash_table_lookup(cache->assets, path);
+	gint64  now   = g_get_monotonic_time();
+	if(asset != NULL && now - asset->checked_at < ASSET_RECHECK_INTERVAL)
+		return asset;
+
+	gchar * file_path = g_strdup_printf("%s%s", cache->root, path); /* path always starts with a '/' */
+
+	struct stat st;
+	if(stat(file_path, &st) == -1) {
+		if(errno == EPERM || errno == EACCES)
+			soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		else if(errno == ENOENT)
+			soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		else
+			soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		g_hash_table_remove(cache->assets, path);
+		g_free(file_path);
+		return NULL;
+	}
+
+	if(!S_ISREG(st.st_mode)) {
+		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
+		g_hash_table_remove(cache->assets, path);
+		g_free(file_path);
+		return NULL;
+	}
+
+	if(asset != NULL && asset->mtime == st.st_mtime && asset->size == st.st_size) {
+		asset->checked_at = now;
+		g_free(file_path);
+		return asset;
+	}
+
+	asset = asset_load(file_path, &st);
+	g_free(file_path);
+	if(asset == NULL) {
+		soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+		g_hash_table_remove(cache->assets, path);
+		return NULL;
+	}
+
+	g_hash_table_replace(cache->assets, g_strdup(path), asset);
+	return asset;
+}
+
+
+static gboolean accepts_encoding(SoupMessage * msg, const char * encoding) {
+	const char * header = soup_message_headers_get_list(msg->request_headers, "Accept-Encoding");
+	if(header == NULL)
+		return FALSE;
+
+	GSList * acceptable = soup_header_parse_quality_list(header, NULL);
+	gboolean accepted   = FALSE;
+	for(GSList * l = acceptable; l != NULL && !accepted; l = l->next)
+		accepted = g_ascii_strcasecmp(l->data, encoding) == 0;
+	soup_header_free_list(acceptable);
+	return accepted;
+}
+
+
+static gboolean is_not_modified(SoupMessage * msg, Asset * asset) {
+	const char * if_none_match = soup_message_headers_get_list(msg->request_headers, "If-None-Match");
+	if(if_none_match != NULL) {
+		if(strcmp(if_none_match, "*") == 0)
+			return TRUE;
+
+		GSList * etags   = soup_header_parse_list(if_none_match);
+		gboolean matches = FALSE;
+		for(GSList * l = etags; l != NULL && !matches; l = l->next)
+			for(int i = 0; i < ENCODING_COUNT && !matches; i++)
+				matches = asset->etags[i] != NULL && strcmp(l->data, asset->etags[i]) == 0;
+		soup_header_free_list(etags);
+		return matches;
+	}
+
+	const char * if_modified_since = soup_message_headers_get_one(msg->request_headers, "If-Modified-Since");
+	if(if_modified_since != NULL) {
+		SoupDate * date = soup_date_new_from_string(if_modified_since);
+		if(date != NULL) {
+			gboolean unmodified = soup_date_to_time_t(date) >= asset->mtime;
+			soup_date_free(date);
+			return unmodified;
+		}
+	}
+
+	return FALSE;
+}
+
+
+void asset_cache_serve(AssetCache * cache, SoupMessage * msg, const char * path) {
+	Asset * asset = asset_cache_lookup(cache, msg, path);
+	if(asset == NULL)
+		return;
+
+	Encoding encoding = ENCODING_IDENTITY;
+	if(asset->bodies[ENCODING_BROTLI] != NULL && accepts_encoding(msg, "br"))
+		encoding = ENCODING_BROTLI;
+	else if(asset->bodies[ENCODING_GZIP] != NULL && accepts_encoding(msg, "gzip"))
+		encoding = ENCODING_GZIP;
+
+	SoupMessageHeaders * headers = msg->response_headers;
+	soup_message_headers_replace(headers, "ETag"         , asset->etags[encoding]);
+	soup_message_headers_replace(headers, "Last-Modified", asset->last_modified);
+	soup_message_headers_replace(headers, "Cache-Control", asset->cache_control);
+	if(asset->bodies[ENCODING_GZIP] != NULL || asset->bodies[ENCODING_BROTLI] != NULL)
+		soup_message_headers_append(headers, "Vary", "Accept-Encoding");
+
+	if(is_not_modified(msg, asset)) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		return;
+	}
+
+	soup_message_headers_set_content_type(headers, asset->content_type, NULL);
+	if(encoding != ENCODING_IDENTITY)
+		soup_message_headers_replace(headers, "Content-Encoding", encoding_names[encoding]);
+
+	/* The body shares the cached bytes, HEAD requests get the headers only */
+	GBytes *     body   = asset->bodies[encoding];
+	SoupBuffer * buffer = soup_buffer_new_with_owner(g_bytes_get_data(body, NULL), g_bytes_get_size(body), g_bytes_ref(body), (GDestroyNotify)g_bytes_unref);
+	soup_message_body_append_buffer(msg->response_body, buffer);
+	soup_buffer_free(buffer);
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
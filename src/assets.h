@@ -0,0 +1,17 @@
+#ifndef BANANA_ASSETS_H
+#define BANANA_ASSETS_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+
+/* In-memory cache of the static files of the web interface. Files are loaded on first request
+ * and served with strong ETags, Last-Modified and Cache-Control headers, conditional requests
+ * are answered with 304, and gzip/brotli variants are picked according to Accept-Encoding. */
+typedef struct _AssetCache AssetCache;
+
+AssetCache * asset_cache_new  (const gchar * root);
+void         asset_cache_free (AssetCache * cache);
+void         asset_cache_serve(AssetCache * cache, SoupMessage * msg, const char * path);
+
+#endif
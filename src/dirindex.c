@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "dirindex.h"
+
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+
+static gint compare_names(gconstpointer a, gconstpointer b) {
+	return g_ascii_strcasecmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+
+static gint compare_files(gconstpointer a, gconstpointer b) {
+	const DirListingFile * fa = *(const DirListingFile * const *)a;
+	const DirListingFile * fb = *(const DirListingFile * const *)b;
+	return g_ascii_strcasecmp(fa->name, fb->name);
+}
+
+
+static void dir_listing_file_free(DirListingFile * file) {
+	g_free(file->name);
+	g_slice_free(DirListingFile, file);
+}
+
+
+/* Reads `path' from disk. This only uses thread-safe calls and shares no state, so it may be
+ * called from any thread. Every entry is stat'ed at most once; directories reported through
+ * d_type are not stat'ed at all. */
+DirListing * dir_listing_scan(const gchar * path, GError ** error) {
+	if(path == NULL || strlen(path) == 0 || path[strlen(path) - 1] != '/') {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "bad path for directory listing: %s", path);
+		return NULL;
+	}
+
+	DIR * dir = opendir(path);
+	if(dir == NULL) {
+		int saved_errno = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno), "cannot open directory `%s': %s", path, g_strerror(saved_errno));
+		return NULL;
+	}
+
+	DirListing * listing = g_slice_new0(DirListing);
+	listing->ref_count   = 1;
+	listing->path        = g_strdup(path);
+	listing->directories = g_ptr_array_new_with_free_func(g_free);
+	listing->files       = g_ptr_array_new_with_free_func((GDestroyNotify)dir_listing_file_free);
+
+	int dir_fd = dirfd(dir);
+	struct dirent * entry;
+	while((entry = readdir(dir)) != NULL) {
+		if(entry->d_name[0] == '.')
+			continue;
+
+		/* Symlinks and file systems without d_type support need a stat() to tell what they are */
+		if(entry->d_type == DT_DIR) {
+			g_ptr_array_add(listing->directories, g_strdup(entry->d_name));
+			continue;
+		}
+
+		struct stat st;
+		if(fstatat(dir_fd, entry->d_name, &st, 0) != 0)
+			continue;
+
+		if(S_ISDIR(st.st_mode))
+			g_ptr_array_add(listing->directories, g_strdup(entry->d_name));
+		else if(S_ISREG(st.st_mode)) {
+			DirListingFile * file = g_slice_new(DirListingFile);
+			file->name  = g_strdup(entry->d_name);
+			file->size  = st.st_size;
+			file->mtime = st.st_mtime;
+			g_ptr_array_add(listing->files, file);
+		}
+	}
+
+	closedir(dir);
+
+	g_ptr_array_sort(listing->directories, compare_names);
+	g_ptr_array_sort(listing->files      , compare_files);
+	return listing;
+}
+
+
+DirListing * dir_listing_ref(DirListing * listing) {
+	g_atomic_int_inc(&listing->ref_count);
+	return listing;
+}
+
+
+void dir_listing_unref(DirListing * listing) {
+	if(!g_atomic_int_dec_and_test(&listing->ref_count))
+		return;
+
+	g_free(listing->path);
+	g_ptr_array_unref(listing->directories);
+	g_ptr_array_unref(listing->files);
+	if(listing->reply)
+		wire_frame_unref(listing->reply);
+	g_slice_free(DirListing, listing);
+}
+
+
+typedef struct _DirIndexEntry {
+	DirListing * listing;
+	int          wd;       /* inotify watch descriptor, -1 if the directory is not watched */
+	GList *      lru_link; /* link in DirIndex.lru, data is the listing path */
+} DirIndexEntry;
+
+
+/* A directory being scanned. It is watched from before the scan starts, so changes made during the
+ * scan are not lost between reading the directory and caching the listing. */
+typedef struct _DirIndexScan {
+	gchar *  path;
+	int      wd;       /* -1 if the directory could not be watched */
+	gboolean stale;    /* something changed since the scan started */
+} DirIndexScan;
+
+
+struct _DirIndex {
+	GHashTable * entries;     /* path -> DirIndexEntry */
+	GHashTable * watches;     /* wd -> path (borrowed from the listing) */
+	GHashTable * scans;       /* path -> DirIndexScan */
+	GQueue       lru;         /* most recently used first */
+	guint        max_entries;
+
+	int          inotify_fd;
+	guint        inotify_source;
+};
+
+
+static void dir_index_entry_free(DirIndex * index, DirIndexEntry * entry) {
+	if(entry->wd >= 0) {
+		g_hash_table_remove(index->watches, GINT_TO_POINTER(entry->wd));
+		inotify_rm_watch(index->inotify_fd, entry->wd);
+	}
+	g_queue_delete_link(&index->lru, entry->lru_link);
+	dir_listing_unref(entry->listing);
+	g_slice_free(DirIndexEntry, entry);
+}
+
+
+static void dir_index_remove(DirIndex * index, const gchar * path) {
+	DirIndexEntry * entry = g_hash_table_lookup(index->entries, path);
+	if(entry == NULL)
+		return;
+
+	g_hash_table_steal(index->entries, path);
+	dir_index_entry_free(index, entry);
+}
+
+
+static void dir_index_scan_free(DirIndexScan * scan) {
+	g_free(scan->path);
+	g_slice_free(DirIndexScan, scan);
+}
+
+
+/* Marks the scans watching `wd' as stale, or all of them for -1 */
+static void dir_index_scans_changed(DirIndex * index, int wd) {
+	GHashTableIter iter;
+	gpointer       value;
+	g_hash_table_iter_init(&iter, index->scans);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		DirIndexScan * scan = value;
+		if(wd == -1 || scan->wd == wd)
+			scan->stale = TRUE;
+	}
+}
+
+
+static void dir_index_clear(DirIndex * index) {
+	while(!g_queue_is_empty(&index->lru))
+		dir_index_remove(index, g_queue_peek_head(&index->lru));
+}
+
+
+/* Handles the pending inotify events, returns FALSE if there were none */
+static gboolean dir_index_read_events(DirIndex * index) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	ssize_t length = read(index->inotify_fd, buffer, sizeof(buffer));
+	if(length <= 0)
+		return FALSE;
+
+	for(char * p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+		const struct inotify_event * event = (const struct inotify_event *)p;
+
+		/* Events were lost, so any listing may be stale */
+		if(event->mask & IN_Q_OVERFLOW) {
+			g_print("[IDX] inotify queue overflowed, dropping all listings\n");
+			dir_index_clear(index);
+			dir_index_scans_changed(index, -1);
+			continue;
+		}
+
+		if(g_hash_table_size(index->scans) > 0)
+			dir_index_scans_changed(index, event->wd);
+
+		const gchar * path = g_hash_table_lookup(index->watches, GINT_TO_POINTER(event->wd));
+		if(path == NULL)
+			continue;
+
+		if(event->mask & IN_IGNORED) {
+			/* The kernel already dropped the watch, make sure we do not remove it twice */
+			DirIndexEntry * entry = g_hash_table_lookup(index->entries, path);
+			g_hash_table_remove(index->watches, GINT_TO_POINTER(event->wd));
+			if(entry != NULL) {
+				entry->wd = -1;
+				dir_index_remove(index, entry->listing->path);
+			}
+			continue;
+		}
+
+		g_print("[IDX] invalidated %s\n", path);
+		dir_index_remove(index, path);
+	}
+
+	return TRUE;
+}
+
+
+static gboolean inotify_cb(GIOChannel * channel, GIOCondition condition, DirIndex * index) {
+	dir_index_read_events(index);
+	return TRUE;
+}
+
+
+DirIndex * dir_index_new(guint max_entries) {
+	DirIndex * index = g_slice_new0(DirIndex);
+	index->entries     = g_hash_table_new(g_str_hash, g_str_equal);
+	index->watches     = g_hash_table_new(g_direct_hash, g_direct_equal);
+	index->scans       = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)dir_index_scan_free);
+	index->max_entries = max_entries;
+	g_queue_init(&index->lru);
+
+	/* Without inotify we cannot know when a listing goes stale, so we simply do not cache */
+	index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(index->inotify_fd == -1)
+		g_printerr("[ERR] inotify unavailable, directory listings will not be cached: %s\n", g_strerror(errno));
+	else {
+		GIOChannel * channel = g_io_channel_unix_new(index->inotify_fd);
+		index->inotify_source = g_io_add_watch(channel, G_IO_IN, (GIOFunc)inotify_cb, index);
+		g_io_channel_unref(channel);
+	}
+
+	return index;
+}
+
+
+void dir_index_free(DirIndex * index) {
+	dir_index_clear(index);
+	g_hash_table_destroy(index->scans);
+
+	if(index->inotify_source)
+		g_source_remove(index->inotify_source);
+	if(index->inotify_fd != -1)
+		close(index->inotify_fd);
+
+	g_hash_table_destroy(index->entries);
+	g_hash_table_destroy(index->watches);
+	g_slice_free(DirIndex, index);
+}
+
+
+/* Returns the cached listing of `path' (borrowed), or NULL on a cache miss */
+DirListing * dir_index_lookup(DirIndex * index, const gchar * path) {
+	DirIndexEntry * entry = g_hash_table_lookup(index->entries, path);
+	if(entry == NULL)
+		return NULL;
+
+	g_queue_unlink(&index->lru, entry->lru_link);
+	g_queue_push_head_link(&index->lru, entry->lru_link);
+	return entry->listing;
+}
+
+
+/* Starts watching `path' before it is scanned, so nothing that changes during the scan goes
+ * unnoticed. Every scan begun must end with dir_index_insert() or dir_index_abort_scan(). */
+void dir_index_begin_scan(DirIndex * index, const gchar * path) {
+	if(index->inotify_fd == -1 || index->max_entries == 0 || g_hash_table_contains(index->scans, path))
+		return;
+
+	DirIndexScan * scan = g_slice_new0(DirIndexScan);
+	scan->path = g_strdup(path);
+	scan->wd   = inotify_add_watch(index->inotify_fd, path, WATCH_MASK);
+	if(scan->wd == -1)
+		g_printerr("[ERR] cannot watch `%s': %s\n", path, g_strerror(errno));
+	g_hash_table_insert(index->scans, scan->path, scan);
+}
+
+
+/* Ends the scan of `path', keeping its watch only if the listing is to be cached. Returns FALSE
+ * if it must not be, because the directory changed or could not be watched. */
+static gboolean dir_index_end_scan(DirIndex * index, const gchar * path, gboolean cache) {
+	/* Events the main loop has not got to yet count too */
+	while(dir_index_read_events(index))
+		;
+
+	DirIndexScan * scan = g_hash_table_lookup(index->scans, path);
+	if(scan == NULL)
+		return FALSE;
+
+	gboolean fresh = !scan->stale && scan->wd != -1;
+	g_hash_table_steal(index->scans, path);
+
+	/* The watch may be shared with a cached alias or another scan of the same directory */
+	gboolean shared = scan->wd == -1 || g_hash_table_contains(index->watches, GINT_TO_POINTER(scan->wd));
+	GHashTableIter iter;
+	gpointer       value;
+	g_hash_table_iter_init(&iter, index->scans);
+	while(!shared && g_hash_table_iter_next(&iter, NULL, &value))
+		shared = ((DirIndexScan *)value)->wd == scan->wd;
+	if(!shared && !(cache && fresh))
+		inotify_rm_watch(index->inotify_fd, scan->wd);
+
+	dir_index_scan_free(scan);
+	return fresh;
+}
+
+
+void dir_index_abort_scan(DirIndex * index, const gchar * path) {
+	dir_index_end_scan(index, path, FALSE);
+}
+
+
+/* Adds a freshly scanned listing to the cache, replacing any previous listing of the same path.
+ * The index takes its own reference. Listings of directories that changed while they were being
+ * scanned are not cached. */
+void dir_index_insert(DirIndex * index, DirListing * listing) {
+	if(index->inotify_fd == -1 || index->max_entries == 0)
+		return;
+
+	dir_index_remove(index, listing->path);
+	if(!dir_index_end_scan(index, listing->path, TRUE)) {
+		g_print("[IDX] %s changed while it was scanned, not cached\n", listing->path);
+		return;
+	}
+
+	int wd = inotify_add_watch(index->inotify_fd, listing->path, WATCH_MASK);
+	if(wd == -1) {
+		g_printerr("[ERR] cannot watch `%s': %s\n", listing->path, g_strerror(errno));
+		return;
+	}
+
+	/* Another spelling of the same directory shares the watch, so it must not remove it */
+	const gchar * aliased = g_hash_table_lookup(index->watches, GINT_TO_POINTER(wd));
+	if(aliased != NULL) {
+		DirIndexEntry * entry = g_hash_table_lookup(index->entries, aliased);
+		g_hash_table_remove(index->watches, GINT_TO_POINTER(wd));
+		entry->wd = -1;
+		dir_index_remove(index, aliased);
+	}
+
+	/* Evict the least recently used directories to stay within bounds */
+	while(g_hash_table_size(index->entries) >= index->max_entries)
+		dir_index_remove(index, g_queue_peek_tail(&index->lru));
+
+	DirIndexEntry * entry = g_slice_new(DirIndexEntry);
+	entry->listing = dir_listing_ref(listing);
+	entry->wd      = wd;
+	g_queue_push_head(&index->lru, listing->path);
+	entry->lru_link = g_queue_peek_head_link(&index->lru);
+
+	g_hash_table_insert(index->entries, listing->path, entry);
+	g_hash_table_insert(index->watches, GINT_TO_POINTER(wd), listing->path);
+}
+
+
+/* Returns a new reference to the listing of `path', reading it from disk only on a cache miss */
+DirListing * dir_index_get(DirIndex * index, const gchar * path, GError ** error) {
+	DirListing * listing = dir_index_lookup(index, path);
+	if(listing != NULL)
+		return dir_listing_ref(listing);
+
+	dir_index_begin_scan(index, path);
+	listing = dir_listing_scan(path, error);
+	if(listing != NULL)
+		dir_index_insert(index, listing);
+	else
+		dir_index_abort_scan(index, path);
+	return listing;
+}
+
+
+/* Drops `path' from the cache, e.g. because the caller knows it changed */
+void dir_index_invalidate(DirIndex * index, const gchar * path) {
+	dir_index_remove(index, path);
+}
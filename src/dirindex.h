@@ -0,0 +1,47 @@
+#ifndef BANANA_DIRINDEX_H
+#define BANANA_DIRINDEX_H
+
+#include <glib.h>
+
+#include "wire.h"
+
+
+/* A single regular file inside a directory listing */
+typedef struct _DirListingFile {
+	gchar * name;
+	gint64  size;
+	gint64  mtime;
+} DirListingFile;
+
+
+/* The sorted contents of one directory. Listings are immutable once scanned (except for the
+ * lazily built `browse' reply) and reference counted, so they can be handed around freely. */
+typedef struct _DirListing {
+	gint        ref_count;
+	gchar *     path;        /* always ends with a '/' */
+	GPtrArray * directories; /* gchar *, sorted case-insensitively */
+	GPtrArray * files;       /* DirListingFile *, sorted case-insensitively */
+	WireFrame * reply;       /* `browse' reply, owned by whoever builds it */
+} DirListing;
+
+
+DirListing * dir_listing_scan (const gchar * path, GError ** error);
+DirListing * dir_listing_ref  (DirListing * listing);
+void         dir_listing_unref(DirListing * listing);
+
+
+/* Cache of directory listings keyed by path. Cached directories are watched with inotify and
+ * dropped from the cache as soon as anything inside them changes, so a cache hit never needs
+ * to touch the disk. Must only be used from the main context. */
+typedef struct _DirIndex DirIndex;
+
+DirIndex *   dir_index_new       (guint max_entries);
+void         dir_index_free      (DirIndex * index);
+DirListing * dir_index_lookup    (DirIndex * index, const gchar * path); /* borrowed */
+void         dir_index_begin_scan(DirIndex * index, const gchar * path);
+void         dir_index_abort_scan(DirIndex * index, const gchar * path);
+void         dir_index_insert    (DirIndex * index, DirListing * listing); /* ends the scan begun for it */
+DirListing * dir_index_get       (DirIndex * index, const gchar * path, GError ** error); /* new reference */
+void         dir_index_invalidate(DirIndex * index, const gchar * path);
+
+#endif
@@ -0,0 +1,221 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+#include <cairo.h>
+
+#include "idle.h"
+
+
+#define PI 3.14159265358979323846
+
+#define SCREEN_WIDTH   32
+#define SCREEN_HEIGHT  18
+#define SCREEN_PIXELS  (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define STEPS          120 /* gradient and noise frames per minute */
+
+
+struct _IdleRenderer {
+	cairo_surface_t *      screen;   /* the low resolution picture, scaled up when drawing */
+	cairo_surface_t *      vignette; /* static, darkens the top and bottom */
+	cairo_surface_t *      noise;    /* rewritten in place for every frame */
+	cairo_surface_t *      mask;     /* rounded corners of one big pixel, depends on the widget size */
+	int                    mask_width;
+	int                    mask_height;
+	cairo_font_options_t * font_options;
+
+	gint64                 frame;    /* minute * STEPS + step of the current picture, -1 if none */
+
+	/* Noise is a per-pixel sine wave with a random phase and speed. Phases are kept in 8.8 fixed
+	 * point units of 1/256 turn, so a frame is one add and one table lookup per pixel. */
+	uint16_t               noise_phase[SCREEN_PIXELS];
+	uint16_t               noise_speed[SCREEN_PIXELS]; /* phase advance per step */
+	uint8_t                noise_alpha[256];           /* premultiplied alpha for each phase */
+};
+
+
+static void cairo_pattern_add_color_stop_hsva(cairo_pattern_t * pattern, double stop, double h, double s, double v, double a) {
+	h = fmod(fmod(h, 360.0) + 360.0, 360.0);
+    double c = v * s;
+    double x = c * (1.0 - fabs(fmod(h / 60.0, 2) - 1.0));
+    double m = v - c;
+    double r, g, b;
+         if(h >=   0.0 && h <  60.0) { r = c + m; g = x + m; b =     m; }
+    else if(h >=  60.0 && h < 120.0) { r = x + m; g = c + m; b =     m; }
+    else if(h >= 120.0 && h < 180.0) { r =     m; g = c + m; b = x + m; }
+    else if(h >= 180.0 && h < 240.0) { r =     m; g = x + m; b = c + m; }
+    else if(h >= 240.0 && h < 300.0) { r = x + m; g =     m; b = c + m; }
+    else if(h >= 300.0 && h < 360.0) { r = c + m; g =     m; b = x + m; }
+    else                             { r =     m; g =     m; b =     m; }
+	cairo_pattern_add_color_stop_rgba(pattern, stop, r, g, b, a);
+}
+
+
+IdleRenderer * idle_renderer_new(void) {
+	IdleRenderer * renderer = g_slice_new0(IdleRenderer);
+	renderer->screen = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, SCREEN_WIDTH, SCREEN_HEIGHT);
+	renderer->noise  = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, SCREEN_WIDTH, SCREEN_HEIGHT);
+	renderer->frame  = -1;
+
+	renderer->vignette = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, SCREEN_WIDTH, SCREEN_HEIGHT);
+	cairo_t * context = cairo_create(renderer->vignette);
+	cairo_pattern_t * gradient = cairo_pattern_create_linear(0.0, 0.0, 0.0, SCREEN_HEIGHT);
+	cairo_pattern_add_color_stop_rgba(gradient, 0.0, 0.0, 0.0, 0.0, 0.8);
+	cairo_pattern_add_color_stop_rgba(gradient, 0.3, 0.0, 0.0, 0.0, 0.0);
+	cairo_pattern_add_color_stop_rgba(gradient, 0.7, 0.0, 0.0, 0.0, 0.0);
+	cairo_pattern_add_color_stop_rgba(gradient, 1.0, 0.0, 0.0, 0.0, 0.8);
+	cairo_rectangle(context, 0.0, 0.0, SCREEN_WIDTH, SCREEN_HEIGHT);
+	cairo_set_source(context, gradient);
+	cairo_fill(context);
+	cairo_pattern_destroy(gradient);
+	cairo_destroy(context);
+
+	renderer->font_options = cairo_font_options_create();
+	cairo_font_options_set_antialias(renderer->font_options, CAIRO_ANTIALIAS_NONE);
+
+	/* Same pseudo random sequence as always, so the noise looks just like before */
+	uint32_t seed = 123456789;
+	for(int i = 0; i < SCREEN_PIXELS; i++) {
+		int32_t s = (int32_t)seed;
+		double  k = (s % 10 + 10) * 0.1;
+		renderer->noise_phase[i] = (uint16_t)lround(fmod(fmod((double)s, 2.0 * PI) + 2.0 * PI, 2.0 * PI) / (2.0 * PI) * 65536.0);
+		renderer->noise_speed[i] = (uint16_t)lround(k * 65536.0 / STEPS);
+		seed = 1103515245u * seed + 12345u;
+	}
+	for(int i = 0; i < 256; i++) {
+		double a = 1.0 + sin(i * 2.0 * PI / 256.0) * 0.5;
+		renderer->noise_alpha[i] = (uint8_t)(a * 0.05 * 255.0);
+	}
+
+	return renderer;
+}
+
+
+void idle_renderer_free(IdleRenderer * renderer) {
+	cairo_surface_destroy(renderer->screen);
+	cairo_surface_destroy(renderer->vignette);
+	cairo_surface_destroy(renderer->noise);
+	if(renderer->mask)
+		cairo_surface_destroy(renderer->mask);
+	cairo_font_options_destroy(renderer->font_options);
+	g_slice_free(IdleRenderer, renderer);
+}
+
+
+static void idle_renderer_render_noise(IdleRenderer * renderer, int step) {
+	cairo_surface_flush(renderer->noise);
+	uint8_t * data   = cairo_image_surface_get_data(renderer->noise);
+	int       stride = cairo_image_surface_get_stride(renderer->noise);
+
+	for(int y = 0; y < SCREEN_HEIGHT; y++) {
+		uint32_t *       row   = (uint32_t *)(data + stride * y);
+		const uint16_t * phase = renderer->noise_phase + y * SCREEN_WIDTH;
+		const uint16_t * speed = renderer->noise_speed + y * SCREEN_WIDTH;
+		for(int x = 0; x < SCREEN_WIDTH; x++) {
+			uint16_t angle = (uint16_t)(phase[x] + speed[x] * step);
+			row[x] = renderer->noise_alpha[angle >> 8] * 0x01010101u; /* cairo expects premultiplied alpha */
+		}
+	}
+
+	cairo_surface_mark_dirty(renderer->noise);
+}
+
+
+static void idle_renderer_render(IdleRenderer * renderer, GDateTime * datetime, int step) {
+	double    seconds01 = (double)step / STEPS;
+	cairo_t * context   = cairo_create(renderer->screen);
+
+	cairo_pattern_t * gradient = cairo_pattern_create_linear(0.0, 0.0, SCREEN_WIDTH, SCREEN_HEIGHT);
+	cairo_pattern_add_color_stop_hsva(gradient, 0.0, seconds01 * 360.0        , 1.0, 0.4, 1.0);
+	cairo_pattern_add_color_stop_hsva(gradient, 1.0, seconds01 * 360.0 + 120.0, 1.0, 0.4, 1.0);
+	cairo_rectangle(context, 0.0, 0.0, SCREEN_WIDTH, SCREEN_HEIGHT);
+	cairo_set_source(context, gradient);
+	cairo_fill(context);
+	cairo_pattern_destroy(gradient);
+
+	cairo_set_source_surface(context, renderer->vignette, 0.0, 0.0);
+	cairo_paint(context);
+
+	idle_renderer_render_noise(renderer, step);
+	cairo_set_source_surface(context, renderer->noise, 0.0, 0.0);
+	cairo_paint(context);
+
+	cairo_select_font_face(context, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+	cairo_set_font_options(context, renderer->font_options);
+	cairo_move_to(context, 2.0, 13.0);
+	cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 0.4);
+	gchar * time_str = g_date_time_format(datetime, "%H:%M");
+	cairo_show_text(context, time_str);
+	g_free(time_str);
+
+	cairo_destroy(context);
+}
+
+
+/* Renders a new frame if the clock moved on to the next step. Returns TRUE if the picture
+ * changed and the widget needs to be redrawn. */
+gboolean idle_renderer_update(IdleRenderer * renderer) {
+	GDateTime * datetime = g_date_time_new_now_local();
+	int         step     = (int)(g_date_time_get_seconds(datetime) / 60.0 * STEPS) % STEPS;
+	gint64      frame    = (g_date_time_to_unix(datetime) + g_date_time_get_utc_offset(datetime) / G_TIME_SPAN_SECOND) / 60 * STEPS + step;
+
+	gboolean changed = frame != renderer->frame;
+	if(changed) {
+		idle_renderer_render(renderer, datetime, step);
+		renderer->frame = frame;
+	}
+
+	g_date_time_unref(datetime);
+	return changed;
+}
+
+
+static void idle_renderer_update_mask(IdleRenderer * renderer, int width, int height) {
+	if(renderer->mask != NULL && renderer->mask_width == width && renderer->mask_height == height)
+		return;
+
+	if(renderer->mask != NULL)
+		cairo_surface_destroy(renderer->mask);
+	renderer->mask        = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	renderer->mask_width  = width;
+	renderer->mask_height = height;
+
+	cairo_t * context = cairo_create(renderer->mask);
+	cairo_arc(context, 4.0, 4.0, 3.0, 1.0 * PI, 1.5 * PI);
+	cairo_arc(context, width - 4.0, 4.0, 3.0, 1.5 * PI, 2.0 * PI);
+	cairo_arc(context, width - 4.0, height - 4.0, 3.0, 2.0 * PI, 0.5 * PI);
+	cairo_arc(context, 4.0, height - 4.0, 3.0, 0.5 * PI, 1.0 * PI);
+	cairo_line_to(context, 1.0, 4.0);
+	cairo_line_to(context, 0.0, 4.0);
+	cairo_line_to(context, 0.0, height);
+	cairo_line_to(context, width, height);
+	cairo_line_to(context, width, 0.0);
+	cairo_line_to(context, 0.0, 0.0);
+	cairo_line_to(context, 0.0, 4.0);
+	cairo_set_source_rgb(context, 0.0, 0.0, 0.0);
+	cairo_fill(context);
+	cairo_destroy(context);
+}
+
+
+/* Scales the current frame up to `width' x `height' and draws it onto `cr' */
+void idle_renderer_draw(IdleRenderer * renderer, cairo_t * cr, int width, int height) {
+	if(renderer->frame == -1)
+		idle_renderer_update(renderer);
+
+	cairo_save(cr);
+	cairo_scale(cr, (double)width / SCREEN_WIDTH, (double)height / SCREEN_HEIGHT);
+	cairo_set_source_surface(cr, renderer->screen, 0.0, 0.0);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+	cairo_rectangle(cr, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+	cairo_fill(cr);
+	cairo_restore(cr);
+
+	/* The mask is only rebuilt when the widget is resized */
+	idle_renderer_update_mask(renderer, width / SCREEN_WIDTH, height / SCREEN_HEIGHT);
+	cairo_set_source_surface(cr, renderer->mask, 0.0, 0.0);
+	cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REPEAT);
+	cairo_rectangle(cr, 0, 0, width, height);
+	cairo_fill(cr);
+}
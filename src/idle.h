@@ -0,0 +1,18 @@
+#ifndef BANANA_IDLE_H
+#define BANANA_IDLE_H
+
+#include <glib.h>
+#include <cairo.h>
+
+
+/* The animated clock shown while nothing is playing. Everything that does not change between
+ * frames is kept around, and a new frame is only rendered when the displayed minute or the
+ * gradient step changes. */
+typedef struct _IdleRenderer IdleRenderer;
+
+IdleRenderer * idle_renderer_new   (void);
+void           idle_renderer_free  (IdleRenderer * renderer);
+gboolean       idle_renderer_update(IdleRenderer * renderer);
+void           idle_renderer_draw  (IdleRenderer * renderer, cairo_t * cr, int width, int height);
+
+#endif
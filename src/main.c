@@ -1,5 +1,6 @@
 #include <dirent.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,9 +9,13 @@
 #include <math.h>
 #include <unistd.h>
 
+#include <glib-unix.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <gst/gst.h>
 #include <gst/video/videooverlay.h>
+#include <gst/video/gstvideodecoder.h>
+#include <gst/net/gstnettimeprovider.h>
 
 /* We need access to the underlying Window IDs */
 #include <gdk/gdk.h>
@@ -27,8 +32,63 @@
 #include <libsoup/soup.h>
 #include <libsoup/soup-websocket.h>
 
-
-#define PI 3.14159265358979323846
+#include "assets.h"
+#include "dirindex.h"
+#include "idle.h"
+#include "media.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "playqueue.h"
+#include "readahead.h"
+#include "resume.h"
+#include "search.h"
+#include "sync.h"
+#include "thumbs.h"
+#include "variants.h"
+#include "watchalong.h"
+#include "wire.h"
+#include "workers.h"
+
+
+#define DIR_INDEX_MAX_ENTRIES 256
+#define BROWSE_PAGE_MAX       1000 /* upper bound for the `limit' of a paged listing */
+#define BROWSE_STREAM_CHUNK   200  /* default number of entries per streamed listing chunk */
+#define SEARCH_RESULTS        100  /* default number of results of a `search' */
+#define STATUS_TICK_MS        500  /* default interval of position updates */
+#define CLIENT_WINDOW         8    /* unacknowledged frames per websocket client */
+#define CLIENT_OUTBOX_MAX     64   /* queued replies per websocket client */
+#define COMMAND_FAST_PATH_MAX 512  /* requests up to this size are parsed on the main loop */
+#define FS_WORKERS            2    /* threads for directory scans */
+#define MEDIA_MAX_STREAMS     4    /* parallel HTTP media streams */
+#define METADATA_DISCOVERERS  2    /* files probed for metadata in parallel */
+#define THUMB_WORKERS         1    /* previews generated in parallel */
+#define RATE_MIN              0.5  /* slowest playback rate with audio */
+#define RATE_MAX              2.0  /* fastest playback rate with audio, anything beyond is a scan */
+#define SCAN_MAX              16.0 /* fastest scan, forward or reverse */
+#define QOS_WINDOW_MS         2000 /* interval over which dropped frames are counted */
+#define QOS_DROPS_DOWN        5    /* dropped frames per window that count as falling behind */
+#define QOS_WINDOWS_DOWN      2    /* windows in a row falling behind before decoding is reduced */
+#define QOS_WINDOWS_UP        15   /* windows in a row without drops before it is raised again */
+#define QOS_LEVEL_MAX         3
+#define READAHEAD_MB          64   /* default read-ahead of the file being played */
+#define PREFETCH_MB           16   /* default prefetch of the next queued file */
+#define READAHEAD_RESUME      25   /* percent of the read-ahead to refill before playback resumes */
+#define READAHEAD_TICK_MS     250  /* interval of stall checks */
+#define RESUME_MIN            (30 * GST_SECOND) /* positions closer to the start are not worth keeping */
+#define RESUME_END_PERCENT    5    /* files stopped this close to the end count as finished */
+#define RESUME_TICK_SECONDS   1    /* interval at which the position of the playing file is noted */
+#define LAG_PROBE_MS          250  /* interval of the main loop lag probe */
+#define HTTP_PORT             3001 /* default port of the web interface and websocket */
+#define SYNC_TOLERANCE        (10 * GST_MSECOND)  /* followers further off than this resynchronize */
+#define SYNC_LEAD             (750 * GST_MSECOND) /* time a follower takes to seek and preroll */
+#define WATCH_SEGMENTS        6    /* segments of the watch-along stream kept for viewers */
+#define WATCH_SEGMENT_SECONDS 2
+#define WATCH_TICK_MS         250  /* interval at which the watch-along stream follows playback */
+#define VARIANT_CACHE_MB      4096 /* default size of the cache of lighter variants */
+
+#define PLAY_FLAG_VIDEO             (1 << 0)  /* from GstPlayFlags, which is not public */
+#define PLAY_FLAG_DEINTERLACE       (1 << 9)
+#define PLAY_FLAG_SOFT_COLORBALANCE (1 << 10)
 
 
 /* Structure to contain all our information, so we can pass it around */
@@ -36,17 +96,117 @@ typedef struct _CustomData {
 	GstElement * pipeline;
 	GstElement * playbin;
 
-	GtkWidget * main_window;
-	GtkWidget * video_widget;
-
-	GList * websockets;
+	GtkWidget *    main_window;  /* NULL when headless */
+	GtkWidget *    video_widget; /* NULL when headless */
+	IdleRenderer * idle;         /* NULL when headless */
+	GMainLoop *    loop;         /* runs instead of gtk_main() when headless */
+
+	GList *      websockets;
+	PlayQueue *  queue;      /* what to play next */
+	AssetCache *  assets;    /* static files of the web interface */
+	MediaServer * media;     /* streams the media files over HTTP */
+	MetadataIndex * metadata; /* durations, codecs and tags of the media files */
+	ThumbService *  thumbs;   /* preview images of the videos */
+	SearchIndex *   search;   /* every name below the root, for `search' */
+
+	DirIndex *   dir_index;  /* cached directory listings for `browse' */
+	GHashTable * scans;      /* path -> ScanJob, directories being read for `browse' */
+	WorkerPool * fs_pool;    /* threads for filesystem access */
+	WorkerPool * parse_pool; /* threads for parsing large requests */
+	WireFrame *  status;     /* latest status snapshot, shared by all websockets */
 
 	gchar *  root_dir;
-	GstState state;    /* Current state of the pipeline */
-	gint64   duration; /* Duration of the clip, in nanoseconds */
+	gchar *  cache_dir; /* where indexes and other derived data are kept */
+	gint     tick_ms;   /* Interval of position updates pushed to clients, 0 disables them */
+
+	/* Player state as reported by the bus, so nobody ever has to block on the pipeline */
+	GstState state;     /* Current state of the pipeline */
+	gint64   duration;  /* Duration of the clip, in nanoseconds */
+	gint64   position;  /* Position in the last status snapshot, in nanoseconds */
+	gint     buffering; /* Buffer fill level in percent */
+	gboolean buffering_paused; /* we paused until the buffers are full again */
+
+	/* Loads */
+	gboolean warm_load;     /* switch files inside the running pipeline instead of going through READY */
+	gboolean last_was_warm; /* whether the last load took the warm path */
+	gint64   load_started;  /* monotonic time of the last load, in microseconds */
+	guint    loads;         /* loads started so far, lets clients tell when theirs is playing */
+	gint     ttff_pending;  /* set while the first video buffer after a load has not reached the sink, atomic */
+	gint     ttff_audio_pending; /* the same for audio, atomic */
+	gint64   ttff_audio;    /* microseconds until the first audio buffer, -1 if none yet */
+	gint     ttff_ms;       /* time to first frame of the last load, -1 if unknown */
+
+	/* Seeks: only one is in flight at a time, requests arriving meanwhile replace the pending one */
+	gboolean     seeking;      /* a flushing seek has not completed yet */
+	guint        seeks_done;   /* seeks completed so far, lets clients tell when theirs is done */
+	gboolean     seek_pending; /* seek_target still has to be issued */
+	gint64       seek_target;  /* position of the latest requested seek, -1 if none */
+	GstSeekFlags seek_flags;   /* flags of the pending seek */
+	gdouble      rate;         /* playback rate, negative for reverse scans */
+
+	/* Adaptive decoding, for files that are too much for the board */
+	GstElement * video_sink;
+	guint        play_flags;   /* flags of playbin before any post-processing was turned off */
+	gint         qos_level;    /* 0 decodes everything, each level trades quality for speed, atomic */
+	gint         qos_dropped;  /* video frames dropped in the current window */
+	guint64      qos_sink_dropped; /* running count last reported by the video sink */
+	gint         qos_streak;   /* windows in a row falling behind (> 0) or keeping up (< 0) */
+
+	/* Audio-only mode, for music with the screen off */
+	gint         audio_only;     /* video is neither decoded nor rendered, atomic */
+	guint        refresh_source; /* the refresh_ui timer, 0 while suspended */
+
+	/* Read-ahead of local files, which playbin does not buffer at all */
+	ReadAhead *  readahead;         /* NULL if disabled */
+	gboolean     readahead_waiting; /* paused on a stall until enough has been read again */
+
+	/* Resume points */
+	ResumeStore * resume;
+	gint64        resume_target; /* where to seek to once the load has prerolled, -1 if nowhere */
+	gboolean      resuming;      /* the seek to the resume point is in flight */
+
+	Metrics *     metrics;       /* served at /metrics */
+	gint64        lag_probed;    /* monotonic time the lag probe last ran */
+	gint          port;          /* of the web interface and websocket */
+
+	/* Playback in lockstep with other players, see sync.h */
+	GstNetTimeProvider * clock_provider; /* we are the master, NULL otherwise */
+	gint           sync_clock_port;      /* where the master publishes its clock */
+	SyncFollower * follower;             /* we follow a master, NULL otherwise */
+	GstClock *     sync_clock;           /* shared clock, owned by the master, borrowed by followers */
+	gint           sync_stage;           /* SYNC_IDLE, or how far a follower got with a resync */
+	gboolean       sync_playing;         /* as of the last sync message of the master */
+	gint64         sync_position;        /* stream position of the master at sync_time */
+	gint64         sync_time;            /* in the shared clock */
+	gdouble        sync_rate;
+	gint64         sync_base_time;       /* base time a follower starts at once it prerolled */
+	gint64         sync_skew;            /* our position minus the master's, G_MININT64 if unknown */
+
+	WatchAlong *   watch;                /* re-streams what plays at /live, NULL if disabled */
+	VariantCache * variants;             /* lighter variants of heavy files, NULL if disabled */
 } CustomData;
 
 
+enum {
+	SYNC_IDLE,    /* in step, or not following */
+	SYNC_PREROLL, /* loading the master's uri */
+	SYNC_SEEK     /* seeking to where the master will be once we are ready */
+};
+
+
+static void broadcast_status(CustomData * data);
+static void broadcast_queue (CustomData * data);
+static void play_item       (CustomData * data, gint index);
+static void set_rate        (CustomData * data, gdouble rate);
+static void seek_to         (CustomData * data, gint64 position, gboolean accurate);
+static void seek_issue      (CustomData * data);
+static void seek_reset      (CustomData * data);
+static void resume_remember (CustomData * data);
+static void resume_cancel   (CustomData * data);
+static void broadcast_sync  (CustomData * data);
+static void sync_async_done (CustomData * data);
+
+
 /* This function is called when the GUI toolkit creates the physical window that will hold the video.
  * At this point we can retrieve its handler(which has a different meaning depending on the windowing system)
  * and pass it to GStreamer through the XOverlay interface. */
@@ -70,131 +230,43 @@ static void realize_cb(GtkWidget * widget, CustomData * data) {
 }
 
 
+static void quit(CustomData * data) {
+	resume_remember(data);
+	gst_element_set_state (data->pipeline, GST_STATE_READY);
+	if(data->loop != NULL)
+		g_main_loop_quit(data->loop);
+	else
+		gtk_main_quit();
+}
+
+
 /* This function is called when the main window is closed */
 static void delete_event_cb(GtkWidget * widget, GdkEvent * event, CustomData * data) {
-	gst_element_set_state (data->pipeline, GST_STATE_READY);
-	gtk_main_quit();
+	quit(data);
 }
 
 
-static void cairo_pattern_add_color_stop_hsva(cairo_pattern_t * pattern, double stop, double h, double s, double v, double a) {
-	h = fmod(fmod(h, 360.0) + 360.0, 360.0);
-    double c = v * s;
-    double x = c * (1.0 - fabs(fmod(h / 60.0, 2) - 1.0));
-    double m = v - c;
-    double r, g, b;
-         if(h >=   0.0 && h <  60.0) { r = c + m; g = x + m; b =     m; }
-    else if(h >=  60.0 && h < 120.0) { r = x + m; g = c + m; b =     m; }
-    else if(h >= 120.0 && h < 180.0) { r =     m; g = c + m; b = x + m; }
-    else if(h >= 180.0 && h < 240.0) { r =     m; g = x + m; b = c + m; }
-    else if(h >= 240.0 && h < 300.0) { r = x + m; g =     m; b = c + m; }
-    else if(h >= 300.0 && h < 360.0) { r = c + m; g =     m; b = x + m; }
-    else                             { r =     m; g =     m; b =     m; }
-	cairo_pattern_add_color_stop_rgba(pattern, stop, r, g, b, a);
+/* SIGINT and SIGTERM shut down as cleanly as closing the window, which is the only way to stop a
+ * headless player */
+static gboolean quit_signal_cb(CustomData * data) {
+	quit(data);
+	return G_SOURCE_REMOVE;
 }
 
 
 /* This function is called everytime the video window needs to be redrawn(due to damage/exposure,
  * rescaling, etc). GStreamer takes care of this in the PAUSED and PLAYING states, otherwise,
- * we simply draw a black rectangle to avoid garbage showing up. */
+ * we draw the idle screen to avoid garbage showing up. */
 static gboolean draw_cb(GtkWidget * widget, cairo_t * cr, CustomData * data) {
-	if(data->state < GST_STATE_PAUSED) {
+	/* Nobody is watching in audio-only mode, plain black is all it takes */
+	if(data->audio_only) {
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		cairo_paint(cr);
+	}
+	else if(data->state < GST_STATE_PAUSED) {
 		GtkAllocation allocation;
-
-		/* Cairo is a 2D graphics library which we use here to clean the video window.
-		 * It is used by GStreamer for other reasons, so it will always be available to us. */
 		gtk_widget_get_allocation(widget, &allocation);
-
-		cairo_surface_t * surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 32, 18);
-		cairo_t *         context = cairo_create(surface);
-
-		GDateTime * datetime  = g_date_time_new_now_local();
-		double      seconds01 = g_date_time_get_seconds(datetime) / 60.0;
-
-		cairo_pattern_t * gradient = cairo_pattern_create_linear(0.0, 0.0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_pattern_add_color_stop_hsva(gradient, 0.0, seconds01 * 360.0        , 1.0, 0.4, 1.0);
-		cairo_pattern_add_color_stop_hsva(gradient, 1.0, seconds01 * 360.0 + 120.0, 1.0, 0.4, 1.0);
-		cairo_rectangle(context, 0.0, 0.0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_set_source(context, gradient);
-		cairo_fill(context);
-		cairo_pattern_destroy(gradient);
-
-		gradient = cairo_pattern_create_linear(0.0, 0.0, 0.0, cairo_image_surface_get_height(surface));
-		cairo_pattern_add_color_stop_rgba(gradient, 0.0, 0.0, 0.0, 0.0, 0.8);
-		cairo_pattern_add_color_stop_rgba(gradient, 0.3, 0.0, 0.0, 0.0, 0.0);
-		cairo_pattern_add_color_stop_rgba(gradient, 0.7, 0.0, 0.0, 0.0, 0.0);
-		cairo_pattern_add_color_stop_rgba(gradient, 1.0, 0.0, 0.0, 0.0, 0.8);
-		cairo_rectangle(context, 0.0, 0.0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_set_source(context, gradient);
-		cairo_fill(context);
-		cairo_pattern_destroy(gradient);
-
-		int        noise_stride  = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(surface));
-		uint32_t * noise_data    = (uint32_t *)malloc(noise_stride * cairo_image_surface_get_height(surface));
-		int        noise_seed    = 123456789;
-		for(int y = 0; y < cairo_image_surface_get_height(surface); y++) {
-			for(int x = 0; x < cairo_image_surface_get_width(surface); x++) {
-				uint32_t * p  = ((uint32_t *)(((uint8_t *)noise_data) + noise_stride * y)) + x;
-				double     a  = 1.0 + sin(noise_seed + (noise_seed % 10 + 10) * 0.1 * 2.0 * PI * seconds01) * 0.5;
-				uint8_t    ca = (uint8_t)(a * 0.05 * 255.0);
-				*p = (ca << 24) | (ca << 16) | (ca << 8) | (ca << 0); /* cairo expects premultiplied alpha */
-
-				noise_seed = 1103515245 * noise_seed + 12345;
-			}
-		}
-		cairo_surface_t * noise_surface = cairo_image_surface_create_for_data((unsigned char *)noise_data, CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface), noise_stride);
-		cairo_set_source_surface(context, noise_surface, 0.0, 0.0);
-		cairo_rectangle(context, 0.0, 0.0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_fill(context);
-		cairo_surface_destroy(noise_surface);
-		free(noise_data);
-
-		cairo_select_font_face(context, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-		cairo_font_options_t * options = cairo_font_options_create();
-		cairo_font_options_set_antialias(options, CAIRO_ANTIALIAS_NONE);
-		cairo_set_font_options(context, options);
-		cairo_font_options_destroy(options);
-		cairo_move_to(context, 2.0, 13.0);
-		cairo_set_source_rgba(context, 1.0, 1.0, 1.0, 0.4);
-		gchar * time_str = g_date_time_format(datetime, "%H:%M");
-		cairo_show_text(context, time_str);
-		g_free(time_str);
-		g_date_time_unref(datetime);
-
-		cairo_save(cr);
-		cairo_scale(cr, (double)allocation.width / cairo_image_surface_get_width(surface), (double)allocation.height / cairo_image_surface_get_height(surface));
-		cairo_set_source_surface(cr, surface, 0.0, 0.0);
-		cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-		cairo_rectangle(cr, 0, 0, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_fill(cr);
-		cairo_restore(cr);
-
-		cairo_destroy(context);
-		cairo_surface_destroy(surface);
-
-		surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, allocation.width / 32, allocation.height / 18);
-		context = cairo_create(surface);
-		cairo_arc(context, 4.0, 4.0, 3.0, 1.0 * PI, 1.5 * PI);
-		cairo_arc(context, cairo_image_surface_get_width(surface) - 4.0, 4.0, 3.0, 1.5 * PI, 2.0 * PI);
-		cairo_arc(context, cairo_image_surface_get_width(surface) - 4.0, cairo_image_surface_get_height(surface) - 4.0, 3.0, 2.0 * PI, 0.5 * PI);
-		cairo_arc(context, 4.0, cairo_image_surface_get_height(surface) - 4.0, 3.0, 0.5 * PI, 1.0 * PI);
-		cairo_line_to(context, 1.0, 4.0);
-		cairo_line_to(context, 0.0, 4.0);
-		cairo_line_to(context, 0.0, cairo_image_surface_get_height(surface));
-		cairo_line_to(context, cairo_image_surface_get_width(surface), cairo_image_surface_get_height(surface));
-		cairo_line_to(context, cairo_image_surface_get_width(surface), 0.0);
-		cairo_line_to(context, 0.0, 0.0);
-		cairo_line_to(context, 0.0, 4.0);
-		cairo_set_source_rgb(context, 0.0, 0.0, 0.0);
-		cairo_fill(context);
-
-		cairo_set_source_surface(cr, surface, 0.0, 0.0);
-		cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REPEAT);
-		cairo_rectangle(cr, 0, 0, allocation.width, allocation.height);
-		cairo_fill(cr);
-
-		cairo_destroy(context);
-		cairo_surface_destroy(surface);
+		idle_renderer_draw(data->idle, cr, allocation.width, allocation.height);
 	}
 
 	return FALSE;
@@ -205,7 +277,9 @@ static gboolean draw_cb(GtkWidget * widget, cairo_t * cr, CustomData * data) {
 static gboolean refresh_ui(CustomData *data) {
 	/* We do not want to update anything unless we are in the PAUSED or PLAYING states */
 	if(data->state < GST_STATE_PAUSED) {
-		gtk_widget_queue_draw(data->video_widget);
+		/* Only redraw the idle screen when it actually shows something new */
+		if(data->idle != NULL && idle_renderer_update(data->idle))
+			gtk_widget_queue_draw(data->video_widget);
 		return TRUE;
 	}
 
@@ -229,401 +303,2384 @@ static void error_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
 	g_clear_error(&err);
 	g_free(debug_info);
 
+	/* A seek in flight never completes now */
+	seek_reset(data);
+
 	/* Set the pipeline to READY(which stops playback) */
+	resume_cancel(data);
 	gst_element_set_state(data->pipeline, GST_STATE_READY);
 }
 
 
-/* This function is called when an End-Of-Stream message is posted on the bus.
- * We just set the pipeline to READY(which stops playback) */
+/* This function is called when an End-Of-Stream message is posted on the bus. Queued items
+ * normally follow gaplessly without ever getting here; if one was queued too late we start it
+ * now, otherwise we set the pipeline to READY(which stops playback) */
 static void eos_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
 	g_print("End-Of-Stream reached.\n");
-	gst_element_set_state(data->pipeline, GST_STATE_READY);
+
+	/* A seek that ran into the end never gets its ASYNC_DONE; one requested meanwhile still goes
+	 * out, since it most likely leads back into the file */
+	if(data->seeking) {
+		data->seeking = FALSE;
+		data->seeks_done++;
+		if(!data->seek_pending)
+			data->seek_target = -1;
+		else {
+			seek_issue(data);
+			if(data->seeking)
+				return;
+		}
+	}
+
+	/* A reverse scan that reached the start carries on playing from there */
+	if(data->rate < 0) {
+		data->rate = 1.0;
+		seek_to(data, 0, FALSE);
+		broadcast_status(data);
+		return;
+	}
+
+	/* Followers wait for the master to tell what comes next */
+	if(data->follower != NULL)
+		return;
+
+	/* Played to the end, so there is nothing to resume */
+	gint current = play_queue_current(data->queue);
+	if(current >= 0)
+		resume_store_set(data->resume, play_queue_get(data->queue, current), -1);
+
+	gint next = current + 1;
+	if(next < (gint)play_queue_length(data->queue))
+		play_item(data, next);
+	else
+		gst_element_set_state(data->pipeline, GST_STATE_READY);
 }
 
 
-/* This function is called when the pipeline changes states. We use it to keep track of the current state. */
-static void state_changed_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
-	GstState old_state, new_state, pending_state;
-	gst_message_parse_state_changed(msg, &old_state, &new_state, &pending_state);
-	if(GST_MESSAGE_SRC(msg) == GST_OBJECT(data->pipeline)) {
-		data->state = new_state;
-		if(old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) {
-			/* For extra responsiveness, we refresh the GUI as soon as we reach the PAUSED state */
-			refresh_ui(data);
-		}
+/* The uri to hand playbin for `uri', that of its variant if one is ready. Thread-safe. */
+static gchar * variant_uri(CustomData * data, const gchar * uri) {
+	gchar * path = data->variants != NULL && uri != NULL ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+	if(path == NULL)
+		return g_strdup(uri);
+
+	gchar * file     = variant_cache_resolve(data->variants, path);
+	gchar * resolved = g_filename_to_uri(file, NULL, NULL);
+	g_free(file);
+	g_free(path);
+	return resolved;
+}
+
+
+/* The uri playbin plays, or is about to, with variants standing in for the file they were made of,
+ * so clients and followers never see them. `variant' tells whether one stood in. */
+static gchar * playing_uri(CustomData * data, const gchar * property, gboolean * variant) {
+	gchar * uri;
+	g_object_get(data->playbin, property, &uri, NULL);
+	gchar * path   = data->variants != NULL && uri != NULL ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+	gchar * source = path != NULL ? variant_cache_original(data->variants, path) : NULL;
+	if(source != NULL) {
+		g_free(uri);
+		uri = g_filename_to_uri(source, NULL, NULL);
 	}
+	if(variant != NULL)
+		*variant = source != NULL;
+	g_free(source);
+	g_free(path);
+	return uri;
 }
 
 
-static void server_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, CustomData * data) {
-	g_print("[%s] %s\n", msg->method, path);
+/* Asks for a variant of `path' if the file is too heavy, TRUE if it is */
+static gboolean variant_want(CustomData * data, const gchar * path) {
+	GStatBuf st;
+	if(path == NULL || g_stat(path, &st) != 0)
+		return FALSE;
+	const MediaInfo * info = metadata_index_get(data->metadata, path, st.st_size, st.st_mtime);
+	return info != NULL && variant_cache_want(data->variants, path, info);
+}
 
-	if(msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
-		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+
+/* Counts whether a heavy file started from its variant, and gets variants of it and of the next
+ * item going, so a queue of heavy files plays light from the second one on */
+static void variant_started(CustomData * data, const gchar * path, gboolean variant) {
+	if(data->variants == NULL)
 		return;
+
+	if(variant || variant_want(data, path)) {
+		variant_cache_played(data->variants, variant);
+		metrics_add(data->metrics, variant ? "banana_variant_loads_total{result=\"hit\"}" : "banana_variant_loads_total{result=\"miss\"}", 1);
 	}
+	variant_want(data, play_queue_get(data->queue, play_queue_current(data->queue) + 1));
+}
 
-	char * file_path = g_strdup_printf("public%s", path); /* path always starts with a '/' */
 
-	struct stat st;
-	if(stat(file_path, &st) == -1) {
-		if(errno == EPERM)
-			soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
-		else if(errno == ENOENT)
-			soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
-		else
-			soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-		g_free(file_path);
-		return;
+static void variant_changed_cb(CustomData * data) {
+	broadcast_status(data);
+}
+
+
+/* This function is called from a streaming thread when playbin is about to run out of data.
+ * Handing it the next uri right here lets it preroll the next item while the current one is
+ * still playing, so there is no gap and no state change in between. */
+static void about_to_finish_cb(GstElement * playbin, CustomData * data) {
+	gchar * next = play_queue_next_uri(data->queue);
+	gchar * uri  = variant_uri(data, next);
+	g_free(next);
+	if(uri != NULL) {
+		g_print("[QUEUE] next %s\n", uri);
+		g_object_set(playbin, "uri", uri, NULL);
+		g_free(uri);
 	}
+}
 
-	if(!S_ISREG(st.st_mode)) {
-		soup_message_set_status(msg, SOUP_STATUS_FORBIDDEN);
-		g_free(file_path);
-		return;
+
+/* This function is called when a new item starts playing, be it after a `load' or a gapless
+ * transition. We follow whatever playbin actually plays. */
+static void stream_start_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	gboolean variant;
+	gchar *  uri  = playing_uri(data, "current-uri", &variant);
+	gchar *  path = uri ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+
+	const gchar * previous = play_queue_get(data->queue, play_queue_current(data->queue));
+	if(path != NULL && g_strcmp0(previous, path) != 0) {
+		/* The previous item played to its end */
+		if(previous != NULL)
+			resume_store_set(data->resume, previous, -1);
+
+		gint index = play_queue_find(data->queue, path);
+		if(index >= 0)
+			play_queue_set_current(data->queue, index);
+		if(!gst_element_query_duration(data->playbin, GST_FORMAT_TIME, &data->duration))
+			data->duration = GST_CLOCK_TIME_NONE;
+
+		/* The next item starts with a segment of its own, at normal speed */
+		gdouble rate = data->rate;
+		data->rate = 1.0;
+		set_rate(data, rate);
+
+		broadcast_queue(data);
+		broadcast_status(data);
 	}
+	if(path != NULL)
+		variant_started(data, path, variant);
 
-	if(msg->method == SOUP_METHOD_GET) {
-		GMappedFile * mapping = g_mapped_file_new(file_path, FALSE, NULL);
-		if(!mapping) {
-			soup_message_set_status(msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
-			g_free(file_path);
-			return;
-		}
+	g_free(path);
+	g_free(uri);
+}
 
-		SoupBuffer * buffer = soup_buffer_new_with_owner(g_mapped_file_get_contents(mapping), g_mapped_file_get_length(mapping), mapping, (GDestroyNotify)g_mapped_file_unref);
-		soup_message_body_append_buffer(msg->response_body, buffer);
-		soup_buffer_free(buffer);
+
+/* Called from a streaming thread for every buffer that reaches one of the sinks. Only the first
+ * one of each kind after a load does anything: it tells the main loop how long the load took. */
+static void first_buffer_post(CustomData * data, gint * pending, const gchar * name) {
+	if(g_atomic_int_compare_and_exchange(pending, TRUE, FALSE)) {
+		gint64 elapsed = g_get_monotonic_time() - data->load_started;
+		GstStructure * structure = gst_structure_new(name, "elapsed", G_TYPE_INT64, elapsed, NULL);
+		gst_element_post_message(data->playbin, gst_message_new_application(GST_OBJECT(data->playbin), structure));
 	}
+}
 
-	soup_message_set_status(msg, SOUP_STATUS_OK);
-	g_free(file_path);
+
+static GstPadProbeReturn first_video_probe(GstPad * pad, GstPadProbeInfo * info, CustomData * data) {
+	first_buffer_post(data, &data->ttff_pending, "first-frame");
+	return GST_PAD_PROBE_OK;
 }
 
 
-static void soup_websocket_connection_send_json(SoupWebsocketConnection * connection, JsonBuilder * builder) {
-	JsonGenerator * generator = json_generator_new();
+static GstPadProbeReturn first_audio_probe(GstPad * pad, GstPadProbeInfo * info, CustomData * data) {
+	first_buffer_post(data, &data->ttff_audio_pending, "first-audio");
+	return GST_PAD_PROBE_OK;
+}
+
 
-	JsonNode * node = json_builder_get_root(builder);
-	json_generator_set_root(generator, node);
+static void ttff_report(CustomData * data, gint64 elapsed) {
+	data->ttff_ms = elapsed / 1000;
+	metrics_observe(data->metrics, data->last_was_warm ? "banana_load_first_frame_seconds{load=\"warm\"}" : "banana_load_first_frame_seconds{load=\"cold\"}", elapsed / 1e6);
+	g_print("[LOAD] %s load, first frame after %d ms\n", data->last_was_warm ? "warm" : "cold", data->ttff_ms);
+	broadcast_status(data);
+}
 
-	gchar * json = json_generator_to_data(generator, NULL);
-	soup_websocket_connection_send_text(connection, json);
 
-	json_node_free(node);
-	g_object_unref(generator);
-	g_free(json);
+/* This function is called for messages posted by ourselves from the streaming threads. Audio
+ * usually arrives first, so it only counts for files without video, see ttff_audio_only(). */
+static void application_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	const GstStructure * structure = gst_message_get_structure(msg);
+	gint64               elapsed;
+	if(gst_structure_has_name(structure, "first-frame")) {
+		gst_structure_get_int64(structure, "elapsed", &elapsed);
+		data->ttff_audio = -1;
+		ttff_report(data, elapsed);
+	}
+	else if(gst_structure_has_name(structure, "first-audio")) {
+		gst_structure_get_int64(structure, "elapsed", &elapsed);
+		if(g_atomic_int_get(&data->ttff_pending))
+			data->ttff_audio = elapsed;
+	}
 }
 
 
-static void send_directory_listing(SoupWebsocketConnection * connection, const char * path) {
-	GList * directories = NULL,
-	      * files       = NULL;
+/* A load that prerolled with audio but no video frame has no video, its first audio buffer is
+ * what the listener gets first */
+static void ttff_audio_only(CustomData * data) {
+	if(data->ttff_audio >= 0 && g_atomic_int_compare_and_exchange(&data->ttff_pending, TRUE, FALSE))
+		ttff_report(data, data->ttff_audio);
+	data->ttff_audio = -1;
+}
+
 
-	if(path == NULL || strlen(path) == 0 || path[strlen(path) - 1] != '/') {
-		g_printerr("[ERR] bad path for directory listing: %s\n", path);
-		return;
+/* Sinks are created once and handed to playbin, so loads never instantiate them again; the probe
+ * on their sink pad measures the time to first frame, or first audio for files without video. `description' is an element with optional
+ * properties, or a whole chain like "identity sleep-time=50000 ! fakesink sync=true qos=true". */
+static GstElement * create_sink(const gchar * description, GstPadProbeCallback probe, CustomData * data) {
+	GError *     error = NULL;
+	GstElement * sink  = strchr(description, '!') ? gst_parse_bin_from_description(description, TRUE, &error) : gst_parse_launch(description, &error);
+	if(error != NULL) {
+		g_printerr("Cannot create sink \"%s\": %s\n", description, error->message);
+		g_clear_error(&error);
+		if(sink != NULL)
+			gst_object_unref(sink);
+		return NULL;
 	}
+	if(sink != NULL) {
+		GstPad * pad = gst_element_get_static_pad(sink, "sink");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe, data, NULL);
+		gst_object_unref(pad);
+	}
+	return sink;
+}
 
-	/* Collect all directories and files from `path' */
-	GError * error;
-	GDir * dir = g_dir_open(path, 0, &error);
-	if(dir == NULL) {
-		g_printerr("[ERR] cannot open directory `%s'\n", path);
-		return;
+
+/* Rates beyond what scaletempo can make sound right are scans: only keyframes are decoded and the
+ * audio is dropped, so even the Banana Pi keeps up at 16x */
+static gboolean rate_is_scan(gdouble rate) {
+	return rate < 0 || rate > RATE_MAX;
+}
+
+
+static void seek_issue(CustomData * data) {
+	GstSeekFlags flags = GST_SEEK_FLAG_FLUSH | data->seek_flags;
+	if(rate_is_scan(data->rate))
+		flags |= GST_SEEK_FLAG_TRICKMODE | GST_SEEK_FLAG_TRICKMODE_KEY_UNITS | GST_SEEK_FLAG_TRICKMODE_NO_AUDIO;
+
+	/* Reverse playback runs from the stop position back to the start of the segment */
+	data->seek_pending = FALSE;
+	if(data->rate < 0)
+		data->seeking = gst_element_seek(data->pipeline, data->rate, GST_FORMAT_TIME, flags, GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_SET, data->seek_target);
+	else
+		data->seeking = gst_element_seek(data->pipeline, data->rate, GST_FORMAT_TIME, flags, GST_SEEK_TYPE_SET, data->seek_target, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+	/* A seek that was refused is over as much as one that completed */
+	if(!data->seeking) {
+		data->seek_target = -1;
+		data->seeks_done++;
 	}
+}
 
-	const gchar * entry;
-	while((entry = g_dir_read_name(dir)) != NULL) {
-		if(entry[0] == '.')
-			continue;
 
-		char * file_path = g_strdup_printf("%s%s", path, entry);
+static void seek_reset(CustomData * data) {
+	if(data->seeking)
+		data->seeks_done++;
+	data->seeking      = FALSE;
+	data->seek_pending = FALSE;
+	data->seek_target  = -1;
+}
 
-		struct stat st;
-		if(stat(file_path, &st) == 0) {
-			if(S_ISDIR(st.st_mode)) {
-				char * name = g_strdup(entry);
-				directories = g_list_append(directories, name);
-			}
-			else if(S_ISREG(st.st_mode)) {
-				char * name = g_strdup(entry);
-				files = g_list_append(files, name);
-			}
-		}
 
-		g_free(file_path);
+/* Seeks to `position', in nanoseconds. Every flushing seek restarts the streaming threads, so
+ * while one is in flight a burst of requests is coalesced into its last target, which is issued
+ * on ASYNC_DONE. Key unit seeks are fast; accurate ones decode up to the exact frame. */
+static void seek_to(CustomData * data, gint64 position, gboolean accurate) {
+	if(data->state < GST_STATE_PAUSED)
+		return;
+
+	if(GST_CLOCK_TIME_IS_VALID(data->duration))
+		position = MIN(position, data->duration);
+	data->seek_target  = MAX(position, 0);
+	data->seek_flags   = accurate ? GST_SEEK_FLAG_ACCURATE : GST_SEEK_FLAG_KEY_UNIT;
+	data->seek_pending = TRUE;
+	if(!data->seeking)
+		seek_issue(data);
+}
+
+
+/* Where relative jumps start from: the target of a seek that has not completed yet, since the
+ * position reported in the middle of a flush is meaningless */
+static gboolean seek_base(CustomData * data, gint64 * position) {
+	if(data->seek_target >= 0) {
+		*position = data->seek_target;
+		return TRUE;
 	}
+	return gst_element_query_position(data->playbin, GST_FORMAT_TIME, position);
+}
 
-	g_dir_close(dir);
 
-	/* Sort the resulting lists */
-	directories = g_list_sort(directories, (GCompareFunc)g_ascii_strcasecmp);
-	files       = g_list_sort(files      , (GCompareFunc)g_ascii_strcasecmp);
+/* Changes the playback rate. Between RATE_MIN and RATE_MAX the sinks can simply run faster or
+ * slower without a flush; scans and anything coming from or going to one need a new segment,
+ * which is a seek to where we are. */
+static void set_rate(CustomData * data, gdouble rate) {
+	if(rate == data->rate)
+		return;
 
-	/* Build and send the resulting Json */
-	JsonBuilder * builder = json_builder_new();
-	json_builder_begin_object(builder);
-		json_builder_set_member_name(builder, "type");
-		json_builder_add_string_value(builder, "browse");
+	gdouble old_rate = data->rate;
+	data->rate = rate;
+	if(data->state < GST_STATE_PAUSED)
+		return;
 
-		json_builder_set_member_name(builder, "path");
-		json_builder_add_string_value(builder, path);
+	if(!rate_is_scan(rate) && !rate_is_scan(old_rate) && !data->seeking &&
+	   gst_element_seek(data->pipeline, rate, GST_FORMAT_TIME, GST_SEEK_FLAG_INSTANT_RATE_CHANGE, GST_SEEK_TYPE_NONE, 0, GST_SEEK_TYPE_NONE, 0))
+		return;
 
-		json_builder_set_member_name(builder, "directories");
-		json_builder_begin_array(builder);
-		for(GList * l = directories; l != NULL; l = l->next)
-			json_builder_add_string_value(builder, l->data);
-		json_builder_end_array(builder);
+	gint64 position;
+	if(seek_base(data, &position))
+		seek_to(data, position, FALSE);
+}
 
-		json_builder_set_member_name(builder, "files");
-		json_builder_begin_array(builder);
-		for(GList * l = files; l != NULL; l = l->next) {
-			char * file_path = g_strdup_printf("%s%s", path, (const char *)l->data);
-			struct stat st;
-			stat(file_path, &st);
 
-			json_builder_begin_object(builder);
-				json_builder_set_member_name(builder, "name");
-				json_builder_add_string_value(builder, l->data);
+static const gchar * const qos_level_names[QOS_LEVEL_MAX + 1] = {
+	"full",
+	"no post-processing",
+	"skipping non-reference frames",
+	"half resolution",
+};
 
-				json_builder_set_member_name(builder, "size");
-				json_builder_add_int_value(builder, st.st_size);
-			json_builder_end_object(builder);
 
-			g_free(file_path);
-		}
-		json_builder_end_array(builder);
-	json_builder_end_object(builder);
-	soup_websocket_connection_send_json(connection, builder);
-	g_object_unref(builder);
+/* Notes where the current item is, or forgets it if it is too close to the start or the end to
+ * be worth resuming. Only memory is touched, the store writes it out in batches. */
+static void resume_remember(CustomData * data) {
+	const gchar * path = play_queue_get(data->queue, play_queue_current(data->queue));
+	gint64        position;
+	if(path == NULL || data->state < GST_STATE_PAUSED || data->resume_target >= 0 || !GST_CLOCK_TIME_IS_VALID(data->duration) || !seek_base(data, &position))
+		return;
 
-	g_list_free_full(directories, g_free);
-	g_list_free_full(files, g_free);
+	if(position < RESUME_MIN || data->duration - position < data->duration / 100 * RESUME_END_PERCENT)
+		position = -1;
+	resume_store_set(data->resume, path, position);
 }
 
 
-static void send_status(SoupWebsocketConnection * connection, CustomData * data) {
-	JsonBuilder * builder = json_builder_new();
-	json_builder_begin_object(builder);
-		json_builder_set_member_name(builder, "type");
-		json_builder_add_string_value(builder, "status");
+static gboolean resume_tick_cb(CustomData * data) {
+	if(data->state == GST_STATE_PLAYING)
+		resume_remember(data);
+	return TRUE;
+}
 
-		json_builder_set_member_name(builder, "length");
-		json_builder_add_double_value(builder, data->duration / 1000000000.0);
 
-		json_builder_set_member_name(builder, "state");
-		GstState state = GST_STATE_NULL;
-		gst_element_get_state(data->pipeline, &state, NULL, GST_CLOCK_TIME_NONE);
-		switch(state) {
-			case GST_STATE_PAUSED:  json_builder_add_string_value(builder, "paused" ); break;
-			case GST_STATE_PLAYING: json_builder_add_string_value(builder, "playing"); break;
-			default:                json_builder_add_string_value(builder, "stopped"); break;
-		}
+static void element_set_show_preroll(GstElement * element, gboolean show) {
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), "show-preroll-frame"))
+		g_object_set(element, "show-preroll-frame", show, NULL);
+}
 
-		gint64 position = 0;
-		gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position);
-		json_builder_set_member_name(builder, "position");
-		json_builder_add_double_value(builder, position / 1000000000.0);
 
-		gchar * filename;
-		g_object_get(GST_OBJECT(data->playbin), "current-uri", &filename, NULL);
-		json_builder_set_member_name(builder, "filename");
-		json_builder_add_string_value(builder, filename);
-	json_builder_end_object(builder);
-	soup_websocket_connection_send_json(connection, builder);
-	g_object_unref(builder);
+static void show_preroll_item(const GValue * item, gpointer show) {
+	element_set_show_preroll(g_value_get_object(item), GPOINTER_TO_INT(show));
 }
 
 
-static void broadcast_status(CustomData * data) {
-	for(GList * l = data->websockets; l != NULL; l = l->next)
-		send_status(l->data, data);
+/* Makes the video sink, or whichever sink inside it, show the frame it prerolls on or not */
+static void set_show_preroll(CustomData * data, gboolean show) {
+	element_set_show_preroll(data->video_sink, show);
+	if(GST_IS_BIN(data->video_sink)) {
+		GstIterator * it = gst_bin_iterate_recurse(GST_BIN(data->video_sink));
+		gst_iterator_foreach(it, (GstIteratorForeachFunction)show_preroll_item, GINT_TO_POINTER(show));
+		gst_iterator_free(it);
+	}
 }
 
 
-static void websocket_onclosed(SoupWebsocketConnection * self, CustomData * data) {
-	printf("[WS] closed\n");
-	data->websockets = g_list_remove(data->websockets, g_object_ref(self));
-	g_object_unref(self);
+/* Drops a resume that has not completed, for a new load or a stop */
+static void resume_cancel(CustomData * data) {
+	if(data->resume_target >= 0 || data->resuming)
+		set_show_preroll(data, TRUE);
+	data->resume_target = -1;
+	data->resuming      = FALSE;
 }
 
 
-static void websocket_onerror(SoupWebsocketConnection * self, GError * error, CustomData * data) {
-	printf("[WS] error\n");
+/* Makes a video decoder follow the decoding level, as far as it has the knobs for it; the
+ * gst-libav ones do. A lower resolution only takes effect once the decoder is opened again.
+ * In audio-only mode the decoder skips everything, which unlike a new pipeline can be undone
+ * mid-stream. May be called from any thread. */
+static void qos_setup_decoder(GstElement * element, CustomData * data) {
+	if(!GST_IS_VIDEO_DECODER(element))
+		return;
+
+	gint level = g_atomic_int_get(&data->qos_level);
+	GObjectClass * klass = G_OBJECT_GET_CLASS(element);
+	if(g_object_class_find_property(klass, "skip-frame"))
+		gst_util_set_object_arg(G_OBJECT(element), "skip-frame", g_atomic_int_get(&data->audio_only) ? "5" : level >= 2 ? "1" : "0");
+	if(g_object_class_find_property(klass, "lowres"))
+		gst_util_set_object_arg(G_OBJECT(element), "lowres", level >= 3 ? "1" : "0");
 }
 
 
-static void websocket_onmessage(SoupWebsocketConnection * self, gint type, GBytes * message, CustomData * data) {
-	if(type == SOUP_WEBSOCKET_DATA_TEXT) {
-		gsize size;
-		char * json = g_bytes_unref_to_data(message, &size);
+static void qos_setup_item(const GValue * item, CustomData * data) {
+	qos_setup_decoder(g_value_get_object(item), data);
+}
 
-		JsonParser * parser = json_parser_new();
-		if(!json_parser_load_from_data(parser, json, size, NULL)) {
-			g_printerr("[ERR] bad json request: %s\n", json);
-			g_free(json);
-			return;
-		}
-		g_free(json);
 
-		JsonNode * node = json_parser_get_root(parser);
-		if(json_node_get_node_type(node) != JSON_NODE_OBJECT) {
-			g_printerr("[ERR] bad json request: %s\n", json);
-			return;
-		}
+static void qos_setup_decoders(CustomData * data) {
+	GstIterator * it = gst_bin_iterate_recurse(GST_BIN(data->playbin));
+	gst_iterator_foreach(it, (GstIteratorForeachFunction)qos_setup_item, data);
+	gst_iterator_free(it);
+}
 
-		JsonObject * object = json_node_get_object(node);
 
-		const gchar * type = json_object_get_string_member(object, "type");
-		if(g_strcmp0(type, "browse") == 0) {
-			const gchar * path = json_object_get_string_member(object, "path");
-			if(path != NULL) {
-				g_print("[WS] browse %s\n", path);
-				send_directory_listing(self, path);
-			}
-		}
-		else if(g_strcmp0(type, "load") == 0) {
-			const gchar * path = json_object_get_string_member(object, "path");
-			if(path != NULL) {
-				g_print("[WS] load %s\n", path);
-				char * str = g_strdup_printf("file://%s", path);
-				gst_element_set_state(data->pipeline, GST_STATE_READY);
-				g_object_set(data->playbin, "uri", str, NULL);
-				gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
-				g_free(str);
-				broadcast_status(data);
-			}
-		}
-		else if(g_strcmp0(type, "play") == 0) {
-			gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
-			g_print("[WS] play\n");
-			broadcast_status(data);
-		}
-		else if(g_strcmp0(type, "pause") == 0) {
-			gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
-			g_print("[WS] pause\n");
-			broadcast_status(data);
-		}
-		else if(g_strcmp0(type, "stop") == 0) {
-			gst_element_set_state(data->pipeline, GST_STATE_READY);
-			g_print("[WS] stop\n");
-			broadcast_status(data);
-		}
-		else if(g_strcmp0(type, "fullscreen") == 0) {
-			gtk_window_fullscreen(GTK_WINDOW(data->main_window));
-			g_print("[WS] fullscreen\n");
-			broadcast_status(data);
-		}
-		else if(g_strcmp0(type, "seek") == 0) {
-			double percent  = json_object_get_double_member(object, "percent");
-			gint64 position = percent / 100.0 * data->duration;
-			g_print("[WS] seek %f%%\n", percent);
-			gst_element_seek_simple(data->pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, position);
-			broadcast_status(data);
-		}
-		else if(g_strcmp0(type, "jump") == 0) {
-			gint64 ms = json_object_get_int_member(object, "ms");
-			g_print("[WS] jump %" G_GINT64_FORMAT "ms\n", ms);
-			gint64 position;
-			if(gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position)) {
-				position += ms * GST_MSECOND;
-				gst_element_seek_simple(data->pipeline, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, position);
-				broadcast_status(data);
-			}
-		}
+/* This function is called from a streaming thread for every element playbin creates, so decoders
+ * of the next file start at the current level */
+static void element_setup_cb(GstElement * playbin, GstElement * element, CustomData * data) {
+	qos_setup_decoder(element, data);
+}
 
-		g_object_unref(parser);
+
+static void qos_set_level(CustomData * data, gint level, gint dropped) {
+	g_print("[QOS] %d frames dropped, decoding level %d (%s)\n", dropped, level, qos_level_names[level]);
+	g_atomic_int_set(&data->qos_level, level);
+
+	guint post_processing = PLAY_FLAG_DEINTERLACE | PLAY_FLAG_SOFT_COLORBALANCE;
+	guint flags;
+	g_object_get(data->playbin, "flags", &flags, NULL);
+	flags &= ~post_processing;
+	if(level < 1)
+		flags |= data->play_flags & post_processing;
+	g_object_set(data->playbin, "flags", flags, NULL);
+	qos_setup_decoders(data);
+
+	data->qos_streak = 0;
+	broadcast_status(data);
+}
+
+
+/* This function is called when an element drops or is about to drop buffers because they are
+ * late. Only the video sink counts: video is what the board struggles with, and other elements
+ * report the same late frames again. Sinks report a running count of dropped frames, which starts
+ * over after flushes. */
+static void qos_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	if(!gst_object_has_as_ancestor(GST_MESSAGE_SRC(msg), GST_OBJECT(data->video_sink)))
+		return;
+
+	GstFormat format;
+	guint64   processed, dropped;
+	gst_message_parse_qos_stats(msg, &format, &processed, &dropped);
+	if(dropped == (guint64)-1)
+		return;
+
+	guint64 new_drops = dropped >= data->qos_sink_dropped ? dropped - data->qos_sink_dropped : dropped;
+	data->qos_sink_dropped = dropped;
+	if(new_drops > 0) {
+		data->qos_dropped += new_drops;
+		metrics_add(data->metrics, "banana_qos_dropped_frames_total", new_drops);
 	}
 }
 
 
-static void websocket_onconnect(SoupServer * server, SoupWebsocketConnection * connection, const char * path, SoupClientContext * client, CustomData * data) {
-	printf("[WS] connect\n");
-	data->websockets = g_list_append(data->websockets, g_object_ref(connection)); /* important: keep a reference */
-	g_signal_connect(connection, "closed",  (GCallback)websocket_onclosed , data);
-	g_signal_connect(connection, "error",   (GCallback)websocket_onerror  , data);
-	g_signal_connect(connection, "message", (GCallback)websocket_onmessage, data);
+/* Steps the decoding level down when frames keep getting dropped and back up once they have not
+ * been for a while. Scans and seeks drop frames on purpose and are left out. */
+static gboolean qos_tick_cb(CustomData * data) {
+	gint dropped = data->qos_dropped;
+	data->qos_dropped = 0;
+	if(data->state != GST_STATE_PLAYING || data->seeking || data->audio_only || rate_is_scan(data->rate)) {
+		data->qos_streak = 0;
+		return TRUE;
+	}
+
+	if(dropped >= QOS_DROPS_DOWN)
+		data->qos_streak = MAX(data->qos_streak, 0) + 1;
+	else if(dropped == 0)
+		data->qos_streak = MIN(data->qos_streak, 0) - 1;
+	else
+		data->qos_streak = 0;
 
-	send_status(connection, data);
-	send_directory_listing(connection, data->root_dir);
+	gint level = data->qos_level;
+	if(data->qos_streak >= QOS_WINDOWS_DOWN && level < QOS_LEVEL_MAX)
+		qos_set_level(data, level + 1, dropped);
+	else if(data->qos_streak <= -QOS_WINDOWS_UP && level > 0)
+		qos_set_level(data, level - 1, dropped);
+	return TRUE;
 }
 
 
-int main(int argc, char * argv[]) {
-	/* Initialize GTK */
-	gtk_init(&argc, &argv);
+/* Turns video off or back on without interrupting the audio. Playbin stops rendering video as
+ * soon as its flag is cleared, the decoders are told to skip every frame, and the GUI timer stops
+ * waking us up. Turning video back on seeks to where we are, so the picture comes back right away
+ * instead of at the next keyframe. */
+static void set_audio_only(CustomData * data, gboolean audio_only) {
+	if(audio_only == data->audio_only)
+		return;
 
-	/* Initialize GStreamer */
-	gst_init(&argc, &argv);
+	g_print("[VIDEO] %s\n", audio_only ? "off" : "on");
+	g_atomic_int_set(&data->audio_only, audio_only);
 
-	/* Initialize our data structure */
-	CustomData data;
-	memset(&data, 0, sizeof(data));
-	data.duration = GST_CLOCK_TIME_NONE;
-	if(argc == 2)
-		data.root_dir = g_strdup(argv[1]);
-	else
-		data.root_dir = g_get_current_dir();
-	if(data.root_dir[strlen(data.root_dir) - 1] != '/') {
-		gchar * str = g_strdup_printf("%s/", data.root_dir);
-		g_free(data.root_dir);
-		data.root_dir = str;
+	guint flags;
+	g_object_get(data->playbin, "flags", &flags, NULL);
+	flags = audio_only ? flags & ~PLAY_FLAG_VIDEO : flags | PLAY_FLAG_VIDEO;
+	g_object_set(data->playbin, "flags", flags, NULL);
+	qos_setup_decoders(data);
+
+	if(audio_only) {
+		g_source_remove(data->refresh_source);
+		data->refresh_source = 0;
+	}
+	else {
+		data->refresh_source = g_timeout_add(120, (GSourceFunc)refresh_ui, data);
+		gint64 position;
+		if(data->state >= GST_STATE_PAUSED && seek_base(data, &position))
+			seek_to(data, position, TRUE);
 	}
+	if(data->video_widget != NULL)
+		gtk_widget_queue_draw(data->video_widget);
+	broadcast_status(data);
+}
 
-	/* Create the elements */
-	data.pipeline = gst_pipeline_new(NULL);
-	data.playbin = gst_element_factory_make("playbin", "playbin");
-	if(!data.pipeline || !data.playbin) {
-		g_printerr("Not all elements could be created.\n");
-		return -1;
+
+/* This function is called when the pipeline changes states. We use it to keep track of the current state. */
+static void state_changed_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	GstState old_state, new_state, pending_state;
+	gst_message_parse_state_changed(msg, &old_state, &new_state, &pending_state);
+	if(GST_MESSAGE_SRC(msg) == GST_OBJECT(data->pipeline)) {
+		data->state = new_state;
+		if(old_state == GST_STATE_PLAYING)
+			resume_remember(data);
+		resume_store_flush(data->resume);
+		if(old_state == GST_STATE_READY && new_state == GST_STATE_PAUSED) {
+			/* For extra responsiveness, we refresh the GUI as soon as we reach the PAUSED state */
+			refresh_ui(data);
+		}
+		if(new_state <= GST_STATE_READY) {
+			data->buffering        = 100;
+			data->buffering_paused = FALSE;
+			data->qos_sink_dropped = 0;
+			seek_reset(data);
+		}
+		broadcast_status(data);
 	}
-	gst_bin_add(GST_BIN(data.pipeline), data.playbin);
+}
 
-	/* Create the GUI */
-	data.main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-	g_signal_connect(G_OBJECT(data.main_window), "delete-event", G_CALLBACK(delete_event_cb), (gpointer)&data);
 
-	data.video_widget = gtk_drawing_area_new();
-	g_signal_connect(data.video_widget, "realize", G_CALLBACK(realize_cb), (gpointer)&data);
-	g_signal_connect(data.video_widget, "draw"   , G_CALLBACK(draw_cb   ), (gpointer)&data);
+/* This function is called when the duration of the stream changes. We query it again right away,
+ * which only asks the demuxer and never blocks. */
+static void duration_changed_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	data->duration = GST_CLOCK_TIME_NONE;
+	if(data->state >= GST_STATE_PAUSED && !gst_element_query_duration(data->playbin, GST_FORMAT_TIME, &data->duration))
+		data->duration = GST_CLOCK_TIME_NONE;
+	broadcast_status(data);
+}
 
-	gtk_container_add(GTK_CONTAINER(data.main_window), data.video_widget);
-	gtk_window_set_title(GTK_WINDOW(data.main_window), "Banana Player");
-	gtk_window_set_default_size(GTK_WINDOW(data.main_window), 1280, 720);
 
-	gtk_widget_show_all(data.main_window);
-	gtk_window_fullscreen(GTK_WINDOW(data.main_window));
-	gtk_window_set_keep_above(GTK_WINDOW(data.main_window), 1);
+/* This function is called when an asynchronous state change or a flushing seek has completed, so
+ * the position is accurate again */
+static void async_done_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	ttff_audio_only(data);
 
-	GdkCursor * cursor = gdk_cursor_new_for_display(gdk_display_get_default(), GDK_BLANK_CURSOR);
-	gdk_window_set_cursor(gtk_widget_get_window(GTK_WIDGET(data.main_window)), cursor);
+	/* A follower on its way back in step */
+	if(data->sync_stage != SYNC_IDLE) {
+		sync_async_done(data);
+		broadcast_status(data);
+		return;
+	}
 
-	/* Instruct the bus to emit signals for each received message, and connect to the interesting signals */
-	GstBus * bus = gst_element_get_bus(data.pipeline);
-	gst_bus_add_signal_watch(bus);
-	g_signal_connect(G_OBJECT(bus), "message::error"        , (GCallback)error_cb        , &data);
-	g_signal_connect(G_OBJECT(bus), "message::eos"          , (GCallback)eos_cb          , &data);
-	g_signal_connect(G_OBJECT(bus), "message::state-changed", (GCallback)state_changed_cb, &data);
-	gst_object_unref(bus);
+	/* A load with a resume point has prerolled without showing anything, now jump there */
+	if(data->resume_target >= 0) {
+		data->seek_target   = data->resume_target;
+		data->seek_flags    = GST_SEEK_FLAG_ACCURATE;
+		data->resume_target = -1;
+		data->resuming      = TRUE;
+		seek_issue(data);
+		if(data->seeking)
+			return;
+	}
 
-	/* Register a function that GLib will call every second */
-	g_timeout_add(120, (GSourceFunc)refresh_ui, &data);
+	if(data->seek_pending) {
+		seek_issue(data);
+		return;
+	}
+	if(data->seeking)
+		data->seeks_done++;
+	data->seeking     = FALSE;
+	data->seek_target = -1;
+
+	if(data->resuming) {
+		data->resuming = FALSE;
+		set_show_preroll(data, TRUE);
+		gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+	}
 
-	SoupServer * server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "banana-player", NULL);
-	GError *error = NULL;
-	soup_server_listen_all(server, 3001, 0, &error);
-	soup_server_add_handler(server, "/", (SoupServerCallback)server_callback, &data, NULL);
-	soup_server_add_websocket_handler(server, "/ws", NULL, NULL, (SoupServerWebsocketCallback)websocket_onconnect, &data, NULL);
+	if(!GST_CLOCK_TIME_IS_VALID(data->duration) && !gst_element_query_duration(data->playbin, GST_FORMAT_TIME, &data->duration))
+		data->duration = GST_CLOCK_TIME_NONE;
+	broadcast_status(data);
+}
 
-	/* Start the GTK main loop. We will not regain control until gtk_main_quit is called. */
-	gtk_main();
 
-	/* Free resources */
-	gst_element_set_state(data.pipeline, GST_STATE_NULL);
-	gst_object_unref(data.pipeline);
-	gst_object_unref(data.playbin);
+/* Pauses playback while the buffers refill and resumes it once they are full again, as long as
+ * nobody paused it in between */
+static void buffering_update(CustomData * data, gint percent) {
+	if(percent == data->buffering)
+		return;
+
+	data->buffering = percent;
+	if(percent < 100 && data->state == GST_STATE_PLAYING && !data->buffering_paused) {
+		metrics_add(data->metrics, "banana_buffering_events_total", 1);
+		data->buffering_paused = TRUE;
+		gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+	}
+	else if(percent >= 100 && data->buffering_paused) {
+		data->buffering_paused = FALSE;
+		gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+	}
+	broadcast_status(data);
+}
+
+
+/* This function is called while network streams fill their buffers */
+static void buffering_cb(GstBus *bus, GstMessage *msg, CustomData *data) {
+	gint percent;
+	gst_message_parse_buffering(msg, &percent);
+	buffering_update(data, percent);
+}
+
+
+/* The file a source probe reports reads of */
+typedef struct _SourceProbe {
+	ReadAhead * readahead;
+	gchar *     location;
+} SourceProbe;
+
+
+static void source_probe_free(SourceProbe * probe) {
+	g_free(probe->location);
+	g_slice_free(SourceProbe, probe);
+}
+
+
+/* Called by the streaming thread for every buffer a file source reads */
+static GstPadProbeReturn source_probe(GstPad * pad, GstPadProbeInfo * info, SourceProbe * probe) {
+	GstBuffer * buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(GST_BUFFER_OFFSET_IS_VALID(buffer))
+		read_ahead_set_position(probe->readahead, probe->location, GST_BUFFER_OFFSET(buffer) + gst_buffer_get_size(buffer));
+	return GST_PAD_PROBE_OK;
+}
+
+
+/* This function is called whenever playbin creates a source for the next file. File sources get
+ * the read-ahead, network sources are buffered by playbin itself. */
+static void source_setup_cb(GstElement * playbin, GstElement * source, CustomData * data) {
+	if(data->readahead == NULL || !g_object_class_find_property(G_OBJECT_GET_CLASS(source), "location"))
+		return;
+
+	gchar * location;
+	g_object_get(source, "location", &location, NULL);
+	if(location != NULL && g_path_is_absolute(location)) {
+		read_ahead_set_file(data->readahead, location);
+		SourceProbe * probe = g_slice_new(SourceProbe);
+		probe->readahead = data->readahead;
+		probe->location  = g_strdup(location);
+		GstPad * pad = gst_element_get_static_pad(source, "src");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)source_probe, probe, (GDestroyNotify)source_probe_free);
+		gst_object_unref(pad);
+	}
+	g_free(location);
+}
+
+
+/* Turns a read-ahead that cannot keep up into buffering, so playback pauses instead of freezing
+ * and resumes once a good part of the read-ahead has been refilled */
+static gboolean readahead_tick_cb(CustomData * data) {
+	if(data->state < GST_STATE_PAUSED) {
+		data->readahead_waiting = FALSE;
+		return TRUE;
+	}
+
+	if(!data->readahead_waiting && data->state == GST_STATE_PLAYING && read_ahead_stalled(data->readahead)) {
+		g_print("[BUFFER] read-ahead stalled\n");
+		data->readahead_waiting = TRUE;
+	}
+	if(data->readahead_waiting) {
+		gint percent = MIN(read_ahead_fill(data->readahead) * 100 / READAHEAD_RESUME, 100);
+		if(percent >= 100)
+			data->readahead_waiting = FALSE;
+		buffering_update(data, percent);
+	}
+	return TRUE;
+}
+
+
+/* Keeps the watch-along stream on what playbin plays. Nothing is remuxed during reverse scans or
+ * while a seek is in flight; the stream picks up again from wherever playback settles. */
+static gboolean watch_tick_cb(CustomData * data) {
+	gchar * uri      = NULL;
+	gint64  position = 0;
+	if(data->state >= GST_STATE_PAUSED && data->rate > 0 && !data->seeking && gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position))
+		g_object_get(data->playbin, "current-uri", &uri, NULL);
+	watch_along_follow(data->watch, uri, position, data->rate);
+	g_free(uri);
+	return TRUE;
+}
+
+
+static void server_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, CustomData * data) {
+	g_print("[%s] %s\n", msg->method, path);
+
+	if(msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	asset_cache_serve(data->assets, msg, path);
+}
+
+
+/* Messages are only serialized once a client needs them, in whatever encoding it asked for */
+static WireFrame * json_builder_to_frame(JsonBuilder * builder) {
+	return wire_frame_new(json_builder_get_root(builder));
+}
+
+
+static void directory_listing_add_file(JsonBuilder * builder, CustomData * data, DirListing * listing, DirListingFile * file) {
+	gchar * path = g_strconcat(listing->path, file->name, NULL);
+	const MediaInfo * info = metadata_index_get(data->metadata, path, file->size, file->mtime);
+	g_free(path);
+
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "name");
+		json_builder_add_string_value(builder, file->name);
+
+		json_builder_set_member_name(builder, "size");
+		json_builder_add_int_value(builder, file->size);
+
+		if(info != NULL && info->playable) {
+			if(info->duration >= 0) {
+				json_builder_set_member_name(builder, "duration");
+				json_builder_add_double_value(builder, info->duration / 1000000000.0);
+			}
+			if(info->width > 0) {
+				json_builder_set_member_name(builder, "width");
+				json_builder_add_int_value(builder, info->width);
+				json_builder_set_member_name(builder, "height");
+				json_builder_add_int_value(builder, info->height);
+			}
+			if(info->video_codec) {
+				json_builder_set_member_name(builder, "video");
+				json_builder_add_string_value(builder, info->video_codec);
+			}
+			if(info->audio_codec) {
+				json_builder_set_member_name(builder, "audio");
+				json_builder_add_string_value(builder, info->audio_codec);
+			}
+			if(info->title) {
+				json_builder_set_member_name(builder, "title");
+				json_builder_add_string_value(builder, info->title);
+			}
+			if(info->artist) {
+				json_builder_set_member_name(builder, "artist");
+				json_builder_add_string_value(builder, info->artist);
+			}
+		}
+	json_builder_end_object(builder);
+}
+
+
+/* Returns the `browse' reply for `listing'. It is built once and kept with the listing until new
+ * metadata for one of its files arrives, so repeated requests for an unchanged directory cost no
+ * more than a send. Only its encodings are kept, not the JSON tree. */
+static WireFrame * directory_listing_json(CustomData * data, DirListing * listing) {
+	if(listing->reply != NULL)
+		return listing->reply;
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "browse");
+
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, listing->path);
+
+		json_builder_set_member_name(builder, "directories");
+		json_builder_begin_array(builder);
+		for(guint i = 0; i < listing->directories->len; i++)
+			json_builder_add_string_value(builder, g_ptr_array_index(listing->directories, i));
+		json_builder_end_array(builder);
+
+		json_builder_set_member_name(builder, "files");
+		json_builder_begin_array(builder);
+		for(guint i = 0; i < listing->files->len; i++)
+			directory_listing_add_file(builder, data, listing, g_ptr_array_index(listing->files, i));
+		json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	listing->reply = json_builder_to_frame(builder);
+	wire_frame_encode_all(listing->reply);
+	g_object_unref(builder);
+
+	return listing->reply;
+}
+
+
+/* Every websocket gets its own bounded outbound queue. Status frames are never queued: a client only
+ * ever has the latest one pending, so stale positions are dropped instead of piling up. Clients that
+ * acknowledge every frame with an `ack' message are additionally limited to CLIENT_WINDOW frames in
+ * flight, so a slow phone on Wi-Fi just receives fewer updates instead of buffering without bound. */
+typedef struct _ListingStream ListingStream;
+
+typedef struct _Client {
+	gint                      ref_count; /* only touched from the main context */
+	SoupWebsocketConnection * connection;
+	CustomData *              data;
+
+	WireFormat                format;    /* encoding chosen with the subprotocol */
+	GQueue                    outbox;    /* WireFrame *, replies that are sent in order */
+	WireFrame *               status;    /* latest status frame not sent yet */
+	guint                     in_flight; /* frames sent but not acknowledged yet, counted from the start */
+	gboolean                  acks;      /* the client acknowledges frames, enables the window */
+
+	gboolean                  follower;  /* another player following us, see sync.h */
+	gchar *                   follower_name;
+	gint64                    skew;      /* as reported by the follower, G_MININT64 if unknown */
+
+	ListingStream *           stream;    /* running streamed listing, if any */
+
+	GQueue                    commands;  /* ParseJob *, requests waiting to run in the order they came */
+	gboolean                  parsing;   /* the head of `commands' is being parsed in a worker */
+} Client;
+
+
+static void listing_stream_resume(ListingStream * stream);
+
+
+static gboolean client_ready(Client * client) {
+	return !client->acks || client->in_flight < CLIENT_WINDOW;
+}
+
+
+static void client_flush(Client * client) {
+	if(soup_websocket_connection_get_state(client->connection) != SOUP_WEBSOCKET_STATE_OPEN)
+		return;
+
+	while(client_ready(client)) {
+		WireFrame * frame = client->status;
+		if(frame != NULL)
+			client->status = NULL;
+		else
+			frame = g_queue_pop_head(&client->outbox);
+		if(frame == NULL)
+			break;
+
+		GBytes * bytes = wire_frame_encode(frame, client->format);
+		soup_websocket_connection_send_message(client->connection, client->format == WIRE_MSGPACK ? SOUP_WEBSOCKET_DATA_BINARY : SOUP_WEBSOCKET_DATA_TEXT, bytes);
+		metrics_add(client->data->metrics, client->format == WIRE_MSGPACK ? "banana_websocket_sent_bytes_total{format=\"msgpack\"}" : "banana_websocket_sent_bytes_total{format=\"json\"}", g_bytes_get_size(bytes));
+		wire_frame_unref(frame);
+		client->in_flight++;
+	}
+
+	if(client->stream != NULL && client_ready(client) && g_queue_is_empty(&client->outbox))
+		listing_stream_resume(client->stream);
+}
+
+
+static void client_send(Client * client, WireFrame * message) {
+	if(g_queue_get_length(&client->outbox) >= CLIENT_OUTBOX_MAX) {
+		g_printerr("[ERR] websocket client too slow, dropping a message\n");
+		wire_frame_unref(g_queue_pop_head(&client->outbox));
+	}
+	g_queue_push_tail(&client->outbox, wire_frame_ref(message));
+	client_flush(client);
+}
+
+
+static void client_send_status(Client * client, WireFrame * status) {
+	if(client->status != NULL)
+		wire_frame_unref(client->status);
+	client->status = wire_frame_ref(status);
+	client_flush(client);
+}
+
+
+static Client * client_ref(Client * client) {
+	client->ref_count++;
+	return client;
+}
+
+
+static void client_unref(Client * client) {
+	if(--client->ref_count > 0)
+		return;
+
+	if(client->status != NULL)
+		wire_frame_unref(client->status);
+	g_queue_clear_full(&client->outbox, (GDestroyNotify)wire_frame_unref);
+	g_free(client->follower_name);
+	g_object_unref(client->connection);
+	g_slice_free(Client, client);
+}
+
+
+static void client_ack(Client * client) {
+	client->acks = TRUE;
+	if(client->in_flight > 0)
+		client->in_flight--;
+	client_flush(client);
+}
+
+
+static void send_directory_listing(Client * client, DirListing * listing) {
+	client_send(client, directory_listing_json(client->data, listing));
+}
+
+
+/* Builds one `browse-page' reply covering entries [offset, offset + limit) of `listing'.
+ * Directories and files are numbered as one sequence, directories first. */
+static WireFrame * directory_listing_page_json(CustomData * data, DirListing * listing, guint offset, guint limit) {
+	guint total = listing->directories->len + listing->files->len;
+	guint end   = MIN(total, offset + limit);
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "browse-page");
+
+		json_builder_set_member_name(builder, "path");
+		json_builder_add_string_value(builder, listing->path);
+
+		json_builder_set_member_name(builder, "offset");
+		json_builder_add_int_value(builder, offset);
+
+		json_builder_set_member_name(builder, "total");
+		json_builder_add_int_value(builder, total);
+
+		json_builder_set_member_name(builder, "entries");
+		json_builder_begin_array(builder);
+		for(guint i = offset; i < end; i++) {
+			if(i < listing->directories->len) {
+				json_builder_begin_object(builder);
+					json_builder_set_member_name(builder, "name");
+					json_builder_add_string_value(builder, g_ptr_array_index(listing->directories, i));
+
+					json_builder_set_member_name(builder, "directory");
+					json_builder_add_boolean_value(builder, TRUE);
+				json_builder_end_object(builder);
+			}
+			else
+				directory_listing_add_file(builder, data, listing, g_ptr_array_index(listing->files, i - listing->directories->len));
+		}
+		json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	WireFrame * frame = json_builder_to_frame(builder);
+	g_object_unref(builder);
+
+	return frame;
+}
+
+
+static void send_directory_page(Client * client, DirListing * listing, guint offset, guint limit) {
+	WireFrame * frame = directory_listing_page_json(client->data, listing, offset, MIN(limit, BROWSE_PAGE_MAX));
+	client_send(client, frame);
+	wire_frame_unref(frame);
+}
+
+
+/* A streamed listing sends one `browse-page' chunk per main loop iteration at low priority, so a
+ * huge directory never turns into one huge message and never holds up playback or other clients.
+ * The stream pauses while its client is backlogged and is resumed by client_flush(). At most one
+ * stream runs per client; starting a new one cancels the previous one. */
+struct _ListingStream {
+	Client *     client;
+	DirListing * listing;
+	guint        offset;
+	guint        chunk;
+	guint        source;
+};
+
+
+static void listing_stream_free(ListingStream * stream) {
+	if(stream->source)
+		g_source_remove(stream->source);
+	dir_listing_unref(stream->listing);
+	g_slice_free(ListingStream, stream);
+}
+
+
+static gboolean listing_stream_step(ListingStream * stream) {
+	Client * client = stream->client;
+	guint    total  = stream->listing->directories->len + stream->listing->files->len;
+
+	if(!client_ready(client) || !g_queue_is_empty(&client->outbox)) {
+		stream->source = 0;
+		return FALSE;
+	}
+
+	WireFrame * frame = directory_listing_page_json(client->data, stream->listing, stream->offset, stream->chunk);
+	stream->offset += stream->chunk;
+	if(stream->offset >= total) {
+		/* Last chunk, drop the stream before sending in case client_flush() wants to resume it */
+		stream->source = 0;
+		client->stream = NULL;
+		listing_stream_free(stream);
+		client_send(client, frame);
+		wire_frame_unref(frame);
+		return FALSE;
+	}
+
+	client_send(client, frame);
+	wire_frame_unref(frame);
+	return TRUE;
+}
+
+
+static void listing_stream_resume(ListingStream * stream) {
+	if(stream->source == 0)
+		stream->source = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)listing_stream_step, stream, NULL);
+}
+
+
+static void stream_directory_listing(Client * client, DirListing * listing, guint chunk) {
+	if(client->stream != NULL)
+		listing_stream_free(client->stream);
+
+	client->stream = g_slice_new0(ListingStream);
+	client->stream->client  = client;
+	client->stream->listing = dir_listing_ref(listing);
+	client->stream->chunk   = CLAMP(chunk, 1, BROWSE_PAGE_MAX);
+	listing_stream_resume(client->stream);
+}
+
+
+/* A `browse' request waiting for its listing */
+typedef enum {
+	BROWSE_FULL,
+	BROWSE_PAGE,
+	BROWSE_STREAM,
+	BROWSE_ENQUEUE  /* not a reply at all, the files go to the play queue */
+} BrowseMode;
+
+typedef struct _BrowseRequest {
+	Client *   client;
+	BrowseMode mode;
+	guint      offset;
+	guint      limit;
+	gint64     started; /* monotonic time of the request */
+} BrowseRequest;
+
+
+static void enqueue_directory_listing(CustomData * data, DirListing * listing);
+
+
+static void browse_request_serve(BrowseRequest * request, DirListing * listing) {
+	Metrics * metrics = request->client->data->metrics;
+	metrics_observe(metrics, "banana_browse_seconds", (g_get_monotonic_time() - request->started) / 1e6);
+	metrics_observe(metrics, "banana_browse_entries", listing->directories->len + listing->files->len);
+
+	if(request->mode == BROWSE_ENQUEUE) {
+		enqueue_directory_listing(request->client->data, listing);
+		return;
+	}
+
+	if(soup_websocket_connection_get_state(request->client->connection) != SOUP_WEBSOCKET_STATE_OPEN)
+		return;
+
+	switch(request->mode) {
+		case BROWSE_FULL:    send_directory_listing  (request->client, listing); break;
+		case BROWSE_PAGE:    send_directory_page     (request->client, listing, request->offset, request->limit); break;
+		case BROWSE_STREAM:  stream_directory_listing(request->client, listing, request->limit); break;
+		case BROWSE_ENQUEUE: break;
+	}
+}
+
+
+static void browse_request_free(BrowseRequest * request) {
+	client_unref(request->client);
+	g_slice_free(BrowseRequest, request);
+}
+
+
+/* Directories missing from the index are scanned in the filesystem worker pool, so a slow disk
+ * never stalls the main loop. Requests for a directory that is already being scanned just wait
+ * for the same scan. */
+typedef struct _ScanJob {
+	CustomData * data;
+	gchar *      path;
+	GList *      requests; /* BrowseRequest * */
+
+	DirListing * listing;  /* result */
+	GError *     error;
+} ScanJob;
+
+
+static void scan_job_run(ScanJob * job) {
+	job->listing = dir_listing_scan(job->path, &job->error);
+}
+
+
+static void scan_job_done(ScanJob * job) {
+	g_hash_table_remove(job->data->scans, job->path);
+
+	if(job->listing != NULL) {
+		dir_index_insert(job->data->dir_index, job->listing);
+		for(GList * l = job->requests; l != NULL; l = l->next)
+			browse_request_serve(l->data, job->listing);
+		dir_listing_unref(job->listing);
+	}
+	else {
+		g_printerr("[ERR] %s\n", job->error->message);
+		g_error_free(job->error);
+		dir_index_abort_scan(job->data->dir_index, job->path);
+	}
+
+	g_list_free_full(job->requests, (GDestroyNotify)browse_request_free);
+	g_free(job->path);
+	g_slice_free(ScanJob, job);
+}
+
+
+static void browse(Client * client, const gchar * path, BrowseMode mode, guint offset, guint limit) {
+	BrowseRequest * request = g_slice_new(BrowseRequest);
+	request->client  = client_ref(client);
+	request->mode    = mode;
+	request->offset  = offset;
+	request->limit   = limit;
+	request->started = g_get_monotonic_time();
+
+	DirListing * listing = dir_index_lookup(client->data->dir_index, path);
+	metrics_add(client->data->metrics, listing ? "banana_browse_total{listing=\"cached\"}" : "banana_browse_total{listing=\"scanned\"}", 1);
+	if(listing != NULL) {
+		browse_request_serve(request, listing);
+		browse_request_free(request);
+		return;
+	}
+
+	ScanJob * job = g_hash_table_lookup(client->data->scans, path);
+	if(job == NULL) {
+		job = g_slice_new0(ScanJob);
+		job->data = client->data;
+		job->path = g_strdup(path);
+		g_hash_table_insert(client->data->scans, job->path, job);
+		dir_index_begin_scan(client->data->dir_index, path);
+		worker_pool_push(client->data->fs_pool, (WorkerFunc)scan_job_run, (WorkerFunc)scan_job_done, job);
+	}
+	job->requests = g_list_append(job->requests, request);
+}
+
+
+/* Answers a `search' right away from the index. Results are ranked by the index; the reply says
+ * whether the index is still being built, in which case results may be missing. */
+static void send_search_results(Client * client, const gchar * query, guint limit) {
+	GPtrArray * results = search_index_query(client->data->search, query, limit);
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "search");
+
+		json_builder_set_member_name(builder, "query");
+		json_builder_add_string_value(builder, query);
+
+		json_builder_set_member_name(builder, "complete");
+		json_builder_add_boolean_value(builder, search_index_is_ready(client->data->search));
+
+		json_builder_set_member_name(builder, "results");
+		json_builder_begin_array(builder);
+		for(guint i = 0; i < results->len; i++) {
+			SearchResult * result = g_ptr_array_index(results, i);
+			json_builder_begin_object(builder);
+				json_builder_set_member_name(builder, "path");
+				json_builder_add_string_value(builder, result->path);
+
+				if(result->directory) {
+					json_builder_set_member_name(builder, "directory");
+					json_builder_add_boolean_value(builder, TRUE);
+				}
+			json_builder_end_object(builder);
+		}
+		json_builder_end_array(builder);
+	json_builder_end_object(builder);
+
+	WireFrame * frame = json_builder_to_frame(builder);
+	client_send(client, frame);
+	wire_frame_unref(frame);
+	g_object_unref(builder);
+	g_ptr_array_unref(results);
+}
+
+
+/* New metadata for a file makes the cached reply of its directory stale */
+static void metadata_updated_cb(const gchar * path, CustomData * data) {
+	gchar *      directory = g_strndup(path, strrchr(path, '/') - path + 1);
+	DirListing * listing   = dir_index_lookup(data->dir_index, directory);
+	if(listing != NULL && listing->reply != NULL) {
+		wire_frame_unref(listing->reply);
+		listing->reply = NULL;
+	}
+	g_free(directory);
+}
+
+
+/* Takes a new snapshot of the player status and serializes it. The snapshot is immutable, so every
+ * subscriber is sent the very same bytes instead of each one getting its own query and JSON. */
+static void update_status(CustomData * data) {
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "status");
+
+		json_builder_set_member_name(builder, "length");
+		json_builder_add_double_value(builder, data->duration / 1000000000.0);
+
+		json_builder_set_member_name(builder, "state");
+		switch(data->state) {
+			case GST_STATE_PAUSED:  json_builder_add_string_value(builder, "paused" ); break;
+			case GST_STATE_PLAYING: json_builder_add_string_value(builder, "playing"); break;
+			default:                json_builder_add_string_value(builder, "stopped"); break;
+		}
+
+		/* Position queries are answered by the sinks without waiting for the streaming threads.
+		 * While seeking, clients see where we are going rather than where the flush left us. */
+		if(data->state < GST_STATE_PAUSED)
+			data->position = 0;
+		else if(data->seek_target >= 0)
+			data->position = data->seek_target;
+		else if(!gst_element_query_position(data->playbin, GST_FORMAT_TIME, &data->position))
+			data->position = 0;
+		json_builder_set_member_name(builder, "position");
+		json_builder_add_double_value(builder, data->position / 1000000000.0);
+
+		json_builder_set_member_name(builder, "loads");
+		json_builder_add_int_value(builder, data->loads);
+
+		json_builder_set_member_name(builder, "seeks");
+		json_builder_add_int_value(builder, data->seeks_done);
+
+		/* Wall clock time of the snapshot in microseconds, for measuring how long it takes to
+		 * reach the clients */
+		json_builder_set_member_name(builder, "time");
+		json_builder_add_int_value(builder, g_get_real_time());
+
+		json_builder_set_member_name(builder, "buffering");
+		json_builder_add_int_value(builder, data->buffering);
+
+		if(data->readahead != NULL) {
+			json_builder_set_member_name(builder, "readahead");
+			json_builder_add_int_value(builder, read_ahead_fill(data->readahead));
+		}
+
+		json_builder_set_member_name(builder, "rate");
+		json_builder_add_double_value(builder, data->rate);
+
+		json_builder_set_member_name(builder, "quality");
+		json_builder_add_int_value(builder, data->qos_level);
+
+		json_builder_set_member_name(builder, "quality_name");
+		json_builder_add_string_value(builder, qos_level_names[data->qos_level]);
+
+		json_builder_set_member_name(builder, "audio_only");
+		json_builder_add_boolean_value(builder, data->audio_only);
+
+		json_builder_set_member_name(builder, "ttff");
+		json_builder_add_int_value(builder, data->ttff_ms);
+
+		json_builder_set_member_name(builder, "load");
+		json_builder_add_string_value(builder, data->last_was_warm ? "warm" : "cold");
+
+		if(data->follower != NULL && data->sync_skew != G_MININT64) {
+			json_builder_set_member_name(builder, "sync_skew");
+			json_builder_add_double_value(builder, data->sync_skew / 1000000.0);
+		}
+		if(data->clock_provider != NULL) {
+			json_builder_set_member_name(builder, "followers");
+			json_builder_begin_array(builder);
+			for(GList * l = data->websockets; l != NULL; l = l->next) {
+				Client * client = l->data;
+				if(!client->follower)
+					continue;
+				json_builder_begin_object(builder);
+					json_builder_set_member_name(builder, "name");
+					json_builder_add_string_value(builder, client->follower_name ? client->follower_name : "");
+					if(client->skew != G_MININT64) {
+						json_builder_set_member_name(builder, "skew");
+						json_builder_add_double_value(builder, client->skew / 1000000.0);
+					}
+				json_builder_end_object(builder);
+			}
+			json_builder_end_array(builder);
+		}
+
+		gchar * filename = playing_uri(data, "current-uri", NULL);
+		json_builder_set_member_name(builder, "filename");
+		json_builder_add_string_value(builder, filename);
+		g_free(filename);
+
+		if(data->variants != NULL) {
+			json_builder_set_member_name(builder, "variants");
+			variant_cache_to_json(data->variants, builder);
+		}
+	json_builder_end_object(builder);
+
+	if(data->status != NULL)
+		wire_frame_unref(data->status);
+	data->status = json_builder_to_frame(builder);
+	g_object_unref(builder);
+}
+
+
+static void broadcast_status(CustomData * data) {
+	if(data->websockets == NULL)
+		return;
+
+	update_status(data);
+	for(GList * l = data->websockets; l != NULL; l = l->next)
+		client_send_status(l->data, data->status);
+
+	if(data->clock_provider != NULL)
+		broadcast_sync(data);
+}
+
+
+/* Pushes the position to all clients while playing. Nothing is sent if it did not move, and
+ * clients that fall behind only ever get the newest snapshot. */
+static gboolean position_tick_cb(CustomData * data) {
+	if(data->state != GST_STATE_PLAYING || data->websockets == NULL)
+		return TRUE;
+
+	gint64 position;
+	if(gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position) && position != data->position)
+		broadcast_status(data);
+	return TRUE;
+}
+
+
+static WireFrame * queue_json(CustomData * data) {
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "queue");
+
+		json_builder_set_member_name(builder, "current");
+		json_builder_add_int_value(builder, play_queue_current(data->queue));
+
+		json_builder_set_member_name(builder, "items");
+		json_builder_begin_array(builder);
+		for(guint i = 0; i < play_queue_length(data->queue); i++)
+			json_builder_add_string_value(builder, play_queue_get(data->queue, i));
+		json_builder_end_array(builder);
+	json_builder_end_object(builder);
+	WireFrame * frame = json_builder_to_frame(builder);
+	g_object_unref(builder);
+
+	return frame;
+}
+
+
+/* Sends the whole queue to all clients whenever it changes. It changes rarely, unlike the status. */
+static void broadcast_queue(CustomData * data) {
+	/* Whatever plays next may as well be read already */
+	if(data->readahead != NULL)
+		read_ahead_set_next(data->readahead, play_queue_get(data->queue, play_queue_current(data->queue) + 1));
+
+	if(data->websockets == NULL)
+		return;
+
+	WireFrame * frame = queue_json(data);
+	for(GList * l = data->websockets; l != NULL; l = l->next)
+		client_send(l->data, frame);
+	wire_frame_unref(frame);
+}
+
+
+/* Tells the followers what the master plays: the uri, whether it is playing, and the stream
+ * position it was at at a given time of the shared clock. Sent along with every status update,
+ * so followers check their skew at every position tick. Nothing is sent while a seek is in
+ * flight, the next update after it completes says where it went. */
+static void broadcast_sync(CustomData * data) {
+	if(data->seeking)
+		return;
+
+	gint64 now      = gst_clock_get_time(data->sync_clock);
+	gint64 position = 0;
+	if(data->state >= GST_STATE_PAUSED && !gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position))
+		return;
+
+	gchar * uri = playing_uri(data, "current-uri", NULL);
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "type");
+		json_builder_add_string_value(builder, "sync");
+
+		json_builder_set_member_name(builder, "uri");
+		json_builder_add_string_value(builder, uri);
+
+		json_builder_set_member_name(builder, "state");
+		switch(data->state) {
+			case GST_STATE_PAUSED:  json_builder_add_string_value(builder, "paused" ); break;
+			case GST_STATE_PLAYING: json_builder_add_string_value(builder, "playing"); break;
+			default:                json_builder_add_string_value(builder, "stopped"); break;
+		}
+
+		json_builder_set_member_name(builder, "position");
+		json_builder_add_int_value(builder, position);
+
+		json_builder_set_member_name(builder, "clock");
+		json_builder_add_int_value(builder, now);
+
+		json_builder_set_member_name(builder, "rate");
+		json_builder_add_double_value(builder, data->rate);
+
+		json_builder_set_member_name(builder, "clock_port");
+		json_builder_add_int_value(builder, data->sync_clock_port);
+	json_builder_end_object(builder);
+	WireFrame * frame = json_builder_to_frame(builder);
+	g_object_unref(builder);
+	g_free(uri);
+
+	for(GList * l = data->websockets; l != NULL; l = l->next) {
+		Client * client = l->data;
+		if(client->follower)
+			client_send(client, frame);
+	}
+	wire_frame_unref(frame);
+}
+
+
+/* Seeks to where the master will be once we are ready to play, or to where it paused. The base
+ * time is chosen so that the target position is rendered at the very moment the master renders
+ * it; the flushing seek starts the running time over at 0 on the target. */
+static void sync_seek(CustomData * data) {
+	gint64 target = data->sync_position;
+	if(data->sync_playing) {
+		data->sync_base_time = gst_clock_get_time(data->sync_clock) + SYNC_LEAD;
+		target += (data->sync_base_time - data->sync_time) * data->sync_rate;
+	}
+
+	data->sync_stage = SYNC_SEEK;
+	data->rate       = data->sync_rate;
+	if(data->state == GST_STATE_PLAYING)
+		gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+	if(!gst_element_seek(data->playbin, data->sync_rate, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE, GST_SEEK_TYPE_SET, MAX(target, 0), GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE)) {
+		g_printerr("[SYNC] seek to %" GST_TIME_FORMAT " failed\n", GST_TIME_ARGS(MAX(target, 0)));
+		data->sync_stage = SYNC_IDLE;
+	}
+}
+
+
+static void sync_async_done(CustomData * data) {
+	/* Prerolled the master's uri, now go to where it is */
+	if(data->sync_stage == SYNC_PREROLL) {
+		sync_seek(data);
+		return;
+	}
+
+	data->sync_stage = SYNC_IDLE;
+	if(data->sync_playing) {
+		gst_element_set_base_time(data->pipeline, data->sync_base_time);
+		gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+	}
+}
+
+
+static void sync_report_skew(CustomData * data) {
+	gchar *      name    = g_strdup_printf("%s:%d", g_get_host_name(), data->port);
+	JsonObject * message = json_object_new();
+	json_object_set_string_member(message, "type", "sync-skew");
+	json_object_set_string_member(message, "name", name);
+	json_object_set_double_member(message, "skew", data->sync_skew / 1000000.0);
+	sync_follower_send(data->follower, message);
+	json_object_unref(message);
+	g_free(name);
+}
+
+
+/* Follows a sync message of the master: loads what it plays, and seeks whenever we are further
+ * off than SYNC_TOLERANCE. Reverse scans are followed like a pause, at the position of the
+ * latest message. */
+static void sync_follow(CustomData * data, JsonObject * message) {
+	GstClock * clock = sync_follower_get_clock(data->follower, json_object_get_int_member(message, "clock_port"));
+	if(clock == NULL)
+		return; /* not synchronized yet, the next message will do */
+	if(clock != data->sync_clock) {
+		/* Takes effect with the next change to PLAYING, which every resync goes through */
+		data->sync_clock = clock;
+		gst_pipeline_use_clock(GST_PIPELINE(data->pipeline), clock);
+		data->sync_stage = SYNC_IDLE;
+		data->sync_skew  = G_MININT64;
+	}
+
+	const gchar * uri   = json_object_get_string_member(message, "uri");
+	const gchar * state = json_object_get_string_member(message, "state");
+	data->sync_position = json_object_get_int_member(message, "position");
+	data->sync_time     = json_object_get_int_member(message, "clock");
+	data->sync_rate     = json_object_get_double_member(message, "rate");
+	data->sync_playing  = g_strcmp0(state, "playing") == 0 && data->sync_rate > 0;
+	if(data->sync_rate <= 0)
+		data->sync_rate = 1.0;
+
+	if(uri == NULL || g_strcmp0(state, "stopped") == 0) {
+		data->sync_stage = SYNC_IDLE;
+		if(data->state > GST_STATE_READY)
+			gst_element_set_state(data->pipeline, GST_STATE_READY);
+		return;
+	}
+
+	/* A gapless transition to the same uri may already be under way here */
+	gchar * current = playing_uri(data, "current-uri", NULL);
+	gchar * next    = playing_uri(data, "uri", NULL);
+	gboolean loaded  = g_strcmp0(uri, current) == 0 && data->state >= GST_STATE_PAUSED;
+	gboolean gapless = !loaded && g_strcmp0(uri, next) == 0 && data->state == GST_STATE_PLAYING;
+	g_free(current);
+	g_free(next);
+	if(!loaded && !gapless && data->sync_stage != SYNC_PREROLL) {
+		gchar * resolved = variant_uri(data, uri);
+		g_print("[SYNC] load %s\n", uri);
+		gst_element_set_state(data->pipeline, GST_STATE_READY);
+		g_object_set(data->playbin, "uri", resolved, NULL);
+		g_free(resolved);
+		data->duration   = GST_CLOCK_TIME_NONE;
+		data->sync_stage = SYNC_PREROLL;
+		data->sync_skew  = G_MININT64;
+		gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+		return;
+	}
+	if(!loaded || data->sync_stage != SYNC_IDLE)
+		return;
+
+	gint64 position;
+	if(!gst_element_query_position(data->playbin, GST_FORMAT_TIME, &position))
+		return;
+	if(!data->sync_playing) {
+		if(data->state == GST_STATE_PLAYING || ABS(position - data->sync_position) > SYNC_TOLERANCE)
+			sync_seek(data);
+		return;
+	}
+
+	if(data->state == GST_STATE_PLAYING) {
+		gint64 now = gst_clock_get_time(clock);
+		data->sync_skew = position - (data->sync_position + (gint64)((now - data->sync_time) * data->sync_rate));
+		metrics_set(data->metrics, "banana_sync_skew_seconds", data->sync_skew / 1e9);
+		sync_report_skew(data);
+		if(ABS(data->sync_skew) <= SYNC_TOLERANCE)
+			return;
+		g_print("[SYNC] %.1f ms off, resynchronizing\n", data->sync_skew / 1e6);
+	}
+	sync_seek(data);
+}
+
+
+/* The queue of a follower is a copy of the master's, so queue indices mean the same on both */
+static void sync_mirror_queue(CustomData * data, JsonObject * message) {
+	JsonArray * items = json_object_get_array_member(message, "items");
+	play_queue_clear(data->queue);
+	for(guint i = 0; i < json_array_get_length(items); i++)
+		play_queue_insert(data->queue, -1, json_array_get_string_element(items, i));
+	play_queue_set_current(data->queue, json_object_get_int_member(message, "current"));
+	broadcast_queue(data);
+}
+
+
+static void sync_message_cb(JsonObject * message, CustomData * data) {
+	const gchar * type = json_object_get_string_member(message, "type");
+	if(g_strcmp0(type, "sync") == 0)
+		sync_follow(data, message);
+	else if(g_strcmp0(type, "queue") == 0)
+		sync_mirror_queue(data, message);
+}
+
+
+/* Commands that change what plays, or the queue, which followers leave to the master */
+static gboolean sync_is_shared_command(const gchar * type) {
+	static const gchar * const shared[] = {
+		"load", "enqueue", "enqueue-directory", "move", "remove", "clear", "play-item", "next", "prev",
+		"play", "pause", "stop", "rate", "seek", "jump",
+	};
+	for(guint i = 0; i < G_N_ELEMENTS(shared); i++)
+		if(g_strcmp0(type, shared[i]) == 0)
+			return TRUE;
+	return FALSE;
+}
+
+
+/* Starts playing item `index' of the queue right away. A cold load goes through READY, which tears
+ * down the demuxers and decoders and renegotiates the sinks. A warm load lets playbin3 switch to
+ * the new uri in place, keeping every element whose caps still fit; it only applies to a running
+ * pipeline. `instant-uri' is only switched on for this, so gapless transitions stay gapless. */
+static void play_item(CustomData * data, gint index) {
+	if(index < 0 || index >= (gint)play_queue_length(data->queue))
+		return;
+	resume_remember(data);
+	play_queue_set_current(data->queue, index);
+
+	const gchar * path   = play_queue_get(data->queue, index);
+	gint64        resume = resume_store_get(data->resume, path);
+	gchar *       file   = data->variants ? variant_cache_resolve(data->variants, path) : g_strdup(path);
+	gchar *       uri    = g_filename_to_uri(file, NULL, NULL);
+	g_free(file);
+	if(uri != NULL) {
+		/* Resuming needs a preroll of its own, which only a cold load has */
+		data->last_was_warm = data->warm_load && data->state >= GST_STATE_PAUSED && resume < 0;
+		data->load_started  = g_get_monotonic_time();
+		data->loads++;
+		data->ttff_ms       = -1;
+		data->rate          = 1.0;
+		seek_reset(data);
+
+		data->buffering         = 100;
+		data->buffering_paused  = FALSE;
+		data->readahead_waiting = FALSE;
+		data->ttff_audio        = -1;
+		g_atomic_int_set(&data->ttff_pending, TRUE);
+		g_atomic_int_set(&data->ttff_audio_pending, TRUE);
+		resume_cancel(data);
+
+		if(data->last_was_warm)
+			g_object_set(data->playbin, "instant-uri", TRUE, "uri", uri, "instant-uri", FALSE, NULL);
+		else {
+			gst_element_set_state(data->pipeline, GST_STATE_READY);
+			g_object_set(data->playbin, "uri", uri, NULL);
+		}
+		data->duration = GST_CLOCK_TIME_NONE;
+
+		/* With a resume point we preroll without showing the frame, and only go on playing after
+		 * a single accurate seek there (see async_done_cb), so the start never flashes by */
+		if(resume >= 0) {
+			g_print("[RESUME] %s at %" GST_TIME_FORMAT "\n", path, GST_TIME_ARGS(resume));
+			data->resume_target = resume;
+			set_show_preroll(data, FALSE);
+			gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+		}
+		else
+			gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+		g_free(uri);
+	}
+	broadcast_queue(data);
+}
+
+
+/* Appends the media files of a directory to the queue, in listing order */
+static void enqueue_directory_listing(CustomData * data, DirListing * listing) {
+	for(guint i = 0; i < listing->files->len; i++) {
+		DirListingFile * file = g_ptr_array_index(listing->files, i);
+		gchar *          path = g_strconcat(listing->path, file->name, NULL);
+		if(metadata_is_media_file(path))
+			play_queue_insert(data->queue, -1, path);
+		g_free(path);
+	}
+	broadcast_queue(data);
+}
+
+
+/* Pending scans and parse jobs may still hold a reference after the connection closed; anything
+ * they try to send afterwards is dropped by client_flush() */
+static void websocket_onclosed(SoupWebsocketConnection * self, Client * client) {
+	printf("[WS] closed\n");
+	client->data->websockets = g_list_remove(client->data->websockets, client);
+	g_signal_handlers_disconnect_by_data(client->connection, client);
+	if(client->stream != NULL) {
+		listing_stream_free(client->stream);
+		client->stream = NULL;
+	}
+	client_unref(client);
+}
+
+
+static void websocket_onerror(SoupWebsocketConnection * self, GError * error, Client * client) {
+	printf("[WS] error\n");
+}
+
+
+/* Command types get a series of their own; anything else would let clients create series at will */
+static const gchar * const command_series[] = {
+	"ack", "browse", "search", "load", "enqueue", "enqueue-directory", "move", "remove", "clear",
+	"play-item", "next", "prev", "play", "pause", "stop", "rate", "audio-only", "fullscreen", "seek", "jump",
+	"sync-skew",
+};
+
+
+static void observe_command(CustomData * data, const gchar * type, gint64 started) {
+	const gchar * label = NULL;
+	for(guint i = 0; i < G_N_ELEMENTS(command_series) && label == NULL; i++)
+		if(g_strcmp0(type, command_series[i]) == 0)
+			label = command_series[i];
+
+	gchar * series = g_strdup_printf("banana_command_seconds{type=\"%s\"}", label ? label : "other");
+	metrics_observe(data->metrics, series, (g_get_monotonic_time() - started) / 1e6);
+	g_free(series);
+}
+
+
+static void handle_command(Client * client, JsonObject * object) {
+	CustomData * data    = client->data;
+	gint64       started = g_get_monotonic_time();
+
+	const gchar * type = json_object_get_string_member(object, "type");
+	if(g_strcmp0(type, "ack") == 0)
+		client_ack(client);
+	else if(data->follower != NULL && sync_is_shared_command(type)) {
+		/* The master tells every room, this one included */
+		g_print("[WS] %s, forwarded to the master\n", type);
+		sync_follower_send(data->follower, object);
+	}
+	else if(g_strcmp0(type, "sync-skew") == 0) {
+		if(client->follower) {
+			const gchar * name = json_object_get_string_member(object, "name");
+			if(name != NULL && g_strcmp0(name, client->follower_name) != 0) {
+				g_free(client->follower_name);
+				client->follower_name = g_strdup(name);
+			}
+			client->skew = json_object_get_double_member(object, "skew") * 1000000;
+		}
+	}
+	else if(g_strcmp0(type, "browse") == 0) {
+		const gchar * path = json_object_get_string_member(object, "path");
+		if(path != NULL) {
+			g_print("[WS] browse %s\n", path);
+			thumb_service_set_folder(data->thumbs, path);
+			if(json_object_has_member(object, "stream") && json_object_get_boolean_member(object, "stream")) {
+				gint64 chunk = json_object_has_member(object, "limit") ? json_object_get_int_member(object, "limit") : BROWSE_STREAM_CHUNK;
+				browse(client, path, BROWSE_STREAM, 0, MAX(chunk, 1));
+			}
+			else if(json_object_has_member(object, "offset") || json_object_has_member(object, "limit")) {
+				gint64 offset = json_object_has_member(object, "offset") ? json_object_get_int_member(object, "offset") : 0;
+				gint64 limit  = json_object_has_member(object, "limit" ) ? json_object_get_int_member(object, "limit" ) : BROWSE_PAGE_MAX;
+				browse(client, path, BROWSE_PAGE, MAX(offset, 0), MAX(limit, 0));
+			}
+			else
+				browse(client, path, BROWSE_FULL, 0, 0);
+		}
+	}
+	else if(g_strcmp0(type, "search") == 0) {
+		const gchar * query = json_object_get_string_member(object, "query");
+		if(query != NULL) {
+			gint64 limit = json_object_has_member(object, "limit") ? json_object_get_int_member(object, "limit") : SEARCH_RESULTS;
+			g_print("[WS] search %s\n", query);
+			send_search_results(client, query, CLAMP(limit, 1, BROWSE_PAGE_MAX));
+		}
+	}
+	else if(g_strcmp0(type, "load") == 0) {
+		/* Plays the file right away; it becomes the current item and the queue goes on after it */
+		const gchar * path = json_object_get_string_member(object, "path");
+		if(path != NULL) {
+			g_print("[WS] load %s\n", path);
+			gint index = play_queue_current(data->queue) + 1;
+			play_queue_insert(data->queue, index, path);
+			play_item(data, index);
+		}
+	}
+	else if(g_strcmp0(type, "enqueue") == 0) {
+		const gchar * path = json_object_get_string_member(object, "path");
+		if(path != NULL) {
+			g_print("[WS] enqueue %s\n", path);
+			gboolean next = json_object_has_member(object, "next") && json_object_get_boolean_member(object, "next");
+			play_queue_insert(data->queue, next ? play_queue_current(data->queue) + 1 : -1, path);
+			broadcast_queue(data);
+		}
+	}
+	else if(g_strcmp0(type, "enqueue-directory") == 0) {
+		const gchar * path = json_object_get_string_member(object, "path");
+		if(path != NULL) {
+			g_print("[WS] enqueue-directory %s\n", path);
+			browse(client, path, BROWSE_ENQUEUE, 0, 0);
+		}
+	}
+	else if(g_strcmp0(type, "move") == 0) {
+		gint64 from = json_object_get_int_member(object, "from");
+		gint64 to   = json_object_get_int_member(object, "to");
+		if(from >= 0 && to >= 0 && play_queue_move(data->queue, from, to))
+			broadcast_queue(data);
+	}
+	else if(g_strcmp0(type, "remove") == 0) {
+		gint64 index = json_object_get_int_member(object, "index");
+		if(index >= 0 && play_queue_remove(data->queue, index))
+			broadcast_queue(data);
+	}
+	else if(g_strcmp0(type, "clear") == 0) {
+		play_queue_clear(data->queue);
+		broadcast_queue(data);
+		g_print("[WS] clear\n");
+	}
+	else if(g_strcmp0(type, "play-item") == 0) {
+		gint64 index = json_object_get_int_member(object, "index");
+		g_print("[WS] play-item %" G_GINT64_FORMAT "\n", index);
+		play_item(data, index);
+	}
+	else if(g_strcmp0(type, "next") == 0) {
+		g_print("[WS] next\n");
+		play_item(data, play_queue_current(data->queue) + 1);
+	}
+	else if(g_strcmp0(type, "prev") == 0) {
+		/* Like any player: back to the start of the item first, to the previous one if already there */
+		g_print("[WS] prev\n");
+		gint64 position;
+		if(data->state >= GST_STATE_PAUSED && seek_base(data, &position) && position > 3 * GST_SECOND)
+			seek_to(data, 0, FALSE);
+		else
+			play_item(data, MAX(play_queue_current(data->queue) - 1, 0));
+	}
+	else if(g_strcmp0(type, "play") == 0) {
+		/* After a stop or at startup, the queue says what to play */
+		if(data->state <= GST_STATE_READY && play_queue_length(data->queue) > 0)
+			play_item(data, MAX(play_queue_current(data->queue), 0));
+		else if(data->buffering < 100)
+			data->buffering_paused = TRUE; /* starts as soon as the buffers are full */
+		else
+			gst_element_set_state(data->pipeline, GST_STATE_PLAYING);
+		g_print("[WS] play\n");
+	}
+	else if(g_strcmp0(type, "pause") == 0) {
+		data->buffering_paused = FALSE;
+		gst_element_set_state(data->pipeline, GST_STATE_PAUSED);
+		g_print("[WS] pause\n");
+	}
+	else if(g_strcmp0(type, "stop") == 0) {
+		resume_remember(data);
+		resume_cancel(data);
+		gst_element_set_state(data->pipeline, GST_STATE_READY);
+		g_print("[WS] stop\n");
+	}
+	else if(g_strcmp0(type, "rate") == 0) {
+		/* 0.5x to 2x with pitch corrected audio, or a keyframe scan at up to 16x in either direction */
+		gdouble rate = json_object_get_double_member(object, "rate");
+		g_print("[WS] rate %.2f\n", rate);
+		if((rate >= RATE_MIN && rate <= SCAN_MAX) || (rate < 0 && rate >= -SCAN_MAX)) {
+			set_rate(data, rate);
+			broadcast_status(data);
+		}
+	}
+	else if(g_strcmp0(type, "audio-only") == 0) {
+		gboolean enabled = json_object_get_boolean_member(object, "enabled");
+		g_print("[WS] audio-only %s\n", enabled ? "on" : "off");
+		set_audio_only(data, enabled);
+	}
+	else if(g_strcmp0(type, "fullscreen") == 0) {
+		if(data->main_window != NULL)
+			gtk_window_fullscreen(GTK_WINDOW(data->main_window));
+		g_print("[WS] fullscreen\n");
+		broadcast_status(data);
+	}
+	else if(g_strcmp0(type, "seek") == 0) {
+		double   percent  = json_object_get_double_member(object, "percent");
+		gboolean accurate = json_object_has_member(object, "accurate") && json_object_get_boolean_member(object, "accurate");
+		g_print("[WS] seek %f%%%s\n", percent, accurate ? " accurate" : "");
+		if(GST_CLOCK_TIME_IS_VALID(data->duration))
+			seek_to(data, percent / 100.0 * data->duration, accurate);
+	}
+	else if(g_strcmp0(type, "jump") == 0) {
+		gint64   ms       = json_object_get_int_member(object, "ms");
+		gboolean accurate = json_object_has_member(object, "accurate") && json_object_get_boolean_member(object, "accurate");
+		g_print("[WS] jump %" G_GINT64_FORMAT "ms%s\n", ms, accurate ? " accurate" : "");
+		gint64 position;
+		if(seek_base(data, &position))
+			seek_to(data, position + ms * GST_MSECOND, accurate);
+	}
+
+	observe_command(data, type, started);
+}
+
+
+/* Text frames are JSON and binary frames MessagePack, whatever the client gets sent */
+static JsonNode * parse_command(GBytes * message, gint type) {
+	gsize         size;
+	const gchar * text = g_bytes_get_data(message, &size);
+	JsonNode *    node = NULL;
+
+	if(type == SOUP_WEBSOCKET_DATA_BINARY)
+		node = wire_msgpack_decode(message, NULL);
+	else {
+		JsonParser * parser = json_parser_new();
+		if(json_parser_load_from_data(parser, text, size, NULL))
+			node = json_node_ref(json_parser_get_root(parser));
+		g_object_unref(parser);
+	}
+
+	if(node == NULL || json_node_get_node_type(node) != JSON_NODE_OBJECT) {
+		if(type == SOUP_WEBSOCKET_DATA_BINARY)
+			g_printerr("[ERR] bad msgpack request of %" G_GSIZE_FORMAT " bytes\n", size);
+		else
+			g_printerr("[ERR] bad json request: %.*s\n", (int)size, text);
+		if(node != NULL)
+			json_node_unref(node);
+		return NULL;
+	}
+	return node;
+}
+
+
+/* Requests too large to be transport commands are parsed in a worker thread. Anything else the
+ * client sends meanwhile waits behind them, so its commands always run in the order they came. */
+typedef struct _ParseJob {
+	Client *     client;
+	GBytes *     message; /* NULL once parsed */
+	gint         type;
+	JsonNode *   command; /* result */
+} ParseJob;
+
+
+static void parse_job_free(ParseJob * job) {
+	if(job->command != NULL)
+		json_node_unref(job->command);
+	if(job->message != NULL)
+		g_bytes_unref(job->message);
+	client_unref(job->client);
+	g_slice_free(ParseJob, job);
+}
+
+
+static void parse_job_run(ParseJob * job) {
+	job->command = parse_command(job->message, job->type);
+	g_bytes_unref(job->message);
+	job->message = NULL;
+}
+
+
+static void parse_job_done(ParseJob * job);
+
+
+/* Runs the waiting commands of `client' up to the next one that still needs parsing */
+static void client_run_commands(Client * client) {
+	client_ref(client);
+	ParseJob * job;
+	while(!client->parsing && (job = g_queue_pop_head(&client->commands)) != NULL) {
+		if(job->message != NULL) {
+			client->parsing = TRUE;
+			g_queue_push_head(&client->commands, job);
+			worker_pool_push(client->data->parse_pool, (WorkerFunc)parse_job_run, (WorkerFunc)parse_job_done, job);
+			break;
+		}
+
+		if(job->command != NULL && soup_websocket_connection_get_state(client->connection) == SOUP_WEBSOCKET_STATE_OPEN)
+			handle_command(client, json_node_get_object(job->command));
+		parse_job_free(job);
+	}
+	client_unref(client);
+}
+
+
+static void parse_job_done(ParseJob * job) {
+	job->client->parsing = FALSE;
+	client_run_commands(job->client);
+}
+
+
+static void websocket_onmessage(SoupWebsocketConnection * self, gint type, GBytes * message, Client * client) {
+	ParseJob * job = g_slice_new0(ParseJob);
+	job->client = client_ref(client);
+	job->type   = type;
+
+	/* Fast path: play/pause/seek and friends are tiny and parsed right away, they must never wait
+	 * behind a directory scan. Acks only free the window and may overtake anything. */
+	if(g_bytes_get_size(message) > COMMAND_FAST_PATH_MAX)
+		job->message = g_bytes_ref(message);
+	else {
+		job->command = parse_command(message, type);
+		JsonObject * object = job->command ? json_node_get_object(job->command) : NULL;
+		if(object != NULL && g_strcmp0(json_object_get_string_member(object, "type"), "ack") == 0) {
+			handle_command(client, object);
+			parse_job_free(job);
+			return;
+		}
+	}
+
+	g_queue_push_tail(&client->commands, job);
+	client_run_commands(client);
+}
+
+
+static void websocket_onconnect(SoupServer * server, SoupWebsocketConnection * connection, const char * path, SoupClientContext * context, CustomData * data) {
+	Client * client = g_slice_new0(Client);
+	client->ref_count  = 1;
+	client->connection = g_object_ref(connection); /* important: keep a reference */
+	client->data       = data;
+	client->format     = wire_format_from_protocol(soup_websocket_connection_get_protocol(connection));
+	client->follower   = g_strcmp0(soup_websocket_connection_get_protocol(connection), SYNC_PROTOCOL) == 0;
+	client->skew       = G_MININT64;
+	printf("[WS] connect, %s\n", client->follower ? "follower" : client->format == WIRE_MSGPACK ? "msgpack" : "json");
+	g_queue_init(&client->outbox);
+	g_queue_init(&client->commands);
+
+	data->websockets = g_list_prepend(data->websockets, client);
+	g_signal_connect(connection, "closed",  (GCallback)websocket_onclosed , client);
+	g_signal_connect(connection, "error",   (GCallback)websocket_onerror  , client);
+	g_signal_connect(connection, "message", (GCallback)websocket_onmessage, client);
+
+	update_status(data);
+	client_send_status(client, data->status);
+
+	WireFrame * queue = queue_json(data);
+	client_send(client, queue);
+	wire_frame_unref(queue);
+
+	/* Followers have no use for listings, but need to know right away what to play */
+	if(!client->follower)
+		browse(client, data->root_dir, BROWSE_PAGE, 0, BROWSE_STREAM_CHUNK);
+	else if(data->clock_provider != NULL)
+		broadcast_sync(data);
+}
+
+
+/* A timer that runs late by as much as the main loop is busy with something else */
+static gboolean lag_probe_cb(CustomData * data) {
+	gint64 now = g_get_monotonic_time();
+	metrics_observe(data->metrics, "banana_main_loop_lag_seconds", MAX(now - data->lag_probed - LAG_PROBE_MS * 1000, 0) / 1e6);
+	data->lag_probed = now;
+	return TRUE;
+}
+
+
+static const gdouble latency_buckets[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+static const gdouble load_buckets[]    = { 0.05, 0.1, 0.2, 0.35, 0.5, 0.75, 1, 1.5, 2, 3, 5, 10 };
+static const gdouble entries_buckets[] = { 10, 100, 1000, 10000, 100000 };
+
+
+static void metrics_setup(Metrics * metrics) {
+	metrics_declare(metrics, "banana_main_loop_lag_seconds", METRICS_HISTOGRAM, "How late main loop timers run", latency_buckets, G_N_ELEMENTS(latency_buckets));
+	metrics_declare(metrics, "banana_command_seconds", METRICS_HISTOGRAM, "Time spent handling websocket commands, by type", latency_buckets, G_N_ELEMENTS(latency_buckets));
+	metrics_declare(metrics, "banana_browse_total", METRICS_COUNTER, "Directory listings requested, by whether they were cached", NULL, 0);
+	metrics_declare(metrics, "banana_browse_seconds", METRICS_HISTOGRAM, "Time from a browse request to its reply", latency_buckets, G_N_ELEMENTS(latency_buckets));
+	metrics_declare(metrics, "banana_browse_entries", METRICS_HISTOGRAM, "Entries of the directory listings served", entries_buckets, G_N_ELEMENTS(entries_buckets));
+	metrics_declare(metrics, "banana_load_first_frame_seconds", METRICS_HISTOGRAM, "Time from a load to the first buffer reaching a sink", load_buckets, G_N_ELEMENTS(load_buckets));
+	metrics_declare(metrics, "banana_qos_dropped_frames_total", METRICS_COUNTER, "Video frames the video sink dropped for being late", NULL, 0);
+	metrics_declare(metrics, "banana_qos_level", METRICS_GAUGE, "Current decoding level, 0 decodes everything", NULL, 0);
+	metrics_declare(metrics, "banana_buffering_events_total", METRICS_COUNTER, "Times playback paused to buffer", NULL, 0);
+	metrics_declare(metrics, "banana_websocket_clients", METRICS_GAUGE, "Connected websocket clients", NULL, 0);
+	metrics_declare(metrics, "banana_websocket_outbox_messages", METRICS_GAUGE, "Replies queued for websocket clients", NULL, 0);
+	metrics_declare(metrics, "banana_websocket_sent_bytes_total", METRICS_COUNTER, "Bytes of websocket messages sent before compression, by encoding", NULL, 0);
+	metrics_declare(metrics, "banana_websocket_in_flight_frames", METRICS_GAUGE, "Frames sent to websocket clients and not acknowledged yet", NULL, 0);
+	metrics_declare(metrics, "banana_sync_followers", METRICS_GAUGE, "Players following this one", NULL, 0);
+	metrics_declare(metrics, "banana_sync_skew_seconds", METRICS_GAUGE, "Position of this follower minus that of its master", NULL, 0);
+	metrics_declare(metrics, "banana_watch_along_cached_bytes", METRICS_GAUGE, "Memory held by segments of the watch-along stream", NULL, 0);
+	metrics_declare(metrics, "banana_variant_loads_total", METRICS_COUNTER, "Heavy files started, by whether a lighter variant was ready", NULL, 0);
+	metrics_declare(metrics, "banana_variant_cache_bytes", METRICS_GAUGE, "Disk space taken by lighter variants", NULL, 0);
+	metrics_declare(metrics, "process_resident_memory_bytes", METRICS_GAUGE, "Resident memory size in bytes", NULL, 0);
+}
+
+
+/* Gauges are read when scraped, so keeping them up to date costs nothing in between */
+static void metrics_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, CustomData * data) {
+	if(msg->method != SOUP_METHOD_GET) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	guint outbox = 0, in_flight = 0, followers = 0;
+	for(GList * l = data->websockets; l != NULL; l = l->next) {
+		Client * client = l->data;
+		outbox    += g_queue_get_length(&client->outbox);
+		in_flight += client->acks ? client->in_flight : 0;
+		followers += client->follower;
+	}
+	metrics_set(data->metrics, "banana_sync_followers", followers);
+	metrics_set(data->metrics, "banana_websocket_clients", g_list_length(data->websockets));
+	metrics_set(data->metrics, "banana_websocket_outbox_messages", outbox);
+	metrics_set(data->metrics, "banana_websocket_in_flight_frames", in_flight);
+	metrics_set(data->metrics, "banana_qos_level", data->qos_level);
+	if(data->watch != NULL)
+		metrics_set(data->metrics, "banana_watch_along_cached_bytes", watch_along_cached(data->watch));
+	if(data->variants != NULL)
+		metrics_set(data->metrics, "banana_variant_cache_bytes", variant_cache_size(data->variants));
+
+	gchar * statm;
+	if(g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+		guint64 pages = 0, resident = 0;
+		if(sscanf(statm, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, &pages, &resident) == 2)
+			metrics_set(data->metrics, "process_resident_memory_bytes", (gdouble)resident * sysconf(_SC_PAGESIZE));
+		g_free(statm);
+	}
+
+	GString * text = metrics_render(data->metrics);
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE, text->str, text->len);
+	g_string_free(text, FALSE);
+}
+
+
+int main(int argc, char * argv[]) {
+	/* Initialize our data structure */
+	CustomData data;
+	memset(&data, 0, sizeof(data));
+	data.duration      = GST_CLOCK_TIME_NONE;
+	data.buffering     = 100;
+	data.tick_ms       = STATUS_TICK_MS;
+	data.ttff_ms       = -1;
+	data.ttff_audio    = -1;
+	data.seek_target   = -1;
+	data.rate          = 1.0;
+	data.resume_target = -1;
+	data.port          = HTTP_PORT;
+	data.sync_skew     = G_MININT64;
+
+	/* Parse the command line */
+	gchar * video_sink_description = NULL;
+	gchar * audio_sink_description = NULL;
+	gint    readahead_mb           = READAHEAD_MB;
+	gint    prefetch_mb            = PREFETCH_MB;
+	gboolean headless              = FALSE;
+	gboolean no_deflate            = FALSE;
+	gint     sync_master_port      = 0;
+	gchar *  sync_follow           = NULL;
+	gboolean watch_along           = FALSE;
+	gint     variant_cache_mb      = VARIANT_CACHE_MB;
+	GOptionEntry entries[] = {
+		{ "headless",   0, 0, G_OPTION_ARG_NONE,     &headless,               "Open no window and play into fakesinks, unless other sinks are given", NULL },
+		{ "tick-ms",    0, 0, G_OPTION_ARG_INT,      &data.tick_ms,           "Interval of position updates sent to clients, 0 to disable", "MS" },
+		{ "cache-dir",  0, 0, G_OPTION_ARG_FILENAME, &data.cache_dir,         "Directory for the metadata index and other caches", "DIR" },
+		{ "warm-load",  0, 0, G_OPTION_ARG_NONE,     &data.warm_load,         "Switch files without stopping the pipeline (needs playbin3)", NULL },
+		{ "video-sink", 0, 0, G_OPTION_ARG_STRING,   &video_sink_description, "Video sink element or chain, default autovideosink", "SINK" },
+		{ "audio-sink", 0, 0, G_OPTION_ARG_STRING,   &audio_sink_description, "Audio sink element or chain, default autoaudiosink", "SINK" },
+		{ "readahead",  0, 0, G_OPTION_ARG_INT,      &readahead_mb,           "Megabytes of the playing file to read ahead, 0 to disable", "MB" },
+		{ "prefetch",   0, 0, G_OPTION_ARG_INT,      &prefetch_mb,            "Megabytes of the next queued file to read in advance", "MB" },
+		{ "no-deflate", 0, 0, G_OPTION_ARG_NONE,     &no_deflate,             "Never compress websocket messages, even for clients that ask for it", NULL },
+		{ "port",       0, 0, G_OPTION_ARG_INT,      &data.port,              "Port of the web interface, default 3001", "PORT" },
+		{ "sync-master", 0, 0, G_OPTION_ARG_INT,     &sync_master_port,       "Lead other players, publishing the clock on this UDP port", "PORT" },
+		{ "sync-follow", 0, 0, G_OPTION_ARG_STRING,  &sync_follow,            "Play in lockstep with the master at this address", "HOST:PORT" },
+		{ "watch-along", 0, 0, G_OPTION_ARG_NONE,    &watch_along,            "Re-stream what plays as HLS at /live/index.m3u8", NULL },
+		{ "variant-cache", 0, 0, G_OPTION_ARG_INT,   &variant_cache_mb,       "Megabytes of lighter variants of heavy files to keep, 0 to disable", "MB" },
+		{ NULL }
+	};
+	GError * error = NULL;
+	GOptionContext * option_context = g_option_context_new("[ROOT_DIR]");
+	g_option_context_add_main_entries(option_context, entries, NULL);
+	g_option_context_add_group(option_context, gtk_get_option_group(FALSE));
+	g_option_context_add_group(option_context, gst_init_get_option_group());
+	if(!g_option_context_parse(option_context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return -1;
+	}
+	g_option_context_free(option_context);
+
+	/* Initialize GTK */
+	if(!headless)
+		gtk_init(&argc, &argv);
+
+	/* Initialize GStreamer */
+	gst_init(&argc, &argv);
+
+	if(argc == 2)
+		data.root_dir = g_strdup(argv[1]);
+	else
+		data.root_dir = g_get_current_dir();
+	if(data.root_dir[strlen(data.root_dir) - 1] != '/') {
+		gchar * str = g_strdup_printf("%s/", data.root_dir);
+		g_free(data.root_dir);
+		data.root_dir = str;
+	}
+	if(data.cache_dir == NULL)
+		data.cache_dir = g_build_filename(g_get_user_cache_dir(), "banana-player", NULL);
+
+	/* Create the elements */
+	data.pipeline = gst_pipeline_new(NULL);
+	if(data.warm_load) {
+		/* Switching uris in place is only implemented by playbin3, since GStreamer 1.22 */
+		data.playbin = gst_element_factory_make("playbin3", "playbin");
+		if(data.playbin == NULL || !g_object_class_find_property(G_OBJECT_GET_CLASS(data.playbin), "instant-uri")) {
+			g_printerr("playbin3 with instant-uri is not available, warm loads disabled.\n");
+			if(data.playbin)
+				gst_object_unref(data.playbin);
+			data.playbin   = NULL;
+			data.warm_load = FALSE;
+		}
+	}
+	if(data.playbin == NULL)
+		data.playbin = gst_element_factory_make("playbin", "playbin");
+	/* Headless sinks still sync to the clock, so playback takes as long as it would on screen */
+	const gchar * default_video_sink = headless ? "fakesink sync=true" : "autovideosink";
+	const gchar * default_audio_sink = headless ? "fakesink sync=true" : "autoaudiosink";
+	data.video_sink = create_sink(video_sink_description ? video_sink_description : default_video_sink, (GstPadProbeCallback)first_video_probe, &data);
+	GstElement * audio_sink = create_sink(audio_sink_description ? audio_sink_description : default_audio_sink, (GstPadProbeCallback)first_audio_probe, &data);
+	g_free(video_sink_description);
+	g_free(audio_sink_description);
+	if(!data.pipeline || !data.playbin || !data.video_sink || !audio_sink) {
+		g_printerr("Not all elements could be created.\n");
+		return -1;
+	}
+	g_object_set(data.playbin, "video-sink", data.video_sink, "audio-sink", audio_sink, NULL);
+	g_object_get(data.playbin, "flags", &data.play_flags, NULL);
+
+	/* Several players in lockstep: the master runs on the system clock and publishes it, the
+	 * followers slave to it once it is known and choose their base time themselves */
+	if(sync_master_port > 0 && sync_follow != NULL) {
+		g_printerr("A player cannot be master and follower at once.\n");
+		return -1;
+	}
+	if(sync_master_port > 0) {
+		data.sync_clock     = gst_system_clock_obtain();
+		data.clock_provider = gst_net_time_provider_new(data.sync_clock, NULL, sync_master_port);
+		if(data.clock_provider == NULL) {
+			g_printerr("Cannot publish the clock on port %d.\n", sync_master_port);
+			return -1;
+		}
+		data.sync_clock_port = sync_master_port;
+		gst_pipeline_use_clock(GST_PIPELINE(data.pipeline), data.sync_clock);
+	}
+
+	/* Network streams are buffered by playbin, as much as files are read ahead */
+	if(readahead_mb > 0)
+		g_object_set(data.playbin, "buffer-size", (gint)MIN((gint64)readahead_mb << 20, G_MAXINT), NULL);
+
+	/* Keeps the pitch of the audio when playing faster or slower */
+	GstElement * scaletempo = gst_element_factory_make("scaletempo", NULL);
+	if(scaletempo != NULL)
+		g_object_set(data.playbin, "audio-filter", scaletempo, NULL);
+	else
+		g_printerr("scaletempo is not available, audio pitch will follow the playback rate.\n");
+	gst_bin_add(GST_BIN(data.pipeline), data.playbin);
+
+	data.metrics    = metrics_new();
+	metrics_setup(data.metrics);
+	data.queue      = play_queue_new();
+	if(readahead_mb > 0)
+		data.readahead = read_ahead_new((gsize)readahead_mb << 20, (gsize)MAX(prefetch_mb, 0) << 20);
+	data.assets     = asset_cache_new("public");
+	data.media      = media_server_new(data.root_dir, MEDIA_MAX_STREAMS);
+	data.dir_index  = dir_index_new(DIR_INDEX_MAX_ENTRIES);
+
+	gchar * metadata_file = g_build_filename(data.cache_dir, "metadata.idx", NULL);
+	data.metadata   = metadata_index_new(data.root_dir, metadata_file, METADATA_DISCOVERERS, (MetadataUpdatedFunc)metadata_updated_cb, &data);
+	g_free(metadata_file);
+	data.thumbs     = thumb_service_new(data.root_dir, data.cache_dir, THUMB_WORKERS);
+	if(variant_cache_mb > 0)
+		data.variants = variant_cache_new(data.cache_dir, (guint64)variant_cache_mb << 20, (VariantChangedFunc)variant_changed_cb, &data);
+
+	gchar * resume_file = g_build_filename(data.cache_dir, "resume.log", NULL);
+	data.resume     = resume_store_new(resume_file);
+	g_free(resume_file);
+	data.search     = search_index_new(data.root_dir);
+	data.scans      = g_hash_table_new(g_str_hash, g_str_equal);
+	data.fs_pool    = worker_pool_new("filesystem", FS_WORKERS);
+	data.parse_pool = worker_pool_new("parser", 1);
+
+	/* Create the GUI */
+	if(headless)
+		data.loop = g_main_loop_new(NULL, FALSE);
+	else {
+		data.idle = idle_renderer_new();
+		data.main_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+		g_signal_connect(G_OBJECT(data.main_window), "delete-event", G_CALLBACK(delete_event_cb), (gpointer)&data);
+
+		data.video_widget = gtk_drawing_area_new();
+		g_signal_connect(data.video_widget, "realize", G_CALLBACK(realize_cb), (gpointer)&data);
+		g_signal_connect(data.video_widget, "draw"   , G_CALLBACK(draw_cb   ), (gpointer)&data);
+
+		gtk_container_add(GTK_CONTAINER(data.main_window), data.video_widget);
+		gtk_window_set_title(GTK_WINDOW(data.main_window), "Banana Player");
+		gtk_window_set_default_size(GTK_WINDOW(data.main_window), 1280, 720);
+
+		gtk_widget_show_all(data.main_window);
+		gtk_window_fullscreen(GTK_WINDOW(data.main_window));
+		gtk_window_set_keep_above(GTK_WINDOW(data.main_window), 1);
+
+		GdkCursor * cursor = gdk_cursor_new_for_display(gdk_display_get_default(), GDK_BLANK_CURSOR);
+		gdk_window_set_cursor(gtk_widget_get_window(GTK_WIDGET(data.main_window)), cursor);
+	}
+	g_unix_signal_add(SIGINT , (GSourceFunc)quit_signal_cb, &data);
+	g_unix_signal_add(SIGTERM, (GSourceFunc)quit_signal_cb, &data);
+
+	/* Instruct the bus to emit signals for each received message, and connect to the interesting signals */
+	GstBus * bus = gst_element_get_bus(data.pipeline);
+	gst_bus_add_signal_watch(bus);
+	g_signal_connect(G_OBJECT(bus), "message::error"        , (GCallback)error_cb        , &data);
+	g_signal_connect(G_OBJECT(bus), "message::eos"          , (GCallback)eos_cb          , &data);
+	g_signal_connect(G_OBJECT(bus), "message::state-changed", (GCallback)state_changed_cb, &data);
+	g_signal_connect(G_OBJECT(bus), "message::duration-changed", (GCallback)duration_changed_cb, &data);
+	g_signal_connect(G_OBJECT(bus), "message::async-done"   , (GCallback)async_done_cb   , &data);
+	g_signal_connect(G_OBJECT(bus), "message::buffering"    , (GCallback)buffering_cb    , &data);
+	g_signal_connect(G_OBJECT(bus), "message::stream-start" , (GCallback)stream_start_cb , &data);
+	g_signal_connect(G_OBJECT(bus), "message::application"  , (GCallback)application_cb  , &data);
+	g_signal_connect(G_OBJECT(bus), "message::qos"          , (GCallback)qos_cb          , &data);
+	gst_object_unref(bus);
+
+	/* Queued items are handed to playbin before the current one ends, for gapless playback */
+	g_signal_connect(data.playbin, "about-to-finish", (GCallback)about_to_finish_cb, &data);
+
+	/* New decoders start at the current decoding level, which follows the QoS of the video */
+	g_signal_connect(data.playbin, "element-setup", (GCallback)element_setup_cb, &data);
+	g_timeout_add(QOS_WINDOW_MS, (GSourceFunc)qos_tick_cb, &data);
+
+	/* Measure how responsive the main loop is */
+	data.lag_probed = g_get_monotonic_time();
+	g_timeout_add(LAG_PROBE_MS, (GSourceFunc)lag_probe_cb, &data);
+
+	/* Note where the playing file is, for resuming it later */
+	g_timeout_add_seconds(RESUME_TICK_SECONDS, (GSourceFunc)resume_tick_cb, &data);
+
+	/* Files are read ahead of playback, which pauses when the disk cannot keep up */
+	if(data.readahead != NULL) {
+		g_signal_connect(data.playbin, "source-setup", (GCallback)source_setup_cb, &data);
+		g_timeout_add(READAHEAD_TICK_MS, (GSourceFunc)readahead_tick_cb, &data);
+	}
+
+	/* Viewers on their phones follow what plays */
+	if(watch_along) {
+		data.watch = watch_along_new(WATCH_SEGMENTS, WATCH_SEGMENT_SECONDS);
+		g_timeout_add(WATCH_TICK_MS, (GSourceFunc)watch_tick_cb, &data);
+	}
+
+	/* Register a function that GLib will call every second */
+	data.refresh_source = g_timeout_add(120, (GSourceFunc)refresh_ui, &data);
+
+	/* Push position updates to the clients */
+	if(data.tick_ms > 0)
+		g_timeout_add(data.tick_ms, (GSourceFunc)position_tick_cb, &data);
+
+	SoupServer * server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "banana-player", NULL);
+	soup_server_listen_all(server, data.port, 0, &error);
+	soup_server_add_handler(server, "/", (SoupServerCallback)server_callback, &data, NULL);
+	soup_server_add_handler(server, "/media", (SoupServerCallback)media_server_callback, data.media, NULL);
+	soup_server_add_handler(server, "/thumb", (SoupServerCallback)thumb_service_callback, data.thumbs, NULL);
+	soup_server_add_handler(server, "/metrics", (SoupServerCallback)metrics_callback, &data, NULL);
+	if(data.watch != NULL)
+		soup_server_add_handler(server, "/live", (SoupServerCallback)watch_along_callback, data.watch, NULL);
+
+	/* Clients choose the encoding with the subprotocol, and get JSON if they ask for none. The
+	 * permessage-deflate extension is negotiated by libsoup for any client that offers it. */
+	static char * protocols[] = { WIRE_PROTOCOL_MSGPACK, WIRE_PROTOCOL_JSON, SYNC_PROTOCOL, NULL };
+#if SOUP_CHECK_VERSION(2, 68, 0)
+	if(no_deflate)
+		soup_server_remove_websocket_extension(server, SOUP_TYPE_WEBSOCKET_EXTENSION_DEFLATE);
+#endif
+	soup_server_add_websocket_handler(server, "/ws", NULL, protocols, (SoupServerWebsocketCallback)websocket_onconnect, &data, NULL);
+
+	if(sync_follow != NULL) {
+		gst_element_set_start_time(data.pipeline, GST_CLOCK_TIME_NONE);
+		data.follower = sync_follower_new(sync_follow, (SyncMessageFunc)sync_message_cb, &data);
+		g_free(sync_follow);
+		if(data.follower == NULL) {
+			g_printerr("--sync-follow needs the address of the master as HOST:PORT.\n");
+			return -1;
+		}
+	}
+
+	/* Start the main loop. We will not regain control until quit() is called. */
+	if(data.loop != NULL) {
+		g_print("Running headless\n");
+		g_main_loop_run(data.loop);
+		g_main_loop_unref(data.loop);
+	}
+	else
+		gtk_main();
+
+	/* Free resources */
+	gst_element_set_state(data.pipeline, GST_STATE_NULL);
+	gst_object_unref(data.pipeline);
+	gst_object_unref(data.playbin);
+	worker_pool_free(data.fs_pool);
+	worker_pool_free(data.parse_pool);
+	asset_cache_free(data.assets);
+	media_server_free(data.media);
+	thumb_service_free(data.thumbs);
+	if(data.variants)
+		variant_cache_free(data.variants);
+	search_index_free(data.search);
+	metadata_index_free(data.metadata);
+	dir_index_free(data.dir_index);
+	if(data.idle)
+		idle_renderer_free(data.idle);
+	play_queue_free(data.queue);
+	resume_store_free(data.resume);
+	metrics_free(data.metrics);
+	if(data.readahead)
+		read_ahead_free(data.readahead);
+	if(data.follower)
+		sync_follower_free(data.follower);
+	if(data.watch)
+		watch_along_free(data.watch);
+	if(data.clock_provider) {
+		gst_object_unref(data.clock_provider);
+		gst_object_unref(data.sync_clock);
+	}
+	g_hash_table_destroy(data.scans);
+	if(data.status)
+		wire_frame_unref(data.status);
 	g_free(data.root_dir);
+	g_free(data.cache_dir);
 	return 0;
 }
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+#include "media.h"
+#include "workers.h"
+
+
+#define MEDIA_PREFIX          "/media/"
+#define MEDIA_CHUNK_SIZE      (256 * 1024)  /* bytes per chunk read */
+#define MEDIA_CHUNKS_QUEUED   2             /* chunks handed to libsoup ahead of the socket */
+#define MEDIA_NICE            10            /* readers yield the CPU and the disk to local playback */
+
+
+struct _MediaServer {
+	gchar *      root_dir; /* canonical, ends with a '/' */
+	guint        max_streams;
+	guint        streams;  /* responses currently being opened or sent */
+	WorkerPool * readers;  /* threads opening files and reading chunks, so the main loop never waits for the disk */
+	gint         shutdown;
+};
+
+
+/* One response being streamed. Chunks are read by the worker pool one at a time and appended to
+ * the body back in the main context. The stream outlives its response while a read is in flight. */
+typedef struct _MediaStream {
+	gint          ref_count; /* only touched from the main context */
+	MediaServer * media;
+	SoupServer *  server;
+	SoupMessage * msg;
+	int           fd;
+	goffset       offset;    /* next byte to read */
+	goffset       end;       /* one past the last byte to send */
+	guint         queued;    /* chunks handed to libsoup but not written yet */
+	gboolean      reading;
+	gboolean      finished;  /* the response is over, chunks still being read are dropped */
+} MediaStream;
+
+
+typedef struct _MediaRead {
+	MediaStream * stream;
+	goffset       offset;
+	gsize         length;
+	gchar *       data;
+	gsize         done;      /* bytes read, short of `length' if the file shrank or failed */
+	int           error;
+} MediaRead;
+
+
+MediaServer * media_server_new(const gchar * root_dir, guint max_streams) {
+	MediaServer * media = g_slice_new0(MediaServer);
+	media->max_streams = max_streams;
+	media->readers     = worker_pool_new_full("media", MAX(max_streams, 1), MEDIA_NICE);
+
+	char * canonical = realpath(root_dir, NULL);
+	if(canonical == NULL)
+		canonical = strdup(root_dir);
+	media->root_dir = g_str_has_suffix(canonical, "/") ? g_strdup(canonical) : g_strconcat(canonical, "/", NULL);
+	free(canonical);
+
+	return media;
+}
+
+
+/* Reads and opens still in the pool are dropped by their done callbacks */
+void media_server_free(MediaServer * media) {
+	g_atomic_int_set(&media->shutdown, 1);
+	worker_pool_free(media->readers);
+	g_free(media->root_dir);
+	g_slice_free(MediaServer, media);
+}
+
+
+/* Maps `path' below the media root, refusing anything that resolves outside of it */
+static gchar * media_server_resolve(MediaServer * media, const char * path) {
+	gchar * relative  = soup_uri_decode(path + strlen(MEDIA_PREFIX));
+	gchar * file_path = g_strconcat(media->root_dir, relative, NULL);
+	g_free(relative);
+
+	char * canonical = realpath(file_path, NULL);
+	g_free(file_path);
+	if(canonical == NULL)
+		return NULL;
+
+	gchar * result = g_str_has_prefix(canonical, media->root_dir) ? g_strdup(canonical) : NULL;
+	free(canonical);
+	return result;
+}
+
+
+static void media_stream_unref(MediaStream * stream) {
+	if(--stream->ref_count > 0)
+		return;
+
+	close(stream->fd);
+	g_object_unref(stream->msg);
+	g_slice_free(MediaStream, stream);
+}
+
+
+/* Reads with pread() rather than mapping the file, so a file truncated or replaced while it is
+ * streamed only ends the response early instead of killing the process with SIGBUS */
+static void media_read_run(MediaRead * read) {
+	read->data = g_malloc(read->length);
+	while(read->done < read->length) {
+		ssize_t got = pread(read->stream->fd, read->data + read->done, read->length - read->done, read->offset + read->done);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0) {
+			read->error = got < 0 ? errno : 0;
+			break;
+		}
+		read->done += got;
+	}
+}
+
+
+static void media_stream_fill(MediaStream * stream);
+
+
+static void media_read_done(MediaRead * read) {
+	MediaStream * stream = read->stream;
+	stream->reading = FALSE;
+
+	if(stream->finished || g_atomic_int_get(&stream->media->shutdown))
+		g_free(read->data);
+	else if(read->done < read->length) {
+		g_printerr("[ERR] cannot read media file: %s\n", read->error ? g_strerror(read->error) : "file shrank");
+		g_free(read->data);
+		stream->offset = stream->end;
+		soup_message_body_complete(stream->msg->response_body);
+		soup_server_unpause_message(stream->server, stream->msg);
+	}
+	else {
+		soup_message_body_append(stream->msg->response_body, SOUP_MEMORY_TAKE, read->data, read->length);
+		stream->offset += read->length;
+		stream->queued++;
+		if(stream->offset >= stream->end)
+			soup_message_body_complete(stream->msg->response_body);
+		soup_server_unpause_message(stream->server, stream->msg);
+		media_stream_fill(stream);
+	}
+
+	media_stream_unref(stream);
+	g_slice_free(MediaRead, read);
+}
+
+
+/* Reads the next chunk unless MEDIA_CHUNKS_QUEUED are already waiting to be written */
+static void media_stream_fill(MediaStream * stream) {
+	if(stream->reading || stream->finished || stream->queued >= MEDIA_CHUNKS_QUEUED || stream->offset >= stream->end)
+		return;
+
+	MediaRead * read = g_slice_new0(MediaRead);
+	read->stream = stream;
+	read->offset = stream->offset;
+	read->length = MIN(MEDIA_CHUNK_SIZE, stream->end - stream->offset);
+	stream->reading = TRUE;
+	stream->ref_count++;
+	worker_pool_push(stream->media->readers, (WorkerFunc)media_read_run, (WorkerFunc)media_read_done, read);
+}
+
+
+static void media_stream_wrote_chunk(SoupMessage * msg, MediaStream * stream) {
+	if(stream->queued > 0)
+		stream->queued--;
+	media_stream_fill(stream);
+}
+
+
+static void media_stream_finished(SoupMessage * msg, MediaStream * stream) {
+	g_signal_handlers_disconnect_by_data(stream->msg, stream);
+	stream->finished = TRUE;
+	stream->media->streams--;
+	media_stream_unref(stream);
+}
+
+
+/* A requested file being opened by the readers */
+typedef struct _MediaOpen {
+	MediaServer * media;
+	SoupServer *  server;
+	SoupMessage * msg;
+	gchar *       path;       /* of the request */
+	gboolean      finished;   /* the client went away meanwhile */
+
+	gchar *       file_path;  /* results, NULL if outside the media root */
+	int           fd;
+	int           error;
+	struct stat   st;
+} MediaOpen;
+
+
+static void media_open_run(MediaOpen * request) {
+	request->fd        = -1;
+	request->file_path = media_server_resolve(request->media, request->path);
+	if(request->file_path == NULL)
+		return;
+
+	request->fd = open(request->file_path, O_RDONLY | O_CLOEXEC);
+	if(request->fd == -1)
+		request->error = errno;
+	else if(fstat(request->fd, &request->st) == -1 || !S_ISREG(request->st.st_mode)) {
+		close(request->fd);
+		request->fd = -1;
+	}
+}
+
+
+/* Sets up the response for the opened file. Returns TRUE if it is complete, FALSE if a stream
+ * now sends the body. */
+static gboolean media_open_respond(MediaOpen * request) {
+	SoupMessage * msg   = request->msg;
+	MediaServer * media = request->media;
+	if(request->fd == -1) {
+		soup_message_set_status(msg, request->error == EACCES ? SOUP_STATUS_FORBIDDEN : SOUP_STATUS_NOT_FOUND);
+		return TRUE;
+	}
+
+	int         fd = request->fd;
+	struct stat st = request->st;
+	request->fd = -1;
+
+	gchar * content_type = g_content_type_guess(request->file_path, NULL, 0, NULL);
+	gchar * mime_type    = g_content_type_get_mime_type(content_type);
+	soup_message_headers_set_content_type(msg->response_headers, mime_type ? mime_type : "application/octet-stream", NULL);
+	soup_message_headers_replace(msg->response_headers, "Accept-Ranges", "bytes");
+	g_free(mime_type);
+	g_free(content_type);
+
+	/* A single range is sent as is; several ranges are merged into one covering range, which
+	 * saves us from multipart bodies and is fine for media players */
+	goffset start = 0, end = st.st_size;
+	SoupRange * ranges;
+	int         n_ranges;
+	if(soup_message_headers_get_one(msg->request_headers, "Range") != NULL) {
+		if(!soup_message_headers_get_ranges(msg->request_headers, st.st_size, &ranges, &n_ranges)) {
+			gchar * content_range = g_strdup_printf("bytes */%" G_GOFFSET_FORMAT, (goffset)st.st_size);
+			soup_message_headers_replace(msg->response_headers, "Content-Range", content_range);
+			soup_message_set_status(msg, SOUP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE);
+			g_free(content_range);
+			close(fd);
+			return TRUE;
+		}
+
+		start = ranges[0].start;
+		end   = ranges[0].end + 1;
+		for(int i = 1; i < n_ranges; i++) {
+			start = MIN(start, ranges[i].start);
+			end   = MAX(end  , ranges[i].end + 1);
+		}
+		soup_message_headers_free_ranges(msg->request_headers, ranges);
+
+		soup_message_headers_set_content_range(msg->response_headers, start, end - 1, st.st_size);
+		soup_message_set_status(msg, SOUP_STATUS_PARTIAL_CONTENT);
+	}
+	else
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+
+	soup_message_headers_set_content_length(msg->response_headers, end - start);
+	if(msg->method == SOUP_METHOD_HEAD || end == start) {
+		close(fd);
+		return TRUE;
+	}
+
+	posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+
+	MediaStream * stream = g_slice_new0(MediaStream);
+	stream->ref_count = 1;
+	stream->media     = media;
+	stream->server    = request->server;
+	stream->msg       = g_object_ref(msg);
+	stream->fd        = fd;
+	stream->offset    = start;
+	stream->end       = end;
+
+	soup_message_body_set_accumulate(msg->response_body, FALSE);
+	g_signal_connect(msg, "wrote-chunk", (GCallback)media_stream_wrote_chunk, stream);
+	g_signal_connect(msg, "finished"   , (GCallback)media_stream_finished   , stream);
+
+	/* Nothing is queued yet, libsoup waits until the first chunk arrives */
+	media_stream_fill(stream);
+	return FALSE;
+}
+
+
+static void media_open_finished(SoupMessage * msg, MediaOpen * request) {
+	request->finished = TRUE;
+}
+
+
+static void media_open_done(MediaOpen * request) {
+	MediaServer * media = request->media;
+	gboolean      get   = request->msg->method == SOUP_METHOD_GET;
+	g_signal_handlers_disconnect_by_data(request->msg, request);
+
+	/* The slot taken for a GET is handed on to the stream, if any */
+	if(request->finished || g_atomic_int_get(&media->shutdown) || media_open_respond(request)) {
+		if(get)
+			media->streams--;
+		if(!request->finished && !g_atomic_int_get(&media->shutdown))
+			soup_server_unpause_message(request->server, request->msg);
+	}
+
+	if(request->fd != -1)
+		close(request->fd);
+	g_object_unref(request->msg);
+	g_free(request->path);
+	g_free(request->file_path);
+	g_slice_free(MediaOpen, request);
+}
+
+
+/* The file is resolved and opened by the readers too, realpath() and open() may block on a slow mount */
+void media_server_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, MediaServer * media) {
+	g_print("[%s] %s\n", msg->method, path);
+
+	if(msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	if(!g_str_has_prefix(path, MEDIA_PREFIX)) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	/* Every stream costs disk bandwidth that local playback may need */
+	if(msg->method == SOUP_METHOD_GET) {
+		if(media->streams >= media->max_streams) {
+			soup_message_headers_replace(msg->response_headers, "Retry-After", "5");
+			soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+			return;
+		}
+		media->streams++;
+	}
+
+	MediaOpen * request = g_slice_new0(MediaOpen);
+	request->media  = media;
+	request->server = server;
+	request->msg    = g_object_ref(msg);
+	request->path   = g_strdup(path);
+	g_signal_connect(msg, "finished", (GCallback)media_open_finished, request);
+	soup_server_pause_message(server, msg);
+	worker_pool_push(media->readers, (WorkerFunc)media_open_run, (WorkerFunc)media_open_done, request);
+}
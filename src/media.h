@@ -0,0 +1,17 @@
+#ifndef BANANA_MEDIA_H
+#define BANANA_MEDIA_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+
+/* Serves the files below the media root over HTTP at /media/..., with byte range support so
+ * other devices can stream and seek. Files are sent in chunks read by worker threads and never
+ * read into memory as a whole. */
+typedef struct _MediaServer MediaServer;
+
+MediaServer * media_server_new     (const gchar * root_dir, guint max_streams);
+void          media_server_free    (MediaServer * media);
+void          media_server_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, MediaServer * media);
+
+#endif
@@ -0,0 +1,547 @@
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/pbutils/pbutils.h>
+
+#include "metadata.h"
+#include "walker.h"
+
+
+#define METADATA_MAGIC        "BANANAMD"
+#define METADATA_VERSION      2
+#define METADATA_TIMEOUT      (10 * GST_SECOND) /* give up on files the discoverer chokes on */
+#define METADATA_SAVE_SECONDS 30
+#define METADATA_STRINGS      6
+
+
+/* On-disk layout: a header followed by `count' records, each one a fixed size part followed by
+ * its strings without terminators. Everything is in host byte order, the index is a cache and
+ * never leaves the machine. */
+typedef struct _MetadataHeader {
+	gchar   magic[8];
+	guint32 version;
+	guint32 count;
+} MetadataHeader;
+
+typedef struct _MetadataRecord {
+	gint64  size;
+	gint64  mtime;
+	gint64  duration;
+	guint32 width;
+	guint32 height;
+	guint32 streams;
+	guint32 playable;
+	guint32 lengths[METADATA_STRINGS]; /* path, container, video, audio, title, artist */
+} MetadataRecord;
+
+
+typedef struct _MetadataEntry {
+	MediaInfo info;
+	guint     generation; /* walk that last saw the file */
+} MetadataEntry;
+
+
+/* A file waiting for the discoverer */
+typedef struct _PendingFile {
+	gchar * path;
+	gint64  size;
+	gint64  mtime;
+} PendingFile;
+
+
+typedef struct _Discoverer {
+	MetadataIndex * index;
+	GstDiscoverer * discoverer;
+	PendingFile *   current; /* file being discovered, NULL if idle */
+} Discoverer;
+
+
+struct _MetadataIndex {
+	gchar *      root_dir;
+	gchar *      filename;
+	GHashTable * entries;      /* path -> MetadataEntry */
+	GQueue       pending;      /* PendingFile *, next file first */
+	GHashTable * queued;       /* path -> link in `pending' */
+	Discoverer * discoverers;
+	guint        n_discoverers;
+
+	Walker *     walker;       /* running walk, if any */
+	guint        generation;
+
+	gboolean     dirty;        /* entries changed since the last save */
+	guint        save_source;
+	GThread *    save_thread;
+	gint         saving;
+
+	MetadataUpdatedFunc updated;
+	gpointer            user_data;
+};
+
+
+static void metadata_entry_free(MetadataEntry * entry) {
+	g_free(entry->info.container);
+	g_free(entry->info.video_codec);
+	g_free(entry->info.audio_codec);
+	g_free(entry->info.title);
+	g_free(entry->info.artist);
+	g_slice_free(MetadataEntry, entry);
+}
+
+
+static void pending_file_free(PendingFile * file) {
+	g_free(file->path);
+	g_slice_free(PendingFile, file);
+}
+
+
+/* Only guesses from the name, so a walk over a large tree never opens a single file */
+gboolean metadata_is_media_file(const gchar * path) {
+	gchar * type = g_content_type_guess(path, NULL, 0, NULL);
+	gchar * mime = g_content_type_get_mime_type(type);
+	gboolean media = mime != NULL && (g_str_has_prefix(mime, "video/") || g_str_has_prefix(mime, "audio/") || g_str_equal(mime, "application/ogg"));
+	g_free(mime);
+	g_free(type);
+	return media;
+}
+
+
+static gboolean caps_field_keep(GQuark field, GValue * value, gpointer user_data) {
+	static const gchar * const keep[] = { "mpegversion", "layer", "profile", "variant", "stream-format", NULL };
+	return g_strv_contains(keep, g_quark_to_string(field));
+}
+
+
+/* Reduces `caps' to the media type and the fields that tell codecs apart, e.g.
+ * "audio/mpeg, mpegversion=(int)4". Consumes `caps'. */
+static gchar * caps_to_codec(GstCaps * caps) {
+	if(caps == NULL)
+		return NULL;
+
+	gchar * codec = NULL;
+	if(!gst_caps_is_empty(caps) && !gst_caps_is_any(caps)) {
+		GstStructure * structure = gst_structure_copy(gst_caps_get_structure(caps, 0));
+		gst_structure_filter_and_map_in_place(structure, caps_field_keep, NULL);
+		codec = gst_structure_to_string(structure);
+		gst_structure_free(structure);
+	}
+	gst_caps_unref(caps);
+	return codec;
+}
+
+
+static void media_info_fill(MediaInfo * info, GstDiscovererInfo * discovered) {
+	info->playable = gst_discoverer_info_get_result(discovered) == GST_DISCOVERER_OK;
+	info->duration = -1;
+	if(!info->playable)
+		return;
+
+	GstClockTime duration = gst_discoverer_info_get_duration(discovered);
+	if(GST_CLOCK_TIME_IS_VALID(duration))
+		info->duration = duration;
+
+	GstDiscovererStreamInfo * top = gst_discoverer_info_get_stream_info(discovered);
+	if(top != NULL) {
+		if(GST_IS_DISCOVERER_CONTAINER_INFO(top))
+			info->container = caps_to_codec(gst_discoverer_stream_info_get_caps(top));
+		gst_discoverer_stream_info_unref(top);
+	}
+
+	GList * videos = gst_discoverer_info_get_video_streams(discovered);
+	if(videos != NULL) {
+		GstDiscovererVideoInfo * video = videos->data;
+		info->width       = gst_discoverer_video_info_get_width(video);
+		info->height      = gst_discoverer_video_info_get_height(video);
+		info->video_codec = caps_to_codec(gst_discoverer_stream_info_get_caps(GST_DISCOVERER_STREAM_INFO(video)));
+	}
+	info->streams = g_list_length(videos);
+	gst_discoverer_stream_info_list_free(videos);
+
+	GList * audios = gst_discoverer_info_get_audio_streams(discovered);
+	if(audios != NULL)
+		info->audio_codec = caps_to_codec(gst_discoverer_stream_info_get_caps(GST_DISCOVERER_STREAM_INFO(audios->data)));
+	info->streams += g_list_length(audios);
+	gst_discoverer_stream_info_list_free(audios);
+
+	GList * subtitles = gst_discoverer_info_get_subtitle_streams(discovered);
+	info->streams += g_list_length(subtitles);
+	gst_discoverer_stream_info_list_free(subtitles);
+
+	const GstTagList * tags = gst_discoverer_info_get_tags(discovered);
+	if(tags != NULL) {
+		gst_tag_list_get_string(tags, GST_TAG_TITLE , &info->title);
+		gst_tag_list_get_string(tags, GST_TAG_ARTIST, &info->artist);
+	}
+}
+
+
+/* Hands queued files to every idle discoverer */
+static void metadata_index_dispatch(MetadataIndex * index) {
+	for(guint i = 0; i < index->n_discoverers; i++) {
+		Discoverer * d = &index->discoverers[i];
+		while(d->current == NULL && !g_queue_is_empty(&index->pending)) {
+			PendingFile * file = g_queue_pop_head(&index->pending);
+			g_hash_table_remove(index->queued, file->path);
+
+			gchar * uri = gst_filename_to_uri(file->path, NULL);
+			if(uri != NULL && gst_discoverer_discover_uri_async(d->discoverer, uri))
+				d->current = file;
+			else
+				pending_file_free(file);
+			g_free(uri);
+		}
+	}
+}
+
+
+/* Queues `path' for discovery. Urgent files (someone is looking at their directory right now)
+ * go to the front of the queue. */
+static void metadata_index_enqueue(MetadataIndex * index, const gchar * path, gint64 size, gint64 mtime, gboolean urgent) {
+	for(guint i = 0; i < index->n_discoverers; i++) {
+		PendingFile * current = index->discoverers[i].current;
+		if(current != NULL && g_str_equal(current->path, path) && current->size == size && current->mtime == mtime)
+			return;
+	}
+
+	GList * link = g_hash_table_lookup(index->queued, path);
+	if(link != NULL) {
+		PendingFile * file = link->data;
+		file->size  = size;
+		file->mtime = mtime;
+		if(urgent) {
+			g_queue_unlink(&index->pending, link);
+			g_queue_push_head_link(&index->pending, link);
+		}
+		return;
+	}
+
+	PendingFile * file = g_slice_new(PendingFile);
+	file->path  = g_strdup(path);
+	file->size  = size;
+	file->mtime = mtime;
+	if(urgent) {
+		g_queue_push_head(&index->pending, file);
+		link = g_queue_peek_head_link(&index->pending);
+	}
+	else {
+		g_queue_push_tail(&index->pending, file);
+		link = g_queue_peek_tail_link(&index->pending);
+	}
+	g_hash_table_insert(index->queued, file->path, link);
+
+	metadata_index_dispatch(index);
+}
+
+
+static void discovered_cb(GstDiscoverer * discoverer, GstDiscovererInfo * discovered, GError * error, Discoverer * d) {
+	MetadataIndex * index = d->index;
+	PendingFile *   file  = d->current;
+	d->current = NULL;
+	if(file == NULL)
+		return;
+
+	MetadataEntry * entry = g_hash_table_lookup(index->entries, file->path);
+	if(entry != NULL)
+		g_hash_table_remove(index->entries, file->path);
+
+	entry = g_slice_new0(MetadataEntry);
+	entry->info.size   = file->size;
+	entry->info.mtime  = file->mtime;
+	entry->generation  = index->generation;
+	media_info_fill(&entry->info, discovered);
+	g_hash_table_insert(index->entries, g_strdup(file->path), entry);
+	index->dirty = TRUE;
+
+	if(!entry->info.playable)
+		g_print("[META] cannot discover %s: %s\n", file->path, error ? error->message : "unknown error");
+	if(index->updated)
+		index->updated(file->path, index->user_data);
+
+	pending_file_free(file);
+	metadata_index_dispatch(index);
+}
+
+
+static void metadata_walk_batch(GPtrArray * files, MetadataIndex * index) {
+	for(guint i = 0; i < files->len; i++) {
+		const WalkerFile * file = g_ptr_array_index(files, i);
+		if(file->directory || !metadata_is_media_file(file->path))
+			continue;
+
+		MetadataEntry * entry = g_hash_table_lookup(index->entries, file->path);
+		if(entry != NULL) {
+			entry->generation = index->generation;
+			if(entry->info.size == file->size && entry->info.mtime == file->mtime)
+				continue;
+		}
+		metadata_index_enqueue(index, file->path, file->size, file->mtime, FALSE);
+	}
+}
+
+
+/* Files below the root that the walk did not see are gone */
+static void metadata_walk_done(MetadataIndex * index) {
+	index->walker = NULL;
+
+	guint          removed = 0;
+	GHashTableIter iter;
+	gpointer       path, entry;
+	g_hash_table_iter_init(&iter, index->entries);
+	while(g_hash_table_iter_next(&iter, &path, &entry)) {
+		if(((MetadataEntry *)entry)->generation != index->generation && g_str_has_prefix(path, index->root_dir)) {
+			g_hash_table_iter_remove(&iter);
+			removed++;
+		}
+	}
+	if(removed > 0)
+		index->dirty = TRUE;
+
+	g_print("[META] walk done, %u files to discover, %u removed\n", g_queue_get_length(&index->pending), removed);
+}
+
+
+static void metadata_index_load(MetadataIndex * index) {
+	GError *      error  = NULL;
+	GMappedFile * mapped = g_mapped_file_new(index->filename, FALSE, &error);
+	if(mapped == NULL) {
+		if(!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_printerr("[ERR] cannot read metadata index: %s\n", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	const gchar * p   = g_mapped_file_get_contents(mapped);
+	const gchar * end = p + g_mapped_file_get_length(mapped);
+
+	MetadataHeader header;
+	if(end - p < (gssize)sizeof(header)) {
+		g_mapped_file_unref(mapped);
+		return;
+	}
+	memcpy(&header, p, sizeof(header));
+	p += sizeof(header);
+	if(memcmp(header.magic, METADATA_MAGIC, sizeof(header.magic)) != 0 || header.version != METADATA_VERSION) {
+		g_printerr("[ERR] ignoring metadata index of an unknown format\n");
+		g_mapped_file_unref(mapped);
+		return;
+	}
+
+	for(guint32 i = 0; i < header.count; i++) {
+		MetadataRecord record;
+		if(end - p < (gssize)sizeof(record))
+			break;
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+
+		gsize length = 0;
+		for(guint s = 0; s < METADATA_STRINGS; s++)
+			length += record.lengths[s];
+		if((gsize)(end - p) < length || record.lengths[0] == 0)
+			break;
+
+		gchar * strings[METADATA_STRINGS];
+		for(guint s = 0; s < METADATA_STRINGS; s++) {
+			strings[s] = record.lengths[s] > 0 ? g_strndup(p, record.lengths[s]) : NULL;
+			p += record.lengths[s];
+		}
+
+		MetadataEntry * entry = g_slice_new0(MetadataEntry);
+		entry->info.size        = record.size;
+		entry->info.mtime       = record.mtime;
+		entry->info.duration    = record.duration;
+		entry->info.width       = record.width;
+		entry->info.height      = record.height;
+		entry->info.streams     = record.streams;
+		entry->info.playable    = record.playable;
+		entry->info.container   = strings[1];
+		entry->info.video_codec = strings[2];
+		entry->info.audio_codec = strings[3];
+		entry->info.title       = strings[4];
+		entry->info.artist      = strings[5];
+		g_hash_table_replace(index->entries, strings[0], entry);
+	}
+
+	g_mapped_file_unref(mapped);
+	g_print("[META] loaded %u entries from %s\n", g_hash_table_size(index->entries), index->filename);
+}
+
+
+static GBytes * metadata_index_serialize(MetadataIndex * index) {
+	GByteArray * buffer = g_byte_array_new();
+
+	MetadataHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, METADATA_MAGIC, sizeof(header.magic));
+	header.version = METADATA_VERSION;
+	header.count   = g_hash_table_size(index->entries);
+	g_byte_array_append(buffer, (const guint8 *)&header, sizeof(header));
+
+	GHashTableIter iter;
+	gpointer       path, value;
+	g_hash_table_iter_init(&iter, index->entries);
+	while(g_hash_table_iter_next(&iter, &path, &value)) {
+		const MediaInfo * info = &((MetadataEntry *)value)->info;
+		const gchar * strings[METADATA_STRINGS] = { path, info->container, info->video_codec, info->audio_codec, info->title, info->artist };
+
+		MetadataRecord record;
+		memset(&record, 0, sizeof(record));
+		record.size     = info->size;
+		record.mtime    = info->mtime;
+		record.duration = info->duration;
+		record.width    = info->width;
+		record.height   = info->height;
+		record.streams  = info->streams;
+		record.playable = info->playable;
+		for(guint s = 0; s < METADATA_STRINGS; s++)
+			record.lengths[s] = strings[s] ? strlen(strings[s]) : 0;
+
+		g_byte_array_append(buffer, (const guint8 *)&record, sizeof(record));
+		for(guint s = 0; s < METADATA_STRINGS; s++)
+			g_byte_array_append(buffer, (const guint8 *)strings[s], record.lengths[s]);
+	}
+
+	return g_byte_array_free_to_bytes(buffer);
+}
+
+
+static void metadata_index_write(const gchar * filename, GBytes * bytes) {
+	GError * error = NULL;
+	gsize    size;
+	const gchar * contents = g_bytes_get_data(bytes, &size);
+	if(!g_file_set_contents(filename, contents, size, &error)) {
+		g_printerr("[ERR] cannot save metadata index: %s\n", error->message);
+		g_error_free(error);
+	}
+}
+
+
+typedef struct _SaveJob {
+	MetadataIndex * index;
+	gchar *         filename;
+	GBytes *        bytes;
+} SaveJob;
+
+
+static gpointer metadata_save_thread(SaveJob * job) {
+	metadata_index_write(job->filename, job->bytes);
+	g_atomic_int_set(&job->index->saving, 0);
+
+	g_bytes_unref(job->bytes);
+	g_free(job->filename);
+	g_slice_free(SaveJob, job);
+	return NULL;
+}
+
+
+/* The index is serialized on the main loop, which is a plain copy, and written in a thread */
+static gboolean metadata_save_cb(MetadataIndex * index) {
+	if(!index->dirty || g_atomic_int_get(&index->saving))
+		return G_SOURCE_CONTINUE;
+
+	if(index->save_thread != NULL)
+		g_thread_join(index->save_thread);
+
+	SaveJob * job = g_slice_new(SaveJob);
+	job->index    = index;
+	job->filename = g_strdup(index->filename);
+	job->bytes    = metadata_index_serialize(index);
+	index->dirty  = FALSE;
+
+	g_atomic_int_set(&index->saving, 1);
+	index->save_thread = g_thread_new("metadata-save", (GThreadFunc)metadata_save_thread, job);
+	return G_SOURCE_CONTINUE;
+}
+
+
+/* Opens the index stored in `filename' and starts bringing it up to date with `root_dir'.
+ * `updated' is called whenever the metadata of a file was (re)discovered. */
+MetadataIndex * metadata_index_new(const gchar * root_dir, const gchar * filename, guint discoverers, MetadataUpdatedFunc updated, gpointer user_data) {
+	gst_pb_utils_init();
+
+	MetadataIndex * index = g_slice_new0(MetadataIndex);
+	index->root_dir   = g_strdup(root_dir);
+	index->filename   = g_strdup(filename);
+	index->entries    = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)metadata_entry_free);
+	index->queued     = g_hash_table_new(g_str_hash, g_str_equal);
+	index->generation = 1;
+	index->updated    = updated;
+	index->user_data  = user_data;
+	g_queue_init(&index->pending);
+
+	gchar * directory = g_path_get_dirname(filename);
+	if(g_mkdir_with_parents(directory, 0755) != 0)
+		g_printerr("[ERR] cannot create `%s': %s\n", directory, g_strerror(errno));
+	g_free(directory);
+
+	metadata_index_load(index);
+
+	index->discoverers = g_new0(Discoverer, discoverers);
+	for(guint i = 0; i < discoverers; i++) {
+		GError *        error      = NULL;
+		GstDiscoverer * discoverer = gst_discoverer_new(METADATA_TIMEOUT, &error);
+		if(discoverer == NULL) {
+			g_printerr("[ERR] cannot create discoverer: %s\n", error->message);
+			g_error_free(error);
+			break;
+		}
+
+		Discoverer * d = &index->discoverers[index->n_discoverers++];
+		d->index      = index;
+		d->discoverer = discoverer;
+		g_signal_connect(discoverer, "discovered", (GCallback)discovered_cb, d);
+		gst_discoverer_start(discoverer);
+	}
+
+	index->save_source = g_timeout_add_seconds(METADATA_SAVE_SECONDS, (GSourceFunc)metadata_save_cb, index);
+	index->walker      = walker_start(root_dir, (WalkerBatchFunc)metadata_walk_batch, (WalkerDoneFunc)metadata_walk_done, index);
+	return index;
+}
+
+
+/* Stops discovering and saves whatever is new since the last save */
+void metadata_index_free(MetadataIndex * index) {
+	if(index->walker != NULL)
+		walker_cancel(index->walker);
+	g_source_remove(index->save_source);
+
+	for(guint i = 0; i < index->n_discoverers; i++) {
+		Discoverer * d = &index->discoverers[i];
+		gst_discoverer_stop(d->discoverer);
+		g_signal_handlers_disconnect_by_data(d->discoverer, d);
+		g_object_unref(d->discoverer);
+		if(d->current != NULL)
+			pending_file_free(d->current);
+	}
+	g_free(index->discoverers);
+
+	if(index->save_thread != NULL)
+		g_thread_join(index->save_thread);
+	if(index->dirty) {
+		GBytes * bytes = metadata_index_serialize(index);
+		metadata_index_write(index->filename, bytes);
+		g_bytes_unref(bytes);
+	}
+
+	g_queue_clear_full(&index->pending, (GDestroyNotify)pending_file_free);
+	g_hash_table_destroy(index->queued);
+	g_hash_table_destroy(index->entries);
+	g_free(index->root_dir);
+	g_free(index->filename);
+	g_slice_free(MetadataIndex, index);
+}
+
+
+/* Returns the metadata of `path' if it is known and up to date with `size' and `mtime'.
+ * Otherwise NULL is returned and the file is discovered next. */
+const MediaInfo * metadata_index_get(MetadataIndex * index, const gchar * path, gint64 size, gint64 mtime) {
+	MetadataEntry * entry = g_hash_table_lookup(index->entries, path);
+	if(entry != NULL && entry->info.size == size && entry->info.mtime == mtime)
+		return &entry->info;
+
+	if(metadata_is_media_file(path))
+		metadata_index_enqueue(index, path, size, mtime, TRUE);
+	return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef BANANA_METADATA_H
+#define BANANA_METADATA_H
+
+#include <glib.h>
+
+
+/* What the discoverer found out about one media file */
+typedef struct _MediaInfo {
+	gint64   size;        /* size and mtime of the file when it was discovered */
+	gint64   mtime;
+	gboolean playable;    /* FALSE if the discoverer failed, all fields below are unset then */
+	gint64   duration;    /* nanoseconds, -1 if unknown */
+	guint    width;       /* of the first video stream, 0 for audio files */
+	guint    height;
+	guint    streams;     /* audio, video and subtitle streams */
+	gchar *  container;   /* caps of the container, codec and stream format fields only */
+	gchar *  video_codec; /* caps of the first video stream */
+	gchar *  audio_codec; /* caps of the first audio stream */
+	gchar *  title;
+	gchar *  artist;
+} MediaInfo;
+
+
+/* Persistent index of media metadata below the media root. On startup the tree is walked in a
+ * background thread and every file that is new or changed since the index was saved (by size and
+ * mtime) is run through a small pool of asynchronous discoverers. The index is saved to disk
+ * periodically, so after the first run only changed files are ever discovered again. Must only be
+ * used from the main context. */
+typedef struct _MetadataIndex MetadataIndex;
+
+typedef void (*MetadataUpdatedFunc)(const gchar * path, gpointer user_data);
+
+MetadataIndex *   metadata_index_new (const gchar * root_dir, const gchar * filename, guint discoverers, MetadataUpdatedFunc updated, gpointer user_data);
+void              metadata_index_free(MetadataIndex * index);
+const MediaInfo * metadata_index_get (MetadataIndex * index, const gchar * path, gint64 size, gint64 mtime);
+
+gboolean          metadata_is_media_file(const gchar * path);
+
+#endif
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include <glib.h>
+
+#include "metrics.h"
+
+
+typedef struct _MetricsFamily {
+	gchar *          name;
+	gchar *          help;
+	MetricsType      type;
+	gdouble *        buckets;   /* upper bounds of histogram buckets, ascending */
+	guint            n_buckets;
+	GPtrArray *      series;    /* MetricsSeries *, in order of creation */
+} MetricsFamily;
+
+typedef struct _MetricsSeries {
+	MetricsFamily *  family;
+	gchar *          labels;    /* between the braces, "" if none */
+	gdouble          value;     /* value of counters and gauges, sum of histograms */
+	guint64          count;     /* observations of histograms */
+	guint64 *        buckets;   /* observations per bucket, not cumulative */
+} MetricsSeries;
+
+struct _Metrics {
+	GPtrArray *      families;  /* MetricsFamily *, in order of declaration */
+	GHashTable *     by_family; /* name -> MetricsFamily * */
+	GHashTable *     by_series; /* full name -> MetricsSeries * */
+};
+
+
+static void metrics_family_free(MetricsFamily * family) {
+	g_ptr_array_unref(family->series);
+	g_free(family->name);
+	g_free(family->help);
+	g_free(family->buckets);
+	g_slice_free(MetricsFamily, family);
+}
+
+
+static void metrics_series_free(MetricsSeries * series) {
+	g_free(series->labels);
+	g_free(series->buckets);
+	g_slice_free(MetricsSeries, series);
+}
+
+
+Metrics * metrics_new(void) {
+	Metrics * metrics = g_slice_new0(Metrics);
+	metrics->families  = g_ptr_array_new_with_free_func((GDestroyNotify)metrics_family_free);
+	metrics->by_family = g_hash_table_new(g_str_hash, g_str_equal);
+	metrics->by_series = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)metrics_series_free);
+	return metrics;
+}
+
+
+void metrics_free(Metrics * metrics) {
+	g_hash_table_destroy(metrics->by_series);
+	g_hash_table_destroy(metrics->by_family);
+	g_ptr_array_unref(metrics->families);
+	g_slice_free(Metrics, metrics);
+}
+
+
+void metrics_declare(Metrics * metrics, const gchar * family, MetricsType type, const gchar * help, const gdouble * buckets, guint n_buckets) {
+	MetricsFamily * f = g_slice_new0(MetricsFamily);
+	f->name      = g_strdup(family);
+	f->help      = g_strdup(help);
+	f->type      = type;
+	f->buckets   = g_new(gdouble, n_buckets);
+	f->n_buckets = n_buckets;
+	if(n_buckets > 0)
+		memcpy(f->buckets, buckets, n_buckets * sizeof(gdouble));
+	f->series    = g_ptr_array_new();
+	g_ptr_array_add(metrics->families, f);
+	g_hash_table_insert(metrics->by_family, f->name, f);
+}
+
+
+static MetricsSeries * metrics_lookup(Metrics * metrics, const gchar * name, MetricsType type) {
+	MetricsSeries * series = g_hash_table_lookup(metrics->by_series, name);
+	if(series != NULL)
+		return series;
+
+	/* First use of this series */
+	const gchar *   brace  = strchr(name, '{');
+	gchar *         family = brace ? g_strndup(name, brace - name) : g_strdup(name);
+	MetricsFamily * f      = g_hash_table_lookup(metrics->by_family, family);
+	g_free(family);
+	if(f == NULL || f->type != type) {
+		g_printerr("[ERR] metric %s is not declared as such\n", name);
+		return NULL;
+	}
+
+	series = g_slice_new0(MetricsSeries);
+	series->family  = f;
+	series->labels  = brace ? g_strndup(brace + 1, strcspn(brace + 1, "}")) : g_strdup("");
+	series->buckets = g_new0(guint64, f->n_buckets);
+	g_ptr_array_add(f->series, series);
+	g_hash_table_insert(metrics->by_series, g_strdup(name), series);
+	return series;
+}
+
+
+void metrics_add(Metrics * metrics, const gchar * name, gdouble value) {
+	MetricsSeries * series = metrics_lookup(metrics, name, METRICS_COUNTER);
+	if(series != NULL)
+		series->value += value;
+}
+
+
+void metrics_set(Metrics * metrics, const gchar * name, gdouble value) {
+	MetricsSeries * series = metrics_lookup(metrics, name, METRICS_GAUGE);
+	if(series != NULL)
+		series->value = value;
+}
+
+
+void metrics_observe(Metrics * metrics, const gchar * name, gdouble value) {
+	MetricsSeries * series = metrics_lookup(metrics, name, METRICS_HISTOGRAM);
+	if(series == NULL)
+		return;
+
+	series->value += value;
+	series->count++;
+	for(guint i = 0; i < series->family->n_buckets; i++) {
+		if(value <= series->family->buckets[i]) {
+			series->buckets[i]++;
+			break;
+		}
+	}
+}
+
+
+static void metrics_render_value(GString * out, const gchar * name, const gchar * suffix, const gchar * labels, const gchar * le, gdouble value) {
+	gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+	g_string_append_printf(out, "%s%s", name, suffix);
+	if(*labels || le) {
+		g_string_append_c(out, '{');
+		g_string_append(out, labels);
+		if(le)
+			g_string_append_printf(out, "%sle=\"%s\"", *labels ? "," : "", le);
+		g_string_append_c(out, '}');
+	}
+	g_string_append_printf(out, " %s\n", g_ascii_dtostr(number, sizeof(number), value));
+}
+
+
+GString * metrics_render(Metrics * metrics) {
+	static const gchar * const types[] = { "counter", "gauge", "histogram" };
+
+	GString * out = g_string_new(NULL);
+	for(guint i = 0; i < metrics->families->len; i++) {
+		MetricsFamily * f = g_ptr_array_index(metrics->families, i);
+		g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", f->name, f->help, f->name, types[f->type]);
+
+		for(guint j = 0; j < f->series->len; j++) {
+			MetricsSeries * series = g_ptr_array_index(f->series, j);
+			if(f->type != METRICS_HISTOGRAM) {
+				metrics_render_value(out, f->name, "", series->labels, NULL, series->value);
+				continue;
+			}
+
+			guint64 cumulative = 0;
+			for(guint k = 0; k < f->n_buckets; k++) {
+				gchar le[G_ASCII_DTOSTR_BUF_SIZE];
+				cumulative += series->buckets[k];
+				metrics_render_value(out, f->name, "_bucket", series->labels, g_ascii_dtostr(le, sizeof(le), f->buckets[k]), cumulative);
+			}
+			metrics_render_value(out, f->name, "_bucket", series->labels, "+Inf", series->count);
+			metrics_render_value(out, f->name, "_sum"   , series->labels, NULL, series->value);
+			metrics_render_value(out, f->name, "_count" , series->labels, NULL, series->count);
+		}
+	}
+	return out;
+}
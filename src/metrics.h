@@ -0,0 +1,27 @@
+#ifndef BANANA_METRICS_H
+#define BANANA_METRICS_H
+
+#include <glib.h>
+
+
+/* Counters, gauges and histograms, rendered in the Prometheus text format. Families are declared
+ * once; their series are named like `family' or `family{label="value"}' and created on first
+ * use. An update is a hash lookup and an addition, cheap enough to leave on everywhere. Must only
+ * be used from the main context. */
+typedef enum {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_HISTOGRAM
+} MetricsType;
+
+typedef struct _Metrics Metrics;
+
+Metrics * metrics_new    (void);
+void      metrics_free   (Metrics * metrics);
+void      metrics_declare(Metrics * metrics, const gchar * family, MetricsType type, const gchar * help, const gdouble * buckets, guint n_buckets);
+void      metrics_add    (Metrics * metrics, const gchar * series, gdouble value); /* counters */
+void      metrics_set    (Metrics * metrics, const gchar * series, gdouble value); /* gauges */
+void      metrics_observe(Metrics * metrics, const gchar * series, gdouble value); /* histograms */
+GString * metrics_render (Metrics * metrics);
+
+#endif
@@ -0,0 +1,140 @@
+#include <glib.h>
+
+#include "playqueue.h"
+
+
+struct _PlayQueue {
+	GPtrArray * items;    /* gchar *, paths */
+	gint        current;
+
+	GMutex      lock;     /* protects next_uri, which streaming threads read */
+	gchar *     next_uri;
+};
+
+
+/* Must be called after every change of the items or the current index */
+static void play_queue_changed(PlayQueue * queue) {
+	gchar * next_uri = NULL;
+	if(queue->current + 1 < (gint)queue->items->len)
+		next_uri = g_filename_to_uri(g_ptr_array_index(queue->items, queue->current + 1), NULL, NULL);
+
+	g_mutex_lock(&queue->lock);
+	g_free(queue->next_uri);
+	queue->next_uri = next_uri;
+	g_mutex_unlock(&queue->lock);
+}
+
+
+PlayQueue * play_queue_new(void) {
+	PlayQueue * queue = g_slice_new0(PlayQueue);
+	queue->items   = g_ptr_array_new_with_free_func(g_free);
+	queue->current = -1;
+	g_mutex_init(&queue->lock);
+	return queue;
+}
+
+
+void play_queue_free(PlayQueue * queue) {
+	g_ptr_array_unref(queue->items);
+	g_mutex_clear(&queue->lock);
+	g_free(queue->next_uri);
+	g_slice_free(PlayQueue, queue);
+}
+
+
+guint play_queue_length(PlayQueue * queue) {
+	return queue->items->len;
+}
+
+
+gint play_queue_current(PlayQueue * queue) {
+	return queue->current;
+}
+
+
+const gchar * play_queue_get(PlayQueue * queue, guint index) {
+	return index < queue->items->len ? g_ptr_array_index(queue->items, index) : NULL;
+}
+
+
+/* Returns the index of `path', looking at the items after the current one first, or -1 */
+gint play_queue_find(PlayQueue * queue, const gchar * path) {
+	gint length = queue->items->len;
+	for(gint i = 0; i < length; i++) {
+		gint index = (MAX(queue->current, 0) + i) % length;
+		if(g_strcmp0(g_ptr_array_index(queue->items, index), path) == 0)
+			return index;
+	}
+	return -1;
+}
+
+
+void play_queue_insert(PlayQueue * queue, gint index, const gchar * path) {
+	if(index < 0 || index > (gint)queue->items->len)
+		index = queue->items->len;
+
+	g_ptr_array_insert(queue->items, index, g_strdup(path));
+	if(index <= queue->current)
+		queue->current++;
+	play_queue_changed(queue);
+}
+
+
+gboolean play_queue_move(PlayQueue * queue, guint from, guint to) {
+	if(from >= queue->items->len || to >= queue->items->len)
+		return FALSE;
+
+	gpointer item = g_ptr_array_steal_index(queue->items, from);
+	g_ptr_array_insert(queue->items, to, item);
+
+	gint current = queue->current;
+	if((gint)from == current)
+		queue->current = to;
+	else if((gint)from < current && (gint)to >= current)
+		queue->current--;
+	else if((gint)from > current && (gint)to <= current)
+		queue->current++;
+
+	play_queue_changed(queue);
+	return TRUE;
+}
+
+
+/* Removing the current item keeps it playing; what comes next is whatever followed it */
+gboolean play_queue_remove(PlayQueue * queue, guint index) {
+	if(index >= queue->items->len)
+		return FALSE;
+
+	g_ptr_array_remove_index(queue->items, index);
+	if((gint)index <= queue->current)
+		queue->current--;
+
+	play_queue_changed(queue);
+	return TRUE;
+}
+
+
+void play_queue_clear(PlayQueue * queue) {
+	g_ptr_array_set_size(queue->items, 0);
+	queue->current = -1;
+	play_queue_changed(queue);
+}
+
+
+gboolean play_queue_set_current(PlayQueue * queue, gint index) {
+	if(index < -1 || index >= (gint)queue->items->len)
+		return FALSE;
+
+	queue->current = index;
+	play_queue_changed(queue);
+	return TRUE;
+}
+
+
+/* Returns a copy of the uri to play after the current item, or NULL if there is none */
+gchar * play_queue_next_uri(PlayQueue * queue) {
+	g_mutex_lock(&queue->lock);
+	gchar * uri = g_strdup(queue->next_uri);
+	g_mutex_unlock(&queue->lock);
+	return uri;
+}
@@ -0,0 +1,25 @@
+#ifndef BANANA_PLAYQUEUE_H
+#define BANANA_PLAYQUEUE_H
+
+#include <glib.h>
+
+
+/* The list of files to play, and which one is playing. Must only be changed from the main
+ * context; the uri of the item after the current one may be read from any thread, so playbin
+ * can ask for it from its streaming thread when the current item is about to finish. */
+typedef struct _PlayQueue PlayQueue;
+
+PlayQueue *   play_queue_new        (void);
+void          play_queue_free       (PlayQueue * queue);
+guint         play_queue_length     (PlayQueue * queue);
+gint          play_queue_current    (PlayQueue * queue); /* -1 if nothing is current */
+const gchar * play_queue_get        (PlayQueue * queue, guint index);
+gint          play_queue_find       (PlayQueue * queue, const gchar * path);
+void          play_queue_insert     (PlayQueue * queue, gint index, const gchar * path); /* -1 appends */
+gboolean      play_queue_move       (PlayQueue * queue, guint from, guint to);
+gboolean      play_queue_remove     (PlayQueue * queue, guint index);
+void          play_queue_clear      (PlayQueue * queue);
+gboolean      play_queue_set_current(PlayQueue * queue, gint index);
+gchar *       play_queue_next_uri   (PlayQueue * queue); /* thread-safe, NULL at the end */
+
+#endif
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "readahead.h"
+
+
+#define READAHEAD_CHUNK    (1024 * 1024)
+#define READAHEAD_STALL_US (250 * 1000) /* a read taking longer than this is a stall */
+
+
+struct _ReadAhead {
+	GThread * thread;
+	GMutex    lock;
+	GCond     cond;
+	gboolean  quit;
+
+	gsize     window;        /* bytes kept ahead of playback */
+	gsize     prefetch;      /* bytes of the next file read once the window is full */
+	guint     generation;    /* bumped whenever a read in flight becomes pointless */
+
+	gchar *   path;          /* file being played */
+	guint64   size;          /* its size, G_MAXUINT64 until known */
+	guint64   start;         /* everything from start to done has been read */
+	guint64   done;
+	guint64   position;      /* where playback reads */
+	gint64    reading_since; /* monotonic time the current read of `path' started, 0 if none */
+
+	gchar *   next_path;     /* file after it */
+	guint64   next_done;     /* bytes of it read */
+};
+
+
+static gboolean read_ahead_current_pending(ReadAhead * ra) {
+	return ra->path != NULL && ra->done < MIN(ra->position + ra->window, ra->size);
+}
+
+
+static gboolean read_ahead_next_pending(ReadAhead * ra) {
+	return ra->next_path != NULL && ra->next_done < ra->prefetch;
+}
+
+
+static gpointer read_ahead_thread(ReadAhead * ra) {
+	gchar * buffer    = g_malloc(READAHEAD_CHUNK);
+	gchar * open_path = NULL;
+	gint    fd        = -1;
+	guint64 fd_size   = 0;
+
+	g_mutex_lock(&ra->lock);
+	while(!ra->quit) {
+		/* The file being played comes first, the next one only once we are far enough ahead */
+		gboolean current = read_ahead_current_pending(ra);
+		if(!current && !read_ahead_next_pending(ra)) {
+			g_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+
+		guint   generation = ra->generation;
+		gchar * path       = g_strdup(current ? ra->path : ra->next_path);
+		guint64 offset     = current ? ra->done : ra->next_done;
+		guint64 end        = current ? MIN(ra->position + ra->window, ra->size) : ra->prefetch;
+		gsize   length     = MIN(end - offset, READAHEAD_CHUNK);
+		if(current)
+			ra->reading_since = g_get_monotonic_time();
+		g_mutex_unlock(&ra->lock);
+
+		if(g_strcmp0(path, open_path) != 0) {
+			if(fd >= 0)
+				close(fd);
+			g_free(open_path);
+			open_path = g_strdup(path);
+
+			struct stat st;
+			fd      = open(path, O_RDONLY | O_CLOEXEC);
+			fd_size = fd >= 0 && fstat(fd, &st) == 0 ? st.st_size : 0;
+		}
+
+		/* The hint gets the kernel going on the whole chunk at once, the read makes sure it is
+		 * really there before we count it */
+		gssize n = -1;
+		if(fd >= 0 && offset < fd_size) {
+			length = MIN(length, fd_size - offset);
+			posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+			n = pread(fd, buffer, length, offset);
+		}
+
+		g_mutex_lock(&ra->lock);
+		if(current)
+			ra->reading_since = 0;
+		if(generation == ra->generation) {
+			/* Errors and the end of the file both end the read-ahead of that file */
+			if(current) {
+				ra->size = n > 0 ? fd_size : offset;
+				if(n > 0)
+					ra->done = offset + n;
+			}
+			else
+				ra->next_done = n > 0 && offset + n < fd_size ? offset + n : ra->prefetch;
+		}
+		g_free(path);
+	}
+	g_mutex_unlock(&ra->lock);
+
+	if(fd >= 0)
+		close(fd);
+	g_free(open_path);
+	g_free(buffer);
+	return NULL;
+}
+
+
+ReadAhead * read_ahead_new(gsize window, gsize prefetch) {
+	ReadAhead * ra = g_slice_new0(ReadAhead);
+	ra->window   = window;
+	ra->prefetch = prefetch;
+	g_mutex_init(&ra->lock);
+	g_cond_init(&ra->cond);
+	ra->thread = g_thread_new("read-ahead", (GThreadFunc)read_ahead_thread, ra);
+	return ra;
+}
+
+
+/* Waits for a read in progress, which may take as long as the disk needs to spin up */
+void read_ahead_free(ReadAhead * ra) {
+	g_mutex_lock(&ra->lock);
+	ra->quit = TRUE;
+	g_cond_signal(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+	g_thread_join(ra->thread);
+
+	g_mutex_clear(&ra->lock);
+	g_cond_clear(&ra->cond);
+	g_free(ra->path);
+	g_free(ra->next_path);
+	g_slice_free(ReadAhead, ra);
+}
+
+
+void read_ahead_set_file(ReadAhead * ra, const gchar * path) {
+	g_mutex_lock(&ra->lock);
+	if(g_strcmp0(path, ra->path) != 0) {
+		g_free(ra->path);
+		ra->path     = g_strdup(path);
+		ra->size     = G_MAXUINT64;
+		ra->start    = 0;
+		ra->done     = 0;
+		ra->position = 0;
+		ra->generation++;
+		g_cond_signal(&ra->cond);
+	}
+	g_mutex_unlock(&ra->lock);
+}
+
+
+/* Called by the streaming thread for every buffer it reads, so keep it cheap. Reads outside of
+ * what has been read ahead, like seeks, start over from there. Reads of `path' once another file
+ * plays, like the tail of the previous one after a gapless switch, are ignored. */
+void read_ahead_set_position(ReadAhead * ra, const gchar * path, guint64 offset) {
+	g_mutex_lock(&ra->lock);
+	if(g_strcmp0(path, ra->path) != 0) {
+		g_mutex_unlock(&ra->lock);
+		return;
+	}
+	if(offset < ra->start || offset > ra->done) {
+		ra->start = offset;
+		ra->done  = offset;
+		ra->generation++;
+	}
+	ra->position = offset;
+	g_cond_signal(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+}
+
+
+void read_ahead_set_next(ReadAhead * ra, const gchar * path) {
+	g_mutex_lock(&ra->lock);
+	if(g_strcmp0(path, ra->next_path) != 0) {
+		g_free(ra->next_path);
+		ra->next_path = g_strdup(path);
+		ra->next_done = 0;
+		ra->generation++;
+		g_cond_signal(&ra->cond);
+	}
+	g_mutex_unlock(&ra->lock);
+}
+
+
+gint read_ahead_fill(ReadAhead * ra) {
+	g_mutex_lock(&ra->lock);
+	guint64 target = ra->path ? MIN(ra->window, ra->size - MIN(ra->position, ra->size)) : 0;
+	gint    fill   = target > 0 ? (ra->done - ra->position) * 100 / target : 100;
+	g_mutex_unlock(&ra->lock);
+	return MIN(fill, 100);
+}
+
+
+gboolean read_ahead_stalled(ReadAhead * ra) {
+	g_mutex_lock(&ra->lock);
+	gboolean stalled = ra->reading_since != 0 && g_get_monotonic_time() - ra->reading_since > READAHEAD_STALL_US &&
+	                   ra->done - ra->position < READAHEAD_CHUNK;
+	g_mutex_unlock(&ra->lock);
+	return stalled;
+}
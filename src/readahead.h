@@ -0,0 +1,21 @@
+#ifndef BANANA_READAHEAD_H
+#define BANANA_READAHEAD_H
+
+#include <glib.h>
+
+
+/* Keeps the page cache filled ahead of where playback reads, from a thread of its own, so a
+ * spun down disk or a slow NFS server stalls that thread instead of the streaming thread. Once
+ * far enough ahead, the beginning of the next file is read as well. Every function may be called
+ * from any thread. */
+typedef struct _ReadAhead ReadAhead;
+
+ReadAhead * read_ahead_new         (gsize window, gsize prefetch); /* bytes, 0 disables prefetching */
+void        read_ahead_free        (ReadAhead * ra);
+void        read_ahead_set_file    (ReadAhead * ra, const gchar * path); /* NULL when nothing plays */
+void        read_ahead_set_position(ReadAhead * ra, const gchar * path, guint64 offset);
+void        read_ahead_set_next    (ReadAhead * ra, const gchar * path); /* NULL if nothing follows */
+gint        read_ahead_fill        (ReadAhead * ra); /* percent of the window read ahead */
+gboolean    read_ahead_stalled     (ReadAhead * ra); /* playback caught up with a read that hangs */
+
+#endif
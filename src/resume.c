@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "resume.h"
+
+
+#define RESUME_FLUSH_SECONDS 5
+#define RESUME_COMPACT_LINES 256 /* never bother compacting a log shorter than this */
+#define RESUME_COMPACT_RATIO 4   /* compact once the log has this many lines per position */
+
+
+/* The log has one line per change: the position in milliseconds, or -1 for a forgotten one, a
+ * tab and the path. The last line of a path wins. */
+struct _ResumeStore {
+	gchar *      filename;
+	GHashTable * positions; /* path -> gint64 *, nanoseconds */
+	GHashTable * dirty;     /* paths changed since the last flush */
+	guint        lines;     /* lines in the log */
+	guint        flush_source;
+};
+
+
+static void resume_store_load(ResumeStore * store) {
+	gchar * contents;
+	if(!g_file_get_contents(store->filename, &contents, NULL, NULL))
+		return;
+
+	gchar ** lines = g_strsplit(contents, "\n", -1);
+	for(gchar ** line = lines; *line != NULL; line++) {
+		gchar * path = strchr(*line, '\t');
+		if(path == NULL)
+			continue;
+
+		gint64 ms = g_ascii_strtoll(*line, NULL, 10);
+		if(ms >= 0) {
+			gint64 * position = g_new(gint64, 1);
+			*position = ms * 1000000;
+			g_hash_table_insert(store->positions, g_strdup(path + 1), position);
+		}
+		else
+			g_hash_table_remove(store->positions, path + 1);
+		store->lines++;
+	}
+	g_strfreev(lines);
+	g_free(contents);
+}
+
+
+static void resume_store_append_line(GString * log, const gchar * path, gint64 position) {
+	g_string_append_printf(log, "%" G_GINT64_FORMAT "\t%s\n", position >= 0 ? position / 1000000 : -1, path);
+}
+
+
+/* Writes every position anew, dropping all the lines that were overwritten since */
+static void resume_store_compact(ResumeStore * store) {
+	GString *      log = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer       path, position;
+	g_hash_table_iter_init(&iter, store->positions);
+	while(g_hash_table_iter_next(&iter, &path, &position))
+		resume_store_append_line(log, path, *(gint64 *)position);
+
+	GError * error = NULL;
+	if(g_file_set_contents(store->filename, log->str, log->len, &error))
+		store->lines = g_hash_table_size(store->positions);
+	else {
+		g_printerr("[ERR] cannot compact resume positions: %s\n", error->message);
+		g_error_free(error);
+	}
+	g_string_free(log, TRUE);
+}
+
+
+void resume_store_flush(ResumeStore * store) {
+	if(g_hash_table_size(store->dirty) == 0)
+		return;
+
+	GString *      log = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer       path;
+	g_hash_table_iter_init(&iter, store->dirty);
+	while(g_hash_table_iter_next(&iter, &path, NULL)) {
+		gint64 * position = g_hash_table_lookup(store->positions, path);
+		resume_store_append_line(log, path, position ? *position : -1);
+	}
+
+	gint fd = open(store->filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if(fd < 0 || write(fd, log->str, log->len) != (gssize)log->len)
+		g_printerr("[ERR] cannot save resume positions: %s\n", g_strerror(errno));
+	else
+		store->lines += g_hash_table_size(store->dirty);
+	if(fd >= 0)
+		close(fd);
+	g_string_free(log, TRUE);
+	g_hash_table_remove_all(store->dirty);
+
+	if(store->lines > RESUME_COMPACT_LINES && store->lines > RESUME_COMPACT_RATIO * g_hash_table_size(store->positions))
+		resume_store_compact(store);
+}
+
+
+static gboolean resume_store_flush_cb(ResumeStore * store) {
+	resume_store_flush(store);
+	return G_SOURCE_CONTINUE;
+}
+
+
+ResumeStore * resume_store_new(const gchar * filename) {
+	ResumeStore * store = g_slice_new0(ResumeStore);
+	store->filename  = g_strdup(filename);
+	store->positions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	store->dirty     = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	gchar * directory = g_path_get_dirname(filename);
+	if(g_mkdir_with_parents(directory, 0755) != 0)
+		g_printerr("[ERR] cannot create `%s': %s\n", directory, g_strerror(errno));
+	g_free(directory);
+
+	resume_store_load(store);
+	store->flush_source = g_timeout_add_seconds(RESUME_FLUSH_SECONDS, (GSourceFunc)resume_store_flush_cb, store);
+	return store;
+}
+
+
+void resume_store_free(ResumeStore * store) {
+	g_source_remove(store->flush_source);
+	resume_store_flush(store);
+	g_hash_table_destroy(store->positions);
+	g_hash_table_destroy(store->dirty);
+	g_free(store->filename);
+	g_slice_free(ResumeStore, store);
+}
+
+
+gint64 resume_store_get(ResumeStore * store, const gchar * path) {
+	gint64 * position = g_hash_table_lookup(store->positions, path);
+	return position ? *position : -1;
+}
+
+
+/* Only updates memory; the change reaches the disk with the next flush */
+void resume_store_set(ResumeStore * store, const gchar * path, gint64 position) {
+	/* The log is line based */
+	if(strchr(path, '\n') != NULL)
+		return;
+
+	gint64 * old = g_hash_table_lookup(store->positions, path);
+	if(position < 0) {
+		if(old == NULL)
+			return;
+		g_hash_table_remove(store->positions, path);
+	}
+	else {
+		if(old != NULL && *old / 1000000 == position / 1000000)
+			return;
+		gint64 * value = g_new(gint64, 1);
+		*value = position;
+		g_hash_table_insert(store->positions, g_strdup(path), value);
+	}
+	g_hash_table_add(store->dirty, g_strdup(path));
+}
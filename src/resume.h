@@ -0,0 +1,18 @@
+#ifndef BANANA_RESUME_H
+#define BANANA_RESUME_H
+
+#include <glib.h>
+
+
+/* Where playback of each file was left, so it can carry on from there. Changes are kept in
+ * memory and appended to a log every few seconds or on resume_store_flush(); the log is rewritten
+ * from scratch once it is mostly outdated lines. Must only be used from the main context. */
+typedef struct _ResumeStore ResumeStore;
+
+ResumeStore * resume_store_new  (const gchar * filename);
+void          resume_store_free (ResumeStore * store);
+gint64        resume_store_get  (ResumeStore * store, const gchar * path); /* nanoseconds, -1 if none */
+void          resume_store_set  (ResumeStore * store, const gchar * path, gint64 position); /* -1 forgets */
+void          resume_store_flush(ResumeStore * store);
+
+#endif
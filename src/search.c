@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "search.h"
+#include "walker.h"
+
+
+#define SEARCH_NONE        G_MAXUINT32
+#define SEARCH_SCAN_MAX    50000 /* candidates scored per query */
+#define SEARCH_REBUILD_MIN 10000 /* removed entries before the index is rebuilt from scratch */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* Ids are stored in hash tables off by one, so that id 0 is not NULL */
+#define ID_TO_POINTER(id) GUINT_TO_POINTER((id) + 1)
+#define POINTER_TO_ID(p)  (GPOINTER_TO_UINT(p) - 1)
+
+
+typedef struct _SearchEntry {
+	gchar *      name;
+	gchar *      folded;    /* case folded name, for matching */
+	guint32      parent;    /* SEARCH_NONE for the root */
+	guint16      depth;
+	gboolean     directory;
+	gboolean     removed;   /* entries are never moved, removed ones stay until the next rebuild */
+	GHashTable * children;  /* name -> id, directories only */
+	int          wd;        /* inotify watch of a directory, -1 if none */
+} SearchEntry;
+
+
+typedef struct _SearchWalk {
+	SearchIndex * index;
+	Walker *      walker;
+	gboolean      root;     /* the walk that builds the index, as opposed to new subtrees */
+} SearchWalk;
+
+
+struct _SearchIndex {
+	gchar *      root_dir;
+	GArray *     entries;     /* SearchEntry, by id */
+	GHashTable * trigrams;    /* packed trigram -> GArray of ids, ascending */
+	GHashTable * directories; /* path -> id */
+	GHashTable * watches;     /* wd -> id */
+	guint        removed;
+	gboolean     ready;       /* the initial walk is complete */
+	GList *      walks;       /* SearchWalk *, running */
+
+	int          inotify_fd;
+	guint        inotify_source;
+	gboolean     watches_exhausted;
+};
+
+
+static void search_index_walk(SearchIndex * index, const gchar * path, gboolean root);
+
+
+static SearchEntry * search_entry(SearchIndex * index, guint32 id) {
+	return &g_array_index(index->entries, SearchEntry, id);
+}
+
+
+static gchar * search_fold(const gchar * name) {
+	return g_utf8_validate(name, -1, NULL) ? g_utf8_casefold(name, -1) : g_ascii_strdown(name, -1);
+}
+
+
+static guint32 trigram_key(const gchar * s) {
+	return ((guint32)(guint8)s[0] << 16) | ((guint32)(guint8)s[1] << 8) | (guint8)s[2];
+}
+
+
+static void search_index_add_trigrams(SearchIndex * index, guint32 id, const gchar * folded) {
+	for(const gchar * s = folded; s[0] && s[1] && s[2]; s++) {
+		gpointer key  = GUINT_TO_POINTER(trigram_key(s));
+		GArray * list = g_hash_table_lookup(index->trigrams, key);
+		if(list == NULL) {
+			list = g_array_new(FALSE, FALSE, sizeof(guint32));
+			g_hash_table_insert(index->trigrams, key, list);
+		}
+
+		/* All trigrams of an entry are added in one go, so a repeated one is always the last id */
+		if(list->len == 0 || g_array_index(list, guint32, list->len - 1) != id)
+			g_array_append_val(list, id);
+	}
+}
+
+
+/* Returns the full path of an entry */
+static gchar * search_index_path(SearchIndex * index, guint32 id) {
+	GPtrArray * names = g_ptr_array_new();
+	gboolean    directory = search_entry(index, id)->directory;
+	for(; id != SEARCH_NONE && search_entry(index, id)->parent != SEARCH_NONE; id = search_entry(index, id)->parent)
+		g_ptr_array_add(names, search_entry(index, id)->name);
+
+	GString * path = g_string_new(index->root_dir);
+	for(guint i = names->len; i > 0; i--) {
+		g_string_append(path, g_ptr_array_index(names, i - 1));
+		if(i > 1 || directory)
+			g_string_append_c(path, '/');
+	}
+	g_ptr_array_free(names, TRUE);
+	return g_string_free(path, FALSE);
+}
+
+
+static void search_index_watch(SearchIndex * index, guint32 id, const gchar * path) {
+	if(g_hash_table_contains(index->directories, path))
+		return;
+	g_hash_table_insert(index->directories, g_strdup(path), ID_TO_POINTER(id));
+
+	if(index->inotify_fd == -1)
+		return;
+
+	int wd = inotify_add_watch(index->inotify_fd, path, WATCH_MASK);
+	if(wd == -1) {
+		if(errno == ENOSPC && !index->watches_exhausted) {
+			g_printerr("[ERR] out of inotify watches, search results may go stale (see fs.inotify.max_user_watches)\n");
+			index->watches_exhausted = TRUE;
+		}
+		return;
+	}
+	search_entry(index, id)->wd = wd;
+	g_hash_table_insert(index->watches, GINT_TO_POINTER(wd), ID_TO_POINTER(id));
+}
+
+
+/* Adds `name' to the directory `parent' and returns its id. Names that are already known are not
+ * added twice, so walks and inotify events may overlap freely. */
+static guint32 search_index_add(SearchIndex * index, guint32 parent, const gchar * name, gboolean directory) {
+	gpointer existing = g_hash_table_lookup(search_entry(index, parent)->children, name);
+	if(existing != NULL)
+		return POINTER_TO_ID(existing);
+
+	SearchEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.name      = g_strdup(name);
+	entry.folded    = search_fold(name);
+	entry.parent    = parent;
+	entry.depth     = search_entry(index, parent)->depth + 1;
+	entry.directory = directory;
+	entry.children  = directory ? g_hash_table_new(g_str_hash, g_str_equal) : NULL;
+	entry.wd        = -1;
+
+	guint32 id = index->entries->len;
+	g_array_append_val(index->entries, entry);
+	g_hash_table_insert(search_entry(index, parent)->children, search_entry(index, id)->name, ID_TO_POINTER(id));
+	search_index_add_trigrams(index, id, search_entry(index, id)->folded);
+	return id;
+}
+
+
+static void search_index_remove(SearchIndex * index, guint32 id) {
+	SearchEntry * entry = search_entry(index, id);
+	if(entry->removed)
+		return;
+
+	if(entry->directory) {
+		GList * children = g_hash_table_get_values(entry->children);
+		for(GList * l = children; l != NULL; l = l->next)
+			search_index_remove(index, POINTER_TO_ID(l->data));
+		g_list_free(children);
+
+		gchar * path = search_index_path(index, id);
+		g_hash_table_remove(index->directories, path);
+		g_free(path);
+
+		if(entry->wd != -1) {
+			g_hash_table_remove(index->watches, GINT_TO_POINTER(entry->wd));
+			inotify_rm_watch(index->inotify_fd, entry->wd);
+			entry->wd = -1;
+		}
+		g_hash_table_destroy(entry->children);
+		entry->children = NULL;
+	}
+
+	if(entry->parent != SEARCH_NONE)
+		g_hash_table_remove(search_entry(index, entry->parent)->children, entry->name);
+	entry->removed = TRUE;
+	index->removed++;
+}
+
+
+static void search_walk_batch(GPtrArray * files, SearchWalk * walk) {
+	SearchIndex * index = walk->index;
+	for(guint i = 0; i < files->len; i++) {
+		const WalkerFile * file = g_ptr_array_index(files, i);
+
+		gsize         length = strlen(file->path) - (file->directory ? 1 : 0);
+		const gchar * slash  = g_strrstr_len(file->path, length, "/");
+		if(slash == NULL)
+			continue;
+
+		gchar *  parent_path = g_strndup(file->path, slash - file->path + 1);
+		gpointer parent      = g_hash_table_lookup(index->directories, parent_path);
+		g_free(parent_path);
+		if(parent == NULL)
+			continue; /* removed while we were walking */
+
+		gchar * name = g_strndup(slash + 1, file->path + length - (slash + 1));
+		guint32 id   = search_index_add(index, POINTER_TO_ID(parent), name, file->directory);
+		g_free(name);
+		if(file->directory)
+			search_index_watch(index, id, file->path);
+	}
+}
+
+
+static void search_walk_done(SearchWalk * walk) {
+	SearchIndex * index = walk->index;
+	index->walks = g_list_remove(index->walks, walk);
+	if(walk->root) {
+		index->ready = TRUE;
+		g_print("[SEARCH] indexed %u entries\n", index->entries->len);
+	}
+	g_slice_free(SearchWalk, walk);
+}
+
+
+static void search_index_clear(SearchIndex * index) {
+	for(GList * l = index->walks; l != NULL; l = l->next) {
+		walker_cancel(((SearchWalk *)l->data)->walker);
+		g_slice_free(SearchWalk, l->data);
+	}
+	g_list_free(index->walks);
+	index->walks = NULL;
+
+	if(index->inotify_source)
+		g_source_remove(index->inotify_source);
+	if(index->inotify_fd != -1)
+		close(index->inotify_fd);
+	index->inotify_source = 0;
+	index->inotify_fd     = -1;
+
+	for(guint i = 0; i < index->entries->len; i++) {
+		SearchEntry * entry = search_entry(index, i);
+		if(entry->children)
+			g_hash_table_destroy(entry->children);
+		g_free(entry->name);
+		g_free(entry->folded);
+	}
+	g_array_set_size(index->entries, 0);
+	g_hash_table_remove_all(index->trigrams);
+	g_hash_table_remove_all(index->directories);
+	g_hash_table_remove_all(index->watches);
+	index->removed = 0;
+	index->ready   = FALSE;
+}
+
+
+static gboolean inotify_cb(GIOChannel * channel, GIOCondition condition, SearchIndex * index);
+
+
+/* Throws everything away and walks the tree again */
+static void search_index_rebuild(SearchIndex * index) {
+	search_index_clear(index);
+
+	index->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(index->inotify_fd == -1)
+		g_printerr("[ERR] inotify unavailable, search results will go stale: %s\n", g_strerror(errno));
+	else {
+		GIOChannel * channel = g_io_channel_unix_new(index->inotify_fd);
+		index->inotify_source = g_io_add_watch(channel, G_IO_IN, (GIOFunc)inotify_cb, index);
+		g_io_channel_unref(channel);
+	}
+
+	SearchEntry root;
+	memset(&root, 0, sizeof(root));
+	root.name     = g_strdup("");
+	root.folded   = g_strdup("");
+	root.parent   = SEARCH_NONE;
+	root.directory = TRUE;
+	root.children = g_hash_table_new(g_str_hash, g_str_equal);
+	root.wd       = -1;
+	g_array_append_val(index->entries, root);
+	search_index_watch(index, 0, index->root_dir);
+
+	search_index_walk(index, index->root_dir, TRUE);
+}
+
+
+static void search_index_walk(SearchIndex * index, const gchar * path, gboolean root) {
+	SearchWalk * walk = g_slice_new(SearchWalk);
+	walk->index  = index;
+	walk->root   = root;
+	walk->walker = walker_start(path, (WalkerBatchFunc)search_walk_batch, (WalkerDoneFunc)search_walk_done, walk);
+	index->walks = g_list_prepend(index->walks, walk);
+}
+
+
+static gboolean inotify_cb(GIOChannel * channel, GIOCondition condition, SearchIndex * index) {
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	ssize_t length = read(index->inotify_fd, buffer, sizeof(buffer));
+	if(length <= 0)
+		return TRUE;
+
+	for(char * p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+		const struct inotify_event * event = (const struct inotify_event *)p;
+
+		if(event->mask & IN_Q_OVERFLOW) {
+			g_printerr("[ERR] inotify queue overflow, rebuilding the search index\n");
+			search_index_rebuild(index);
+			return G_SOURCE_REMOVE; /* the rebuild installed a new watch */
+		}
+
+		gpointer directory = g_hash_table_lookup(index->watches, GINT_TO_POINTER(event->wd));
+		if(directory == NULL)
+			continue;
+
+		if(event->mask & IN_IGNORED) {
+			search_entry(index, POINTER_TO_ID(directory))->wd = -1;
+			g_hash_table_remove(index->watches, GINT_TO_POINTER(event->wd));
+			continue;
+		}
+		if(event->len == 0 || event->name[0] == '.')
+			continue;
+
+		guint32 parent = POINTER_TO_ID(directory);
+		if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			gboolean is_dir = (event->mask & IN_ISDIR) != 0;
+			guint32  id     = search_index_add(index, parent, event->name, is_dir);
+			if(is_dir) {
+				/* A directory moved in may come with contents of its own */
+				gchar * path = search_index_path(index, id);
+				search_index_watch(index, id, path);
+				search_index_walk(index, path, FALSE);
+				g_free(path);
+			}
+		}
+		else if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			gpointer child = g_hash_table_lookup(search_entry(index, parent)->children, event->name);
+			if(child != NULL)
+				search_index_remove(index, POINTER_TO_ID(child));
+		}
+	}
+
+	/* Removed entries still take up memory and posting list slots */
+	if(index->removed >= SEARCH_REBUILD_MIN && index->removed > index->entries->len / 2) {
+		search_index_rebuild(index);
+		return G_SOURCE_REMOVE;
+	}
+	return TRUE;
+}
+
+
+SearchIndex * search_index_new(const gchar * root_dir) {
+	SearchIndex * index = g_slice_new0(SearchIndex);
+	index->root_dir    = g_strdup(root_dir);
+	index->entries     = g_array_new(FALSE, FALSE, sizeof(SearchEntry));
+	index->trigrams    = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_array_unref);
+	index->directories = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index->watches     = g_hash_table_new(g_direct_hash, g_direct_equal);
+	index->inotify_fd  = -1;
+
+	search_index_rebuild(index);
+	return index;
+}
+
+
+void search_index_free(SearchIndex * index) {
+	search_index_clear(index);
+	g_array_unref(index->entries);
+	g_hash_table_destroy(index->trigrams);
+	g_hash_table_destroy(index->directories);
+	g_hash_table_destroy(index->watches);
+	g_free(index->root_dir);
+	g_slice_free(SearchIndex, index);
+}
+
+
+/* FALSE while the initial walk is still running and results may be incomplete */
+gboolean search_index_is_ready(SearchIndex * index) {
+	return index->ready;
+}
+
+
+static gboolean id_list_contains(GArray * list, guint32 id) {
+	guint low = 0, high = list->len;
+	while(low < high) {
+		guint    middle = (low + high) / 2;
+		guint32  value  = g_array_index(list, guint32, middle);
+		if(value == id)
+			return TRUE;
+		if(value < id)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return FALSE;
+}
+
+
+/* Marks every live entry whose name contains `word' and returns their ids. Words of three bytes
+ * or more are looked up by the posting lists of their trigrams, shorter ones need a full scan. */
+static GArray * search_index_match(SearchIndex * index, const gchar * word, guint8 * marks) {
+	GArray * matches = g_array_new(FALSE, FALSE, sizeof(guint32));
+	gsize    length  = strlen(word);
+
+	if(length < 3) {
+		for(guint32 id = 1; id < index->entries->len; id++) {
+			SearchEntry * entry = search_entry(index, id);
+			if(!entry->removed && strstr(entry->folded, word) != NULL) {
+				g_array_append_val(matches, id);
+				marks[id] = 1;
+			}
+		}
+		return matches;
+	}
+
+	GPtrArray * lists    = g_ptr_array_new();
+	GArray *    shortest = NULL;
+	for(gsize i = 0; i + 3 <= length; i++) {
+		GArray * list = g_hash_table_lookup(index->trigrams, GUINT_TO_POINTER(trigram_key(word + i)));
+		if(list == NULL) {
+			g_ptr_array_free(lists, TRUE);
+			return matches;
+		}
+		g_ptr_array_add(lists, list);
+		if(shortest == NULL || list->len < shortest->len)
+			shortest = list;
+	}
+
+	for(guint i = 0; i < shortest->len; i++) {
+		guint32       id    = g_array_index(shortest, guint32, i);
+		SearchEntry * entry = search_entry(index, id);
+		if(entry->removed)
+			continue;
+
+		gboolean candidate = TRUE;
+		for(guint l = 0; l < lists->len && candidate; l++)
+			candidate = g_ptr_array_index(lists, l) == shortest || id_list_contains(g_ptr_array_index(lists, l), id);
+
+		/* The trigrams may appear in a different order, only the name itself can tell */
+		if(candidate && strstr(entry->folded, word) != NULL) {
+			g_array_append_val(matches, id);
+			marks[id] = 1;
+		}
+	}
+
+	g_ptr_array_free(lists, TRUE);
+	return matches;
+}
+
+
+typedef struct _ScoredEntry {
+	guint32 id;
+	gint    score;
+} ScoredEntry;
+
+
+static gint compare_scored(gconstpointer a, gconstpointer b) {
+	const ScoredEntry * sa = a;
+	const ScoredEntry * sb = b;
+	if(sa->score != sb->score)
+		return sa->score > sb->score ? -1 : 1;
+	return sa->id < sb->id ? -1 : 1;
+}
+
+
+static void search_result_free(SearchResult * result) {
+	g_free(result->path);
+	g_slice_free(SearchResult, result);
+}
+
+
+/* Scores how well `id' matches all `words', or returns FALSE if one of them is missing from its
+ * path. Matches in the name itself count most, at the start of a word even more; matches in
+ * parent directories count less the further up they are. Short and shallow paths win ties. */
+static gboolean search_index_score(SearchIndex * index, guint32 id, gchar ** words, guint8 ** marks, guint n_words, gint * score) {
+	SearchEntry * entry = search_entry(index, id);
+	*score = 0;
+
+	for(guint w = 0; w < n_words; w++) {
+		guint   distance = 0;
+		guint32 match    = id;
+		while(match != SEARCH_NONE && !marks[w][match]) {
+			match = search_entry(index, match)->parent;
+			distance++;
+		}
+		if(match == SEARCH_NONE)
+			return FALSE;
+
+		if(distance == 0) {
+			const gchar * found = strstr(entry->folded, words[w]);
+			*score += found == entry->folded || !g_ascii_isalnum(found[-1]) ? 150 : 100;
+		}
+		else
+			*score += 40 / distance;
+	}
+
+	*score -= entry->depth * 2 + strlen(entry->name) / 4;
+	return TRUE;
+}
+
+
+/* Returns up to `limit' entries matching every word of `query', best matches first */
+GPtrArray * search_index_query(SearchIndex * index, const gchar * query, guint limit) {
+	GPtrArray * results = g_ptr_array_new_with_free_func((GDestroyNotify)search_result_free);
+
+	gchar *  folded = search_fold(query);
+	gchar ** words  = g_strsplit_set(folded, " \t", -1);
+	g_free(folded);
+
+	guint n_words = 0;
+	for(guint i = 0; words[i] != NULL; i++)
+		if(words[i][0] != '\0')
+			words[n_words++] = words[i];
+		else
+			g_free(words[i]);
+	words[n_words] = NULL;
+	if(n_words == 0) {
+		g_strfreev(words);
+		return results;
+	}
+
+	guint     n       = index->entries->len;
+	GArray ** matches = g_new(GArray *, n_words);
+	guint8 ** marks   = g_new(guint8 *, n_words);
+	guint     rarest  = 0;
+	for(guint w = 0; w < n_words; w++) {
+		marks[w]   = g_malloc0(n);
+		matches[w] = search_index_match(index, words[w], marks[w]);
+		if(matches[w]->len < matches[rarest]->len)
+			rarest = w;
+	}
+
+	/* Every result lies inside a match of the rarest word, the other words are checked along
+	 * the path of each candidate */
+	guint8 * seen   = g_malloc0(n);
+	GArray * stack  = g_array_new(FALSE, FALSE, sizeof(guint32));
+	GArray * scored = g_array_new(FALSE, FALSE, sizeof(ScoredEntry));
+	guint    scanned = 0;
+	for(guint i = 0; i < matches[rarest]->len && scanned < SEARCH_SCAN_MAX; i++) {
+		g_array_append_val(stack, g_array_index(matches[rarest], guint32, i));
+		while(stack->len > 0 && scanned < SEARCH_SCAN_MAX) {
+			guint32 id = g_array_index(stack, guint32, stack->len - 1);
+			g_array_set_size(stack, stack->len - 1);
+			if(seen[id])
+				continue;
+			seen[id] = 1;
+			scanned++;
+
+			ScoredEntry candidate = { id, 0 };
+			if(search_index_score(index, id, words, marks, n_words, &candidate.score))
+				g_array_append_val(scored, candidate);
+
+			SearchEntry * entry = search_entry(index, id);
+			if(entry->children != NULL) {
+				GHashTableIter iter;
+				gpointer       child;
+				g_hash_table_iter_init(&iter, entry->children);
+				while(g_hash_table_iter_next(&iter, NULL, &child)) {
+					guint32 child_id = POINTER_TO_ID(child);
+					g_array_append_val(stack, child_id);
+				}
+			}
+		}
+		g_array_set_size(stack, 0);
+	}
+
+	g_array_sort(scored, compare_scored);
+	for(guint i = 0; i < scored->len && i < limit; i++) {
+		ScoredEntry * candidate = &g_array_index(scored, ScoredEntry, i);
+		SearchResult * result   = g_slice_new(SearchResult);
+		result->path      = search_index_path(index, candidate->id);
+		result->directory = search_entry(index, candidate->id)->directory;
+		result->score     = candidate->score;
+		g_ptr_array_add(results, result);
+	}
+
+	for(guint w = 0; w < n_words; w++) {
+		g_array_unref(matches[w]);
+		g_free(marks[w]);
+	}
+	g_free(matches);
+	g_free(marks);
+	g_free(seen);
+	g_array_unref(stack);
+	g_array_unref(scored);
+	g_strfreev(words);
+	return results;
+}
@@ -0,0 +1,26 @@
+#ifndef BANANA_SEARCH_H
+#define BANANA_SEARCH_H
+
+#include <glib.h>
+
+
+typedef struct _SearchResult {
+	gchar *  path;      /* directories end with a '/' */
+	gboolean directory;
+	gint     score;
+} SearchResult;
+
+
+/* In-memory index of every file and directory name below the media root, for searching the whole
+ * library without walking the tree. The index is built by a background walk and kept current
+ * with inotify. Names are indexed by trigram; a query matches a path when every word of the query
+ * is found in the name of the entry or of one of its parent directories. Must only be used from
+ * the main context. */
+typedef struct _SearchIndex SearchIndex;
+
+SearchIndex * search_index_new     (const gchar * root_dir);
+void          search_index_free    (SearchIndex * index);
+gboolean      search_index_is_ready(SearchIndex * index);
+GPtrArray *   search_index_query   (SearchIndex * index, const gchar * query, guint limit); /* SearchResult *, best first */
+
+#endif
@@ -0,0 +1,164 @@
+#include <string.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/net/gstnetclientclock.h>
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+
+#include "sync.h"
+
+
+#define SYNC_RECONNECT_SECONDS 2
+
+
+struct _SyncFollower {
+	gchar *                   host;
+	gchar *                   url;
+	SoupSession *             session;
+	SoupWebsocketConnection * connection;  /* NULL while disconnected */
+	GCancellable *            cancellable; /* of connecting, cancelled when the follower is freed */
+	GstClock *                clock;       /* network client clock of the master, NULL until known */
+	gint                      clock_port;
+	SyncMessageFunc           func;
+	gpointer                  user_data;
+	guint                     reconnect_source;
+};
+
+
+static void sync_follower_connect(SyncFollower * follower);
+
+
+static gboolean sync_follower_reconnect_cb(SyncFollower * follower) {
+	follower->reconnect_source = 0;
+	sync_follower_connect(follower);
+	return G_SOURCE_REMOVE;
+}
+
+
+static void sync_follower_schedule_reconnect(SyncFollower * follower) {
+	if(follower->reconnect_source == 0)
+		follower->reconnect_source = g_timeout_add_seconds(SYNC_RECONNECT_SECONDS, (GSourceFunc)sync_follower_reconnect_cb, follower);
+}
+
+
+static void sync_follower_message_cb(SoupWebsocketConnection * connection, gint type, GBytes * message, SyncFollower * follower) {
+	if(type != SOUP_WEBSOCKET_DATA_TEXT)
+		return;
+
+	gsize         size;
+	const gchar * json   = g_bytes_get_data(message, &size);
+	JsonParser *  parser = json_parser_new();
+	if(json_parser_load_from_data(parser, json, size, NULL) && JSON_NODE_HOLDS_OBJECT(json_parser_get_root(parser)))
+		follower->func(json_node_get_object(json_parser_get_root(parser)), follower->user_data);
+	g_object_unref(parser);
+}
+
+
+static void sync_follower_closed_cb(SoupWebsocketConnection * connection, SyncFollower * follower) {
+	g_printerr("[SYNC] lost the master at %s\n", follower->url);
+	g_signal_handlers_disconnect_by_data(connection, follower);
+	g_clear_object(&follower->connection);
+	sync_follower_schedule_reconnect(follower);
+}
+
+
+static void sync_follower_connected_cb(SoupSession * session, GAsyncResult * result, SyncFollower * follower) {
+	GError * error = NULL;
+	SoupWebsocketConnection * connection = soup_session_websocket_connect_finish(session, result, &error);
+	if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		/* The follower is gone */
+		g_error_free(error);
+		return;
+	}
+	if(connection == NULL) {
+		g_printerr("[SYNC] cannot reach the master at %s: %s\n", follower->url, error->message);
+		g_error_free(error);
+		sync_follower_schedule_reconnect(follower);
+		return;
+	}
+
+	g_print("[SYNC] following %s\n", follower->url);
+	follower->connection = connection;
+	g_signal_connect(connection, "message", (GCallback)sync_follower_message_cb, follower);
+	g_signal_connect(connection, "closed" , (GCallback)sync_follower_closed_cb , follower);
+}
+
+
+static void sync_follower_connect(SyncFollower * follower) {
+	char *        protocols[] = { SYNC_PROTOCOL, NULL };
+	SoupMessage * msg         = soup_message_new("GET", follower->url);
+	soup_session_websocket_connect_async(follower->session, msg, NULL, protocols, follower->cancellable, (GAsyncReadyCallback)sync_follower_connected_cb, follower);
+	g_object_unref(msg);
+}
+
+
+SyncFollower * sync_follower_new(const gchar * master, SyncMessageFunc func, gpointer user_data) {
+	const gchar * colon = strrchr(master, ':');
+	if(colon == NULL || colon == master)
+		return NULL;
+
+	SyncFollower * follower = g_slice_new0(SyncFollower);
+	follower->host        = g_strndup(master, colon - master);
+	follower->url         = g_strdup_printf("ws://%s/ws", master);
+	follower->session     = soup_session_new();
+	follower->cancellable = g_cancellable_new();
+	follower->func        = func;
+	follower->user_data   = user_data;
+	sync_follower_connect(follower);
+	return follower;
+}
+
+
+void sync_follower_free(SyncFollower * follower) {
+	if(follower->reconnect_source)
+		g_source_remove(follower->reconnect_source);
+	if(follower->connection != NULL) {
+		g_signal_handlers_disconnect_by_data(follower->connection, follower);
+		soup_websocket_connection_close(follower->connection, SOUP_WEBSOCKET_CLOSE_GOING_AWAY, NULL);
+		g_object_unref(follower->connection);
+	}
+	g_cancellable_cancel(follower->cancellable);
+	g_object_unref(follower->cancellable);
+	soup_session_abort(follower->session);
+	g_object_unref(follower->session);
+	if(follower->clock != NULL)
+		gst_object_unref(follower->clock);
+	g_free(follower->host);
+	g_free(follower->url);
+	g_slice_free(SyncFollower, follower);
+}
+
+
+gboolean sync_follower_connected(SyncFollower * follower) {
+	return follower->connection != NULL;
+}
+
+
+void sync_follower_send(SyncFollower * follower, JsonObject * message) {
+	if(follower->connection == NULL)
+		return;
+
+	JsonNode * node = json_node_alloc();
+	json_node_init_object(node, message);
+	gchar * json = json_to_string(node, FALSE);
+	soup_websocket_connection_send_text(follower->connection, json);
+	g_free(json);
+	json_node_unref(node);
+}
+
+
+/* The clock is created when the master first tells where it is published, and only handed out
+ * once it has converged, so the pipeline never runs on a clock that is still way off */
+GstClock * sync_follower_get_clock(SyncFollower * follower, gint port) {
+	if(follower->clock != NULL && port != follower->clock_port) {
+		gst_object_unref(follower->clock);
+		follower->clock = NULL;
+	}
+	if(follower->clock == NULL) {
+		follower->clock      = gst_net_client_clock_new("master", follower->host, port, 0);
+		follower->clock_port = port;
+		g_print("[SYNC] using the clock of %s:%d\n", follower->host, port);
+	}
+	return gst_clock_is_synced(follower->clock) ? follower->clock : NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef BANANA_SYNC_H
+#define BANANA_SYNC_H
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+
+
+/* Playback in lockstep across players. The master publishes its pipeline clock on the network
+ * and tells its followers what it plays and where; followers connect to the master's websocket
+ * with their own subprotocol, slave their pipeline to its clock and forward the commands of
+ * their own clients to it. This is the follower's end of the connection: it reconnects whenever
+ * the master goes away, and provides the master's clock once it has synchronized with it. Must
+ * only be used from the main context. */
+#define SYNC_PROTOCOL "banana.sync"
+
+typedef struct _SyncFollower SyncFollower;
+
+typedef void (*SyncMessageFunc)(JsonObject * message, gpointer user_data);
+
+SyncFollower * sync_follower_new      (const gchar * master, SyncMessageFunc func, gpointer user_data); /* HOST:PORT */
+void           sync_follower_free     (SyncFollower * follower);
+void           sync_follower_send     (SyncFollower * follower, JsonObject * message);
+gboolean       sync_follower_connected(SyncFollower * follower);
+GstClock *     sync_follower_get_clock(SyncFollower * follower, gint port); /* borrowed, NULL until synchronized */
+
+#endif
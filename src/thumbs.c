@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+
+#include "thumbs.h"
+#include "workers.h"
+
+
+#define THUMB_WIDTH       320                 /* pixels, the height follows the aspect ratio */
+#define THUMB_NICE        19
+#define THUMB_QUEUE_MAX   64                  /* previews waiting to be generated */
+#define THUMB_RESOLVERS   4                   /* threads looking up requests, a listing asks for many at once */
+#define THUMB_TIMEOUT     (10 * GST_SECOND)   /* for prerolling and seeking */
+#define THUMB_DEFAULT_MAX (5 * 60 * GST_SECOND) /* latest position of the representative frame */
+#define THUMB_MAX_AGE     3600                /* seconds clients may reuse a preview */
+
+#define PLAY_FLAG_VIDEO   (1 << 0)            /* from GstPlayFlags, which is not public */
+
+
+struct _ThumbService {
+	gchar *       root_dir;   /* canonical, ends with a '/' */
+	gchar *       cache_dir;
+	gchar *       folder;     /* canonical folder being browsed, its previews come first */
+	SoupServer *  server;
+
+	WorkerPool *  pool;
+	WorkerPool *  resolver;   /* canonicalizes paths and reads cached previews, which may be on a slow mount */
+	GstTaskPool * task_pool;
+	GHashTable *  jobs;       /* key -> ThumbJob, previews being generated */
+	GHashTable *  failed;     /* keys of files without a video frame */
+	guint64       sequence;
+	guint         folders;    /* folders asked for, only the latest one is used */
+	gint          shutdown;
+};
+
+
+/* One preview being generated, with every request waiting for it */
+typedef struct _ThumbJob {
+	ThumbService * service;
+	gchar *        key;
+	gchar *        path;
+	gchar *        directory;  /* with a trailing '/' */
+	gchar *        cache_path;
+	gint64         time;       /* seconds, -1 for a representative frame */
+	guint64        sequence;
+	GList *        waiters;    /* SoupMessage * */
+
+	GBytes *       jpeg;       /* result */
+	GError *       error;
+} ThumbJob;
+
+
+static void thumb_playbin_free(GstElement * playbin) {
+	gst_element_set_state(playbin, GST_STATE_NULL);
+	gst_object_unref(playbin);
+}
+
+
+static GPrivate thumb_playbin = G_PRIVATE_INIT((GDestroyNotify)thumb_playbin_free);
+
+
+static GstBusSyncReply thumb_bus_sync(GstBus * bus, GstMessage * msg, GstTaskPool * task_pool) {
+	worker_task_pool_adopt(task_pool, msg);
+
+	/* Nobody watches the preview pipelines, errors show up as failed state changes */
+	return GST_BUS_DROP;
+}
+
+
+/* Every worker thread keeps its own video-only playbin around between previews */
+static GstElement * thumb_playbin_get(ThumbService * service) {
+	GstElement * playbin = g_private_get(&thumb_playbin);
+	if(playbin != NULL)
+		return playbin;
+
+	playbin = gst_element_factory_make("playbin", NULL);
+	if(playbin == NULL)
+		return NULL;
+	g_object_set(playbin,
+		"flags"     , PLAY_FLAG_VIDEO,
+		"video-sink", gst_element_factory_make("fakesink", NULL),
+		"audio-sink", gst_element_factory_make("fakesink", NULL),
+		NULL);
+
+	GstBus * bus = gst_element_get_bus(playbin);
+	gst_bus_set_sync_handler(bus, (GstBusSyncHandler)thumb_bus_sync, gst_object_ref(service->task_pool), gst_object_unref);
+	gst_object_unref(bus);
+
+	g_private_set(&thumb_playbin, playbin);
+	return playbin;
+}
+
+
+static gboolean thumb_wait(GstElement * playbin, GError ** error) {
+	GstStateChangeReturn ret = gst_element_get_state(playbin, NULL, NULL, THUMB_TIMEOUT);
+	if(ret == GST_STATE_CHANGE_SUCCESS || ret == GST_STATE_CHANGE_NO_PREROLL)
+		return TRUE;
+
+	g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_STATE_CHANGE, ret == GST_STATE_CHANGE_ASYNC ? "timed out" : "cannot decode");
+	return FALSE;
+}
+
+
+/* Decodes the keyframe at or before `time' and encodes it as a small JPEG. Runs in a worker. */
+static GBytes * thumb_render(ThumbService * service, const gchar * path, gint64 time, GError ** error) {
+	GstElement * playbin = thumb_playbin_get(service);
+	if(playbin == NULL) {
+		g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_MISSING_PLUGIN, "no playbin");
+		return NULL;
+	}
+
+	gchar * uri = gst_filename_to_uri(path, error);
+	if(uri == NULL)
+		return NULL;
+	g_object_set(playbin, "uri", uri, NULL);
+	g_free(uri);
+
+	GBytes * jpeg = NULL;
+	gst_element_set_state(playbin, GST_STATE_PAUSED);
+	if(!thumb_wait(playbin, error))
+		goto out;
+
+	gint64 position = time * GST_SECOND;
+	if(time < 0) {
+		gint64 duration;
+		position = gst_element_query_duration(playbin, GST_FORMAT_TIME, &duration) ? MIN(duration / 10, THUMB_DEFAULT_MAX) : 0;
+	}
+
+	/* Snapping to the previous keyframe means a single frame is decoded, whatever the GOP size */
+	if(position > 0) {
+		gst_element_seek_simple(playbin, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE, position);
+		if(!thumb_wait(playbin, error))
+			goto out;
+	}
+
+	GstCaps *   caps   = gst_caps_new_simple("image/jpeg", "width", G_TYPE_INT, THUMB_WIDTH, "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1, NULL);
+	GstSample * sample = NULL;
+	g_signal_emit_by_name(playbin, "convert-sample", caps, &sample);
+	gst_caps_unref(caps);
+
+	GstBuffer * buffer = sample ? gst_sample_get_buffer(sample) : NULL;
+	GstMapInfo  map;
+	if(buffer != NULL && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+		jpeg = g_bytes_new(map.data, map.size);
+		gst_buffer_unmap(buffer, &map);
+	}
+	else
+		g_set_error(error, GST_STREAM_ERROR, GST_STREAM_ERROR_DECODE, "no video frame");
+	if(sample != NULL)
+		gst_sample_unref(sample);
+
+out:
+	gst_element_set_state(playbin, GST_STATE_READY);
+	return jpeg;
+}
+
+
+static void thumb_job_run(ThumbJob * job) {
+	if(g_atomic_int_get(&job->service->shutdown))
+		return;
+
+	job->jpeg = thumb_render(job->service, job->path, job->time, &job->error);
+	if(job->jpeg == NULL)
+		return;
+
+	gsize         size;
+	const gchar * data      = g_bytes_get_data(job->jpeg, &size);
+	gchar *       directory = g_path_get_dirname(job->cache_path);
+	GError *      error     = NULL;
+	if(g_mkdir_with_parents(directory, 0755) != 0 || !g_file_set_contents(job->cache_path, data, size, &error)) {
+		g_printerr("[ERR] cannot cache preview of %s: %s\n", job->path, error ? error->message : g_strerror(errno));
+		g_clear_error(&error);
+	}
+	g_free(directory);
+}
+
+
+static void thumb_respond(SoupMessage * msg, const gchar * key, GBytes * jpeg) {
+	if(jpeg == NULL) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	gchar * etag          = g_strdup_printf("\"%s\"", key);
+	gchar * cache_control = g_strdup_printf("max-age=%d", THUMB_MAX_AGE);
+	soup_message_headers_replace(msg->response_headers, "ETag"         , etag);
+	soup_message_headers_replace(msg->response_headers, "Cache-Control", cache_control);
+	soup_message_headers_set_content_type(msg->response_headers, "image/jpeg", NULL);
+	g_free(cache_control);
+	g_free(etag);
+
+	SoupBuffer * buffer = soup_buffer_new_with_owner(g_bytes_get_data(jpeg, NULL), g_bytes_get_size(jpeg), g_bytes_ref(jpeg), (GDestroyNotify)g_bytes_unref);
+	soup_message_body_append_buffer(msg->response_body, buffer);
+	soup_buffer_free(buffer);
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+
+static void thumb_waiter_finished(SoupMessage * msg, ThumbJob * job) {
+	g_signal_handlers_disconnect_by_data(msg, job);
+	job->waiters = g_list_remove(job->waiters, msg);
+	g_object_unref(msg);
+}
+
+
+static void thumb_job_done(ThumbJob * job) {
+	ThumbService * service = job->service;
+	g_hash_table_remove(service->jobs, job->key);
+
+	if(job->jpeg == NULL && job->error != NULL) {
+		g_print("[THUMB] no preview for %s: %s\n", job->path, job->error->message);
+		g_hash_table_add(service->failed, g_strdup(job->key));
+	}
+
+	for(GList * l = job->waiters; l != NULL; l = l->next) {
+		SoupMessage * msg = l->data;
+		g_signal_handlers_disconnect_by_data(msg, job);
+		thumb_respond(msg, job->key, job->jpeg);
+		soup_server_unpause_message(service->server, msg);
+		g_object_unref(msg);
+	}
+	g_list_free(job->waiters);
+
+	if(job->jpeg)
+		g_bytes_unref(job->jpeg);
+	g_clear_error(&job->error);
+	g_free(job->key);
+	g_free(job->path);
+	g_free(job->directory);
+	g_free(job->cache_path);
+	g_slice_free(ThumbJob, job);
+}
+
+
+/* Previews of the folder being browsed come first, newer requests before older ones since the
+ * user has most likely scrolled past whatever asked first */
+static gint thumb_job_compare(const ThumbJob * a, const ThumbJob * b, ThumbService * service) {
+	gboolean a_browsed = service->folder != NULL && strcmp(a->directory, service->folder) == 0;
+	gboolean b_browsed = service->folder != NULL && strcmp(b->directory, service->folder) == 0;
+	if(a_browsed != b_browsed)
+		return a_browsed ? -1 : 1;
+	return a->sequence > b->sequence ? -1 : 1;
+}
+
+
+/* Returns the canonical form of `path' if it is below the media root, NULL otherwise */
+static gchar * thumb_service_resolve(ThumbService * service, const gchar * path) {
+	char * canonical = realpath(path, NULL);
+	if(canonical == NULL)
+		return NULL;
+
+	gchar * result = g_str_has_prefix(canonical, service->root_dir) ? g_strdup(canonical) : NULL;
+	free(canonical);
+	return result;
+}
+
+
+ThumbService * thumb_service_new(const gchar * root_dir, const gchar * cache_dir, gint workers) {
+	ThumbService * service = g_slice_new0(ThumbService);
+	service->cache_dir = g_build_filename(cache_dir, "thumbnails", NULL);
+	service->jobs      = g_hash_table_new(g_str_hash, g_str_equal);
+	service->failed    = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	service->task_pool = worker_task_pool_new(THUMB_NICE);
+	service->pool      = worker_pool_new_full("thumbnails", workers, THUMB_NICE);
+	service->resolver  = worker_pool_new("thumbnail-lookups", THUMB_RESOLVERS);
+	worker_pool_set_sort(service->pool, (GCompareDataFunc)thumb_job_compare, service);
+
+	char * canonical = realpath(root_dir, NULL);
+	if(canonical == NULL)
+		canonical = strdup(root_dir);
+	service->root_dir = g_str_has_suffix(canonical, "/") ? g_strdup(canonical) : g_strconcat(canonical, "/", NULL);
+	free(canonical);
+
+	return service;
+}
+
+
+/* Drops queued previews and waits for those being generated */
+void thumb_service_free(ThumbService * service) {
+	g_atomic_int_set(&service->shutdown, 1);
+	worker_pool_free(service->resolver);
+	worker_pool_free(service->pool);
+	gst_object_unref(service->task_pool);
+	g_hash_table_destroy(service->jobs);
+	g_hash_table_destroy(service->failed);
+	g_free(service->root_dir);
+	g_free(service->cache_dir);
+	g_free(service->folder);
+	g_slice_free(ThumbService, service);
+}
+
+
+/* A browsed folder being canonicalized */
+typedef struct _ThumbFolder {
+	ThumbService * service;
+	gchar *        path;
+	guint          sequence;
+	gchar *        folder;   /* result, NULL if outside the media root */
+} ThumbFolder;
+
+
+static void thumb_folder_run(ThumbFolder * job) {
+	gchar * folder = thumb_service_resolve(job->service, job->path);
+	job->folder = folder && !g_str_has_suffix(folder, "/") ? g_strconcat(folder, "/", NULL) : g_strdup(folder);
+	g_free(folder);
+}
+
+
+static void thumb_folder_done(ThumbFolder * job) {
+	ThumbService * service = job->service;
+
+	/* Only the folder asked for last counts, the user has moved on from the others */
+	if(job->sequence == service->folders && !g_atomic_int_get(&service->shutdown)) {
+		g_free(service->folder);
+		service->folder = job->folder;
+		job->folder     = NULL;
+		worker_pool_set_sort(service->pool, (GCompareDataFunc)thumb_job_compare, service);
+	}
+
+	g_free(job->folder);
+	g_free(job->path);
+	g_slice_free(ThumbFolder, job);
+}
+
+
+/* Tells the service which folder the user is looking at, so its previews are generated first.
+ * The folder is canonicalized in a worker, since realpath() may block on a slow mount. */
+void thumb_service_set_folder(ThumbService * service, const gchar * path) {
+	ThumbFolder * job = g_slice_new0(ThumbFolder);
+	job->service  = service;
+	job->path     = g_strdup(path);
+	job->sequence = ++service->folders;
+	worker_pool_push(service->resolver, (WorkerFunc)thumb_folder_run, (WorkerFunc)thumb_folder_done, job);
+}
+
+
+/* A request for a preview being looked up in a worker */
+typedef struct _ThumbRequest {
+	ThumbService * service;
+	SoupServer *   server;
+	SoupMessage *  msg;
+	gchar *        file;           /* as asked for */
+	gint64         time;
+	gchar *        if_none_match;
+	gboolean       finished;       /* the client went away meanwhile */
+
+	gchar *        path;           /* results: canonical, NULL unless a regular file below the media root */
+	gchar *        key;
+	gchar *        cache_file;
+	gboolean       not_modified;
+	GBytes *       jpeg;           /* from the disk cache */
+} ThumbRequest;
+
+
+static void thumb_request_run(ThumbRequest * request) {
+	if(g_atomic_int_get(&request->service->shutdown))
+		return;
+
+	struct stat st;
+	request->path = thumb_service_resolve(request->service, request->file);
+	if(request->path == NULL || stat(request->path, &st) == -1 || !S_ISREG(st.st_mode)) {
+		g_clear_pointer(&request->path, g_free);
+		return;
+	}
+
+	gchar * source = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT, request->path, (gint64)st.st_size, (gint64)st.st_mtime, request->time);
+	request->key   = g_compute_checksum_for_string(G_CHECKSUM_SHA1, source, -1);
+	g_free(source);
+
+	/* The key covers everything the preview depends on, a matching ETag needs no further disk access */
+	const gchar * key = request->key;
+	if(request->if_none_match != NULL && strlen(request->if_none_match) == strlen(key) + 2 && strncmp(request->if_none_match + 1, key, strlen(key)) == 0) {
+		request->not_modified = TRUE;
+		return;
+	}
+
+	gchar   key_dir[3] = { key[0], key[1], '\0' };
+	gchar * cache_path = g_build_filename(request->service->cache_dir, key_dir, key + 2, NULL);
+	request->cache_file = g_strconcat(cache_path, ".jpg", NULL);
+	g_free(cache_path);
+
+	gchar * contents;
+	gsize   length;
+	if(g_file_get_contents(request->cache_file, &contents, &length, NULL))
+		request->jpeg = g_bytes_new_take(contents, length);
+}
+
+
+/* Answers from what the worker found, or leaves the message paused waiting for its preview.
+ * Returns FALSE in the latter case. */
+static gboolean thumb_request_answer(ThumbRequest * request) {
+	ThumbService * service = request->service;
+	SoupMessage *  msg     = request->msg;
+	if(request->path == NULL || g_hash_table_contains(service->failed, request->key)) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return TRUE;
+	}
+	if(request->not_modified) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_MODIFIED);
+		return TRUE;
+	}
+	if(request->jpeg != NULL) {
+		thumb_respond(msg, request->key, request->jpeg);
+		return TRUE;
+	}
+
+	ThumbJob * job = g_hash_table_lookup(service->jobs, request->key);
+	if(job == NULL) {
+		if(worker_pool_pending(service->pool) >= THUMB_QUEUE_MAX) {
+			soup_message_headers_replace(msg->response_headers, "Retry-After", "2");
+			soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+			return TRUE;
+		}
+
+		job = g_slice_new0(ThumbJob);
+		job->service    = service;
+		job->key        = g_strdup(request->key);
+		job->path       = g_strdup(request->path);
+		job->directory  = g_strndup(request->path, strrchr(request->path, '/') - request->path + 1);
+		job->cache_path = g_strdup(request->cache_file);
+		job->time       = request->time;
+		job->sequence   = service->sequence++;
+		g_hash_table_insert(service->jobs, job->key, job);
+		worker_pool_push(service->pool, (WorkerFunc)thumb_job_run, (WorkerFunc)thumb_job_done, job);
+	}
+
+	service->server = request->server;
+	job->waiters = g_list_prepend(job->waiters, g_object_ref(msg));
+	g_signal_connect(msg, "finished", (GCallback)thumb_waiter_finished, job);
+	return FALSE;
+}
+
+
+static void thumb_request_finished(SoupMessage * msg, ThumbRequest * request) {
+	request->finished = TRUE;
+}
+
+
+static void thumb_request_done(ThumbRequest * request) {
+	g_signal_handlers_disconnect_by_data(request->msg, request);
+	if(!request->finished && !g_atomic_int_get(&request->service->shutdown) && thumb_request_answer(request))
+		soup_server_unpause_message(request->server, request->msg);
+
+	if(request->jpeg)
+		g_bytes_unref(request->jpeg);
+	g_object_unref(request->msg);
+	g_free(request->file);
+	g_free(request->if_none_match);
+	g_free(request->path);
+	g_free(request->key);
+	g_free(request->cache_file);
+	g_slice_free(ThumbRequest, request);
+}
+
+
+/* Looks the request up in a worker, since resolving the path and reading the cache may block */
+void thumb_service_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, ThumbService * service) {
+	if(msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	const gchar * file = query ? g_hash_table_lookup(query, "path") : NULL;
+	const gchar * t    = query ? g_hash_table_lookup(query, "t"   ) : NULL;
+	if(file == NULL) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	ThumbRequest * request = g_slice_new0(ThumbRequest);
+	request->service       = service;
+	request->server        = server;
+	request->msg           = g_object_ref(msg);
+	request->file          = g_strdup(file);
+	request->if_none_match = g_strdup(soup_message_headers_get_one(msg->request_headers, "If-None-Match"));
+
+	/* Whole seconds are plenty for previews and keep the number of distinct frames down */
+	request->time = t ? (gint64)g_ascii_strtod(t, NULL) : -1;
+	if(request->time < 0)
+		request->time = -1;
+
+	g_signal_connect(msg, "finished", (GCallback)thumb_request_finished, request);
+	soup_server_pause_message(server, msg);
+	worker_pool_push(service->resolver, (WorkerFunc)thumb_request_run, (WorkerFunc)thumb_request_done, request);
+}
@@ -0,0 +1,19 @@
+#ifndef BANANA_THUMBS_H
+#define BANANA_THUMBS_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+
+/* Serves preview images of the videos below the media root at /thumb?path=...&t=SECONDS.
+ * Previews are small JPEGs of the keyframe nearest to `t' (or of a representative frame if `t'
+ * is missing). They are generated by a bounded queue of niced workers and kept in a content
+ * addressed disk cache, so every frame is only ever decoded once per version of a file. */
+typedef struct _ThumbService ThumbService;
+
+ThumbService * thumb_service_new       (const gchar * root_dir, const gchar * cache_dir, gint workers);
+void           thumb_service_free      (ThumbService * thumbs);
+void           thumb_service_set_folder(ThumbService * thumbs, const gchar * path);
+void           thumb_service_callback  (SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, ThumbService * thumbs);
+
+#endif
@@ -0,0 +1,654 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+
+#include "metadata.h"
+#include "variants.h"
+#include "workers.h"
+
+
+#define VARIANT_NICE        19
+#define VARIANT_MAX_WIDTH   1920
+#define VARIANT_MAX_HEIGHT  1080
+#define VARIANT_MAX_BITRATE (20 * 1000 * 1000) /* bits per second the board reads and decodes comfortably */
+#define VARIANT_MAX_STREAMS 4                  /* beyond this the demuxer spends its time on streams nobody plays */
+#define VARIANT_HEIGHT      720                /* of downscaled variants */
+#define VARIANT_KBITRATE    3000               /* of downscaled video */
+#define VARIANT_PROGRESS_MS 1000               /* interval of progress updates */
+#define VARIANT_EXTENSION   ".mkv"
+#define VARIANT_PINNED      2                  /* variants last handed to playbin: the one playing and the next */
+
+#if !GST_CHECK_VERSION(1, 20, 0)
+#define gst_element_request_pad_simple gst_element_get_request_pad
+#endif
+
+
+/* A variant on disk */
+typedef struct _VariantEntry {
+	gchar * file;
+	gchar * source;   /* file it was made from, NULL until asked for again after a restart */
+	gint64  size;
+	gint64  used;     /* real time it was last played, in seconds */
+} VariantEntry;
+
+
+/* A variant being made or waiting for the worker */
+typedef struct _VariantJob {
+	VariantCache * cache;
+	gchar *        key;
+	gchar *        source;
+	gchar *        file;
+	VariantKind    kind;
+	guint          width;     /* of downscaled video, even as x264 wants it */
+	guint          height;
+	gboolean       has_audio;
+	gint64         duration;
+	gint           progress;  /* percent, -1 while queued, atomic */
+	gint           cancelled; /* the cache is gone, atomic */
+
+	gboolean       ok;        /* result */
+	GError *       error;
+} VariantJob;
+
+
+struct _VariantCache {
+	gchar *            dir;
+	guint64            max_bytes;
+	VariantChangedFunc changed;
+	gpointer           user_data;
+
+	WorkerPool *       pool;
+	GstTaskPool *      task_pool;
+	GHashTable *       jobs;      /* key -> VariantJob */
+	GHashTable *       failed;    /* keys of files no variant could be made of */
+	guint              progress_source;
+	gint               progress_sum;
+	gint               shutdown;
+
+	GMutex             lock;      /* protects entries and total, which loads look up from streaming threads */
+	GHashTable *       entries;   /* key -> VariantEntry */
+	guint64            total;
+	gchar *            pinned[VARIANT_PINNED]; /* keys of the variants last resolved, never evicted */
+
+	guint              hits;      /* problem files played from a variant */
+	guint              misses;    /* problem files played as they are */
+};
+
+
+static const gchar * const kind_names[] = { "none", "remux", "downscale" };
+
+
+/* Codecs the board decodes in real time at any size it can show */
+static gboolean variant_codec_is_light(const gchar * codec) {
+	static const gchar * const light[] = { "video/x-h264", "video/mpeg", "video/x-divx", "video/x-xvid", "video/x-h263", "video/x-vp8", "video/x-msmpeg", "video/x-theora", NULL };
+
+	GstStructure * structure = gst_structure_from_string(codec, NULL);
+	if(structure == NULL)
+		return TRUE;
+	gboolean      is_light = g_strv_contains(light, gst_structure_get_name(structure));
+	const gchar * profile  = gst_structure_get_string(structure, "profile");
+	/* 10 bit and 4:2:2/4:4:4 H.264 has no hardware decoder either */
+	if(profile != NULL && (strstr(profile, "10") != NULL || strstr(profile, "422") != NULL || strstr(profile, "444") != NULL))
+		is_light = FALSE;
+	gst_structure_free(structure);
+	return is_light;
+}
+
+
+/* The capability probe, from what the discoverer already found out */
+VariantKind variant_probe(const MediaInfo * info) {
+	if(info == NULL || !info->playable || info->video_codec == NULL)
+		return VARIANT_NONE;
+
+	if(info->width > VARIANT_MAX_WIDTH || info->height > VARIANT_MAX_HEIGHT || !variant_codec_is_light(info->video_codec))
+		return VARIANT_DOWNSCALE;
+	if(info->duration > 0 && gst_util_uint64_scale(info->size * 8, GST_SECOND, info->duration) > VARIANT_MAX_BITRATE)
+		return VARIANT_DOWNSCALE;
+	if(info->streams > VARIANT_MAX_STREAMS)
+		return VARIANT_REMUX;
+	return VARIANT_NONE;
+}
+
+
+/* Variants are named after the path, size and mtime of their file, so a changed file gets a new one */
+static gchar * variant_key(const gchar * path, gint64 size, gint64 mtime) {
+	gchar * source = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT, path, size, mtime);
+	gchar * key    = g_compute_checksum_for_string(G_CHECKSUM_SHA1, source, -1);
+	g_free(source);
+	return key;
+}
+
+
+static gchar * variant_key_of_file(const gchar * path) {
+	GStatBuf st;
+	if(g_stat(path, &st) != 0)
+		return NULL;
+	return variant_key(path, st.st_size, st.st_mtime);
+}
+
+
+static void variant_entry_free(VariantEntry * entry) {
+	g_free(entry->file);
+	g_free(entry->source);
+	g_slice_free(VariantEntry, entry);
+}
+
+
+static void variant_job_free(VariantJob * job) {
+	g_free(job->key);
+	g_free(job->source);
+	g_free(job->file);
+	g_clear_error(&job->error);
+	g_slice_free(VariantJob, job);
+}
+
+
+static gboolean variant_cache_is_pinned(VariantCache * cache, const gchar * key) {
+	for(guint i = 0; i < VARIANT_PINNED; i++)
+		if(g_strcmp0(cache->pinned[i], key) == 0)
+			return TRUE;
+	return FALSE;
+}
+
+
+/* Drops the least recently played variants until the cache fits. Must be called with the lock held. */
+static void variant_cache_evict(VariantCache * cache) {
+	while(cache->total > cache->max_bytes) {
+		GHashTableIter iter;
+		gpointer       key, value;
+		gpointer       oldest_key = NULL;
+		VariantEntry * oldest     = NULL;
+		g_hash_table_iter_init(&iter, cache->entries);
+		while(g_hash_table_iter_next(&iter, &key, &value)) {
+			VariantEntry * entry = value;
+			if(variant_cache_is_pinned(cache, key))
+				continue;
+			if(oldest == NULL || entry->used < oldest->used) {
+				oldest     = entry;
+				oldest_key = key;
+			}
+		}
+		if(oldest == NULL)
+			break;
+
+		g_print("[VARIANT] evicting %s\n", oldest->source ? oldest->source : oldest->file);
+		if(g_unlink(oldest->file) != 0 && errno != ENOENT)
+			g_printerr("[ERR] cannot remove %s: %s\n", oldest->file, g_strerror(errno));
+		cache->total -= oldest->size;
+		g_hash_table_remove(cache->entries, oldest_key);
+	}
+}
+
+
+/* Variants left by earlier runs, with the time they were last played as their mtime. Leftovers
+ * of variants that were never finished are removed. */
+static void variant_cache_load(VariantCache * cache) {
+	GDir * dir = g_dir_open(cache->dir, 0, NULL);
+	if(dir == NULL)
+		return;
+
+	const gchar * name;
+	while((name = g_dir_read_name(dir)) != NULL) {
+		gchar *  file = g_build_filename(cache->dir, name, NULL);
+		GStatBuf st;
+		if(!g_str_has_suffix(name, VARIANT_EXTENSION) || g_stat(file, &st) != 0) {
+			g_unlink(file);
+			g_free(file);
+			continue;
+		}
+
+		VariantEntry * entry = g_slice_new0(VariantEntry);
+		entry->file = file;
+		entry->size = st.st_size;
+		entry->used = st.st_mtime;
+		g_hash_table_replace(cache->entries, g_strndup(name, strlen(name) - strlen(VARIANT_EXTENSION)), entry);
+		cache->total += entry->size;
+	}
+	g_dir_close(dir);
+
+	g_print("[VARIANT] %u variants, %" G_GUINT64_FORMAT " MB\n", g_hash_table_size(cache->entries), cache->total >> 20);
+	variant_cache_evict(cache);
+}
+
+
+/* Making a variant, in a worker thread */
+
+typedef struct _VariantLinks {
+	GMutex       lock;
+	GstElement * pipeline;
+	GstElement * video;     /* branches to the muxer, NULL once linked */
+	GstElement * audio;
+	gint64       position;  /* of the last video buffer, -1 if none yet */
+} VariantLinks;
+
+
+static GstPadProbeReturn variant_position_probe(GstPad * pad, GstPadProbeInfo * info, VariantLinks * links) {
+	GstBuffer * buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(GST_BUFFER_PTS_IS_VALID(buffer)) {
+		g_mutex_lock(&links->lock);
+		links->position = GST_BUFFER_PTS(buffer);
+		g_mutex_unlock(&links->lock);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+
+/* The first video and audio stream go to their branch, anything else nowhere */
+static void variant_pad_added_cb(GstElement * demux, GstPad * pad, VariantLinks * links) {
+	GstCaps *     caps  = gst_pad_get_current_caps(pad);
+	const gchar * name  = caps ? gst_structure_get_name(gst_caps_get_structure(caps, 0)) : "";
+	gboolean      video = g_str_has_prefix(name, "video/");
+	gboolean      audio = g_str_has_prefix(name, "audio/");
+
+	g_mutex_lock(&links->lock);
+	GstElement * branch = video ? links->video : audio ? links->audio : NULL;
+	if(video)
+		links->video = NULL;
+	else if(audio)
+		links->audio = NULL;
+	g_mutex_unlock(&links->lock);
+	if(caps != NULL)
+		gst_caps_unref(caps);
+
+	if(branch == NULL) {
+		branch = gst_element_factory_make("fakesink", NULL);
+		g_object_set(branch, "sync", FALSE, "async", FALSE, NULL);
+		gst_bin_add(GST_BIN(links->pipeline), branch);
+		gst_element_sync_state_with_parent(branch);
+	}
+	else if(video)
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)variant_position_probe, links, NULL);
+
+	GstPad * sink = gst_element_get_static_pad(branch, "sink");
+	gst_pad_link(pad, sink);
+	gst_object_unref(sink);
+}
+
+
+/* A stream the metadata promised but the demuxer did not expose must not hold up the muxer */
+static void variant_no_more_pads_cb(GstElement * demux, VariantLinks * links) {
+	g_mutex_lock(&links->lock);
+	GstElement * branches[] = { links->video, links->audio };
+	links->video = NULL;
+	links->audio = NULL;
+	g_mutex_unlock(&links->lock);
+
+	for(guint i = 0; i < G_N_ELEMENTS(branches); i++) {
+		if(branches[i] == NULL)
+			continue;
+		GstPad * sink = gst_element_get_static_pad(branches[i], "sink");
+		gst_pad_send_event(sink, gst_event_new_eos());
+		gst_object_unref(sink);
+	}
+}
+
+
+static GstElement * variant_branch(GstElement * pipeline, GstElement * mux, const gchar * description, const gchar * pad_template, GError ** error) {
+	GstElement * branch = gst_parse_bin_from_description(description, TRUE, error);
+	if(branch == NULL)
+		return NULL;
+	gst_bin_add(GST_BIN(pipeline), branch);
+
+	GstPad * src     = gst_element_get_static_pad(branch, "src");
+	GstPad * mux_pad = gst_element_request_pad_simple(mux, pad_template);
+	if(mux_pad == NULL || gst_pad_link(src, mux_pad) != GST_PAD_LINK_OK)
+		g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_NEGOTIATION, "cannot link %s to the muxer", description);
+	gst_object_unref(src);
+	if(mux_pad != NULL)
+		gst_object_unref(mux_pad);
+	return *error == NULL ? branch : NULL;
+}
+
+
+static GstBusSyncReply variant_bus_sync(GstBus * bus, GstMessage * msg, GstTaskPool * task_pool) {
+	worker_task_pool_adopt(task_pool, msg);
+	return GST_BUS_PASS;
+}
+
+
+/* Remuxes or transcodes the first video and audio stream of the source into a Matroska file */
+static gboolean variant_make(VariantJob * job, const gchar * output, GError ** error) {
+	gboolean     remux    = job->kind == VARIANT_REMUX;
+	GstElement * pipeline = gst_pipeline_new("variant");
+	GstElement * source   = gst_element_factory_make("filesrc", NULL);
+	GstElement * demux    = gst_element_factory_make(remux ? "parsebin" : "decodebin", NULL);
+	GstElement * mux      = gst_element_factory_make("matroskamux", NULL);
+	GstElement * sink     = gst_element_factory_make("filesink", NULL);
+	if(source == NULL || demux == NULL || mux == NULL || sink == NULL) {
+		g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_MISSING_PLUGIN, "filesrc, %s, matroskamux or filesink is not available", remux ? "parsebin" : "decodebin");
+		if(source) gst_object_unref(source);
+		if(demux)  gst_object_unref(demux);
+		if(mux)    gst_object_unref(mux);
+		if(sink)   gst_object_unref(sink);
+		gst_object_unref(pipeline);
+		return FALSE;
+	}
+	g_object_set(source, "location", job->source, NULL);
+	g_object_set(sink, "location", output, "sync", FALSE, NULL);
+	gst_bin_add_many(GST_BIN(pipeline), source, demux, mux, sink, NULL);
+	gst_element_link(source, demux);
+	gst_element_link(mux, sink);
+
+	/* Downscaled video is encoded to decode cheaply rather than to be small */
+	VariantLinks links = { 0 };
+	g_mutex_init(&links.lock);
+	links.pipeline = pipeline;
+	links.position = -1;
+	if(remux)
+		links.video = variant_branch(pipeline, mux, "queue", "video_%u", error);
+	else {
+		gchar * description = g_strdup_printf("queue ! videoconvert ! videoscale ! video/x-raw,width=%u,height=%u,pixel-aspect-ratio=1/1 ! "
+		                                      "x264enc speed-preset=veryfast tune=fastdecode bitrate=%d ! h264parse ! queue", job->width, job->height, VARIANT_KBITRATE);
+		links.video = variant_branch(pipeline, mux, description, "video_%u", error);
+		g_free(description);
+	}
+	if(links.video != NULL && job->has_audio)
+		links.audio = variant_branch(pipeline, mux, remux ? "queue" : "queue ! audioconvert ! audioresample ! vorbisenc ! queue", "audio_%u", error);
+
+	GstBus * bus = gst_element_get_bus(pipeline);
+	gst_bus_set_sync_handler(bus, (GstBusSyncHandler)variant_bus_sync, gst_object_ref(job->cache->task_pool), gst_object_unref);
+
+	gboolean ok = FALSE;
+	if(*error == NULL) {
+		g_signal_connect(demux, "pad-added"   , (GCallback)variant_pad_added_cb   , &links);
+		g_signal_connect(demux, "no-more-pads", (GCallback)variant_no_more_pads_cb, &links);
+		if(gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+			g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_STATE_CHANGE, "cannot start");
+	}
+
+	while(*error == NULL && !ok) {
+		GstMessage * msg = gst_bus_timed_pop_filtered(bus, VARIANT_PROGRESS_MS * GST_MSECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+		if(msg == NULL) {
+			if(g_atomic_int_get(&job->cache->shutdown))
+				g_set_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "cancelled");
+
+			g_mutex_lock(&links.lock);
+			gint64 position = links.position;
+			g_mutex_unlock(&links.lock);
+			if(position >= 0 && job->duration > 0)
+				g_atomic_int_set(&job->progress, CLAMP(position * 100 / job->duration, 0, 99));
+			continue;
+		}
+
+		if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS)
+			ok = TRUE;
+		else
+			gst_message_parse_error(msg, error, NULL);
+		gst_message_unref(msg);
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(bus);
+	gst_object_unref(pipeline);
+	g_mutex_clear(&links.lock);
+	return ok;
+}
+
+
+static void variant_job_run(VariantJob * job) {
+	if(g_atomic_int_get(&job->cache->shutdown))
+		return;
+
+	g_atomic_int_set(&job->progress, 0);
+	gchar * part = g_strconcat(job->file, ".part", NULL);
+	job->ok = variant_make(job, part, &job->error);
+	if(job->ok && g_rename(part, job->file) != 0) {
+		g_set_error(&job->error, G_FILE_ERROR, g_file_error_from_errno(errno), "%s", g_strerror(errno));
+		job->ok = FALSE;
+	}
+	if(!job->ok)
+		g_unlink(part);
+	g_free(part);
+}
+
+
+/* May run after the cache is freed, see variant_cache_free() */
+static void variant_job_done(VariantJob * job) {
+	if(g_atomic_int_get(&job->cancelled)) {
+		variant_job_free(job);
+		return;
+	}
+
+	VariantCache * cache = job->cache;
+	GStatBuf       st;
+	gboolean       made  = job->ok && g_stat(job->file, &st) == 0;
+	if(made && (guint64)st.st_size > cache->max_bytes) {
+		/* It would only push everything else out and then itself */
+		g_print("[VARIANT] variant of %s is %" G_GINT64_FORMAT " MB, more than the cache holds\n", job->source, (gint64)st.st_size >> 20);
+		g_unlink(job->file);
+		g_hash_table_add(cache->failed, g_strdup(job->key));
+	}
+	else if(made) {
+		g_print("[VARIANT] %s ready, %" G_GINT64_FORMAT " MB\n", job->source, (gint64)st.st_size >> 20);
+		VariantEntry * entry = g_slice_new0(VariantEntry);
+		entry->file   = g_strdup(job->file);
+		entry->source = g_strdup(job->source);
+		entry->size   = st.st_size;
+		entry->used   = g_get_real_time() / G_USEC_PER_SEC;
+
+		g_mutex_lock(&cache->lock);
+		g_hash_table_replace(cache->entries, g_strdup(job->key), entry);
+		cache->total += entry->size;
+		variant_cache_evict(cache);
+		g_mutex_unlock(&cache->lock);
+	}
+	else if(!g_atomic_int_get(&cache->shutdown)) {
+		g_print("[VARIANT] cannot make a variant of %s: %s\n", job->source, job->error ? job->error->message : "unknown error");
+		g_hash_table_add(cache->failed, g_strdup(job->key));
+	}
+
+	g_hash_table_remove(cache->jobs, job->key);
+	variant_job_free(job);
+	cache->changed(cache->user_data);
+}
+
+
+/* Tells about progress while a job runs, and stops once the queue is empty */
+static gboolean variant_progress_cb(VariantCache * cache) {
+	if(g_hash_table_size(cache->jobs) == 0) {
+		cache->progress_source = 0;
+		cache->progress_sum    = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	gint           sum = 0;
+	GHashTableIter iter;
+	gpointer       value;
+	g_hash_table_iter_init(&iter, cache->jobs);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+		sum += g_atomic_int_get(&((VariantJob *)value)->progress);
+	if(sum != cache->progress_sum) {
+		cache->progress_sum = sum;
+		cache->changed(cache->user_data);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+
+VariantCache * variant_cache_new(const gchar * cache_dir, guint64 max_bytes, VariantChangedFunc changed, gpointer user_data) {
+	VariantCache * cache = g_slice_new0(VariantCache);
+	cache->dir       = g_build_filename(cache_dir, "variants", NULL);
+	cache->max_bytes = max_bytes;
+	cache->changed   = changed;
+	cache->user_data = user_data;
+	cache->pool      = worker_pool_new_full("variants", 1, VARIANT_NICE);
+	cache->task_pool = worker_task_pool_new(VARIANT_NICE);
+	cache->jobs      = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->failed    = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	cache->entries   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)variant_entry_free);
+	g_mutex_init(&cache->lock);
+
+	if(g_mkdir_with_parents(cache->dir, 0755) != 0)
+		g_printerr("[ERR] cannot create %s: %s\n", cache->dir, g_strerror(errno));
+	variant_cache_load(cache);
+	return cache;
+}
+
+
+/* Cancels the variant being made and drops the queued ones. Their done callbacks may still run
+ * once the pool is gone, so the jobs are told to only free themselves then. */
+void variant_cache_free(VariantCache * cache) {
+	GHashTableIter iter;
+	gpointer       value;
+	g_hash_table_iter_init(&iter, cache->jobs);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+		g_atomic_int_set(&((VariantJob *)value)->cancelled, 1);
+
+	g_atomic_int_set(&cache->shutdown, 1);
+	worker_pool_free(cache->pool);
+	gst_object_unref(cache->task_pool);
+	if(cache->progress_source)
+		g_source_remove(cache->progress_source);
+	g_hash_table_destroy(cache->jobs);
+	g_hash_table_destroy(cache->failed);
+	g_hash_table_destroy(cache->entries);
+	g_mutex_clear(&cache->lock);
+	for(guint i = 0; i < VARIANT_PINNED; i++)
+		g_free(cache->pinned[i]);
+	g_free(cache->dir);
+	g_slice_free(VariantCache, cache);
+}
+
+
+/* Queues a variant of `path' if the probe finds it too heavy and none exists yet */
+gboolean variant_cache_want(VariantCache * cache, const gchar * path, const MediaInfo * info) {
+	VariantKind kind = variant_probe(info);
+	if(kind == VARIANT_NONE)
+		return FALSE;
+
+	gchar * key = variant_key(path, info->size, info->mtime);
+	g_mutex_lock(&cache->lock);
+	VariantEntry * entry = g_hash_table_lookup(cache->entries, key);
+	if(entry != NULL && entry->source == NULL)
+		entry->source = g_strdup(path);
+	g_mutex_unlock(&cache->lock);
+	if(entry != NULL || g_hash_table_contains(cache->jobs, key) || g_hash_table_contains(cache->failed, key)) {
+		g_free(key);
+		return TRUE;
+	}
+
+	VariantJob * job = g_slice_new0(VariantJob);
+	job->cache     = cache;
+	job->key       = key;
+	job->source    = g_strdup(path);
+	job->file      = g_strconcat(cache->dir, G_DIR_SEPARATOR_S, key, VARIANT_EXTENSION, NULL);
+	job->kind      = kind;
+	job->height    = MIN(info->height, VARIANT_HEIGHT) & ~1u;
+	job->width     = info->height ? (guint)gst_util_uint64_scale_round(info->width, job->height, info->height) & ~1u : 0;
+	job->has_audio = info->audio_codec != NULL;
+	job->duration  = info->duration;
+	job->progress  = -1;
+	g_hash_table_insert(cache->jobs, job->key, job);
+	worker_pool_push(cache->pool, (WorkerFunc)variant_job_run, (WorkerFunc)variant_job_done, job);
+	g_print("[VARIANT] queued %s of %s\n", kind_names[kind], path);
+
+	if(cache->progress_source == 0)
+		cache->progress_source = g_timeout_add(VARIANT_PROGRESS_MS, (GSourceFunc)variant_progress_cb, cache);
+	cache->changed(cache->user_data);
+	return TRUE;
+}
+
+
+/* Returns the variant of `path' if one is ready, `path' itself otherwise. Playing a variant makes
+ * it the most recently used one, on disk too so the order survives restarts, and pins it: what
+ * playbin plays or prerolls next must stay on disk, and known to variant_cache_original(). */
+gchar * variant_cache_resolve(VariantCache * cache, const gchar * path) {
+	gchar * key = variant_key_of_file(path);
+	if(key == NULL)
+		return g_strdup(path);
+
+	g_mutex_lock(&cache->lock);
+	gchar *        file  = NULL;
+	VariantEntry * entry = g_hash_table_lookup(cache->entries, key);
+	if(entry != NULL) {
+		if(entry->source == NULL)
+			entry->source = g_strdup(path);
+		entry->used = g_get_real_time() / G_USEC_PER_SEC;
+		g_utime(entry->file, NULL);
+		file = g_strdup(entry->file);
+		if(!variant_cache_is_pinned(cache, key)) {
+			g_free(cache->pinned[0]);
+			memmove(cache->pinned, cache->pinned + 1, (VARIANT_PINNED - 1) * sizeof(gchar *));
+			cache->pinned[VARIANT_PINNED - 1] = g_strdup(key);
+		}
+	}
+	g_mutex_unlock(&cache->lock);
+	g_free(key);
+	return file ? file : g_strdup(path);
+}
+
+
+gchar * variant_cache_original(VariantCache * cache, const gchar * path) {
+	gchar * directory = g_path_get_dirname(path);
+	gchar * name      = g_path_get_basename(path);
+	gchar * source    = NULL;
+	if(g_str_equal(directory, cache->dir) && g_str_has_suffix(name, VARIANT_EXTENSION)) {
+		name[strlen(name) - strlen(VARIANT_EXTENSION)] = '\0';
+		g_mutex_lock(&cache->lock);
+		VariantEntry * entry = g_hash_table_lookup(cache->entries, name);
+		if(entry != NULL)
+			source = g_strdup(entry->source);
+		g_mutex_unlock(&cache->lock);
+	}
+	g_free(directory);
+	g_free(name);
+	return source;
+}
+
+
+/* Counts a problem file starting to play, from its variant or not */
+void variant_cache_played(VariantCache * cache, gboolean hit) {
+	if(hit)
+		cache->hits++;
+	else
+		cache->misses++;
+}
+
+
+guint64 variant_cache_size(VariantCache * cache) {
+	g_mutex_lock(&cache->lock);
+	guint64 total = cache->total;
+	g_mutex_unlock(&cache->lock);
+	return total;
+}
+
+
+/* {"hits": N, "misses": N, "bytes": N, "jobs": [{"path", "kind", "progress"}]}, with a progress
+ * of -1 for queued jobs */
+void variant_cache_to_json(VariantCache * cache, JsonBuilder * builder) {
+	json_builder_begin_object(builder);
+		json_builder_set_member_name(builder, "hits");
+		json_builder_add_int_value(builder, cache->hits);
+
+		json_builder_set_member_name(builder, "misses");
+		json_builder_add_int_value(builder, cache->misses);
+
+		json_builder_set_member_name(builder, "bytes");
+		json_builder_add_int_value(builder, variant_cache_size(cache));
+
+		json_builder_set_member_name(builder, "jobs");
+		json_builder_begin_array(builder);
+		GHashTableIter iter;
+		gpointer       value;
+		g_hash_table_iter_init(&iter, cache->jobs);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			VariantJob * job = value;
+			json_builder_begin_object(builder);
+				json_builder_set_member_name(builder, "path");
+				json_builder_add_string_value(builder, job->source);
+
+				json_builder_set_member_name(builder, "kind");
+				json_builder_add_string_value(builder, kind_names[job->kind]);
+
+				json_builder_set_member_name(builder, "progress");
+				json_builder_add_int_value(builder, g_atomic_int_get(&job->progress));
+			json_builder_end_object(builder);
+		}
+		json_builder_end_array(builder);
+	json_builder_end_object(builder);
+}
@@ -0,0 +1,38 @@
+#ifndef BANANA_VARIANTS_H
+#define BANANA_VARIANTS_H
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "metadata.h"
+
+
+/* Lighter copies of files the board cannot play smoothly. A quick probe of the metadata spots
+ * them: video too large, too dense or in a codec without a cheap decoder gets downscaled to H.264,
+ * files with many streams get their first video and audio stream remuxed. Variants are made one at
+ * a time by a niced background worker, kept on disk next to the other caches and evicted least
+ * recently played first once they exceed `max_bytes', except for the two last handed to playbin.
+ * Loads play a variant instead of its file whenever one is ready. */
+typedef enum {
+	VARIANT_NONE,      /* the file plays fine as it is */
+	VARIANT_REMUX,
+	VARIANT_DOWNSCALE
+} VariantKind;
+
+typedef struct _VariantCache VariantCache;
+
+typedef void (*VariantChangedFunc)(gpointer user_data);
+
+VariantKind    variant_probe(const MediaInfo * info);
+
+/* Must only be used from the main context, except for the functions marked thread-safe */
+VariantCache * variant_cache_new     (const gchar * cache_dir, guint64 max_bytes, VariantChangedFunc changed, gpointer user_data);
+void           variant_cache_free    (VariantCache * cache);
+gboolean       variant_cache_want    (VariantCache * cache, const gchar * path, const MediaInfo * info); /* TRUE for problem files */
+gchar *        variant_cache_resolve (VariantCache * cache, const gchar * path); /* thread-safe, the file to play instead of `path' */
+gchar *        variant_cache_original(VariantCache * cache, const gchar * path); /* thread-safe, NULL if `path' is no variant */
+void           variant_cache_played  (VariantCache * cache, gboolean hit);
+guint64        variant_cache_size    (VariantCache * cache); /* bytes of the variants on disk */
+void           variant_cache_to_json (VariantCache * cache, JsonBuilder * builder);
+
+#endif
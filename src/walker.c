@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "walker.h"
+
+
+#define WALKER_BATCH_SIZE 512
+
+
+struct _Walker {
+	gint            ref_count;
+	gint            cancelled;
+	gchar *         root;
+	GMainContext *  context;
+	WalkerBatchFunc batch;
+	WalkerDoneFunc  done;
+	gpointer        user_data;
+};
+
+
+typedef struct _WalkerBatch {
+	Walker *    walker;
+	GPtrArray * files;
+	gboolean    last;
+} WalkerBatch;
+
+
+static void walker_unref(Walker * walker) {
+	if(!g_atomic_int_dec_and_test(&walker->ref_count))
+		return;
+
+	g_main_context_unref(walker->context);
+	g_free(walker->root);
+	g_slice_free(Walker, walker);
+}
+
+
+static void walker_file_free(WalkerFile * file) {
+	g_free(file->path);
+	g_slice_free(WalkerFile, file);
+}
+
+
+static gboolean walker_batch_dispatch(WalkerBatch * batch) {
+	Walker * walker = batch->walker;
+	if(!g_atomic_int_get(&walker->cancelled)) {
+		if(batch->files->len > 0)
+			walker->batch(batch->files, walker->user_data);
+		if(batch->last && walker->done)
+			walker->done(walker->user_data);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+
+static void walker_batch_free(WalkerBatch * batch) {
+	g_ptr_array_unref(batch->files);
+	walker_unref(batch->walker);
+	g_slice_free(WalkerBatch, batch);
+}
+
+
+static GPtrArray * walker_deliver(Walker * walker, GPtrArray * files, gboolean last) {
+	WalkerBatch * batch = g_slice_new(WalkerBatch);
+	batch->walker = walker;
+	batch->files  = files;
+	batch->last   = last;
+	g_atomic_int_inc(&walker->ref_count);
+	g_main_context_invoke_full(walker->context, G_PRIORITY_LOW, (GSourceFunc)walker_batch_dispatch, batch, (GDestroyNotify)walker_batch_free);
+
+	return last ? NULL : g_ptr_array_new_with_free_func((GDestroyNotify)walker_file_free);
+}
+
+
+static void walker_add(GPtrArray * files, gchar * path, gboolean directory, const struct stat * st) {
+	WalkerFile * file = g_slice_new(WalkerFile);
+	file->path      = path;
+	file->directory = directory;
+	file->size      = st ? st->st_size  : 0;
+	file->mtime     = st ? st->st_mtime : 0;
+	g_ptr_array_add(files, file);
+}
+
+
+/* Identifies a directory however it was reached */
+typedef struct _WalkerDirId {
+	dev_t dev;
+	ino_t ino;
+} WalkerDirId;
+
+
+static guint walker_dir_id_hash(const WalkerDirId * id) {
+	return (guint)id->ino ^ (guint)(id->ino >> 32) ^ (guint)id->dev;
+}
+
+
+static gboolean walker_dir_id_equal(const WalkerDirId * a, const WalkerDirId * b) {
+	return a->dev == b->dev && a->ino == b->ino;
+}
+
+
+static void walker_dir_id_free(WalkerDirId * id) {
+	g_slice_free(WalkerDirId, id);
+}
+
+
+/* Returns FALSE if the directory open as `dir' was walked already, e.g. through a symlink */
+static gboolean walker_visit(GHashTable * visited, DIR * dir) {
+	struct stat st;
+	if(fstat(dirfd(dir), &st) != 0)
+		return FALSE;
+
+	WalkerDirId id = { st.st_dev, st.st_ino };
+	if(g_hash_table_contains(visited, &id))
+		return FALSE;
+	g_hash_table_add(visited, g_slice_dup(WalkerDirId, &id));
+	return TRUE;
+}
+
+
+static gpointer walker_thread(Walker * walker) {
+	GPtrArray *  files   = g_ptr_array_new_with_free_func((GDestroyNotify)walker_file_free);
+	GQueue       pending = G_QUEUE_INIT;
+	GHashTable * visited = g_hash_table_new_full((GHashFunc)walker_dir_id_hash, (GEqualFunc)walker_dir_id_equal, (GDestroyNotify)walker_dir_id_free, NULL);
+	g_queue_push_tail(&pending, g_strdup(walker->root));
+
+	gchar * path;
+	while((path = g_queue_pop_head(&pending)) != NULL) {
+		if(g_atomic_int_get(&walker->cancelled)) {
+			g_free(path);
+			continue;
+		}
+
+		/* Symlinks to a parent would otherwise make the walk go on forever */
+		DIR * dir = opendir(path);
+		if(dir == NULL || !walker_visit(visited, dir)) {
+			if(dir != NULL)
+				closedir(dir);
+			g_free(path);
+			continue;
+		}
+
+		struct dirent * entry;
+		while((entry = readdir(dir)) != NULL) {
+			if(entry->d_name[0] == '.')
+				continue;
+
+			struct stat st;
+			gboolean    have_stat = FALSE;
+			gboolean    directory = entry->d_type == DT_DIR;
+			if(!directory) {
+				if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0)
+					continue;
+				have_stat = TRUE;
+				directory = S_ISDIR(st.st_mode);
+				if(!directory && !S_ISREG(st.st_mode))
+					continue;
+			}
+
+			if(directory) {
+				gchar * child = g_strconcat(path, entry->d_name, "/", NULL);
+				g_queue_push_tail(&pending, g_strdup(child));
+				walker_add(files, child, TRUE, NULL);
+			}
+			else
+				walker_add(files, g_strconcat(path, entry->d_name, NULL), FALSE, have_stat ? &st : NULL);
+
+			if(files->len >= WALKER_BATCH_SIZE)
+				files = walker_deliver(walker, files, FALSE);
+		}
+
+		closedir(dir);
+		g_free(path);
+	}
+
+	g_hash_table_destroy(visited);
+	walker_deliver(walker, files, TRUE);
+	walker_unref(walker);
+	return NULL;
+}
+
+
+/* Starts walking `root' (which must end with a '/'). `batch' is called for every few hundred
+ * entries found, `done' once the walk is complete. */
+Walker * walker_start(const gchar * root, WalkerBatchFunc batch, WalkerDoneFunc done, gpointer user_data) {
+	Walker * walker = g_slice_new0(Walker);
+	walker->ref_count = 2; /* the caller and the thread */
+	walker->root      = g_strdup(root);
+	walker->context   = g_main_context_ref_thread_default();
+	walker->batch     = batch;
+	walker->done      = done;
+	walker->user_data = user_data;
+
+	g_thread_unref(g_thread_new("walker", (GThreadFunc)walker_thread, walker));
+	return walker;
+}
+
+
+/* Stops the walk. No callbacks are made after this returns. */
+void walker_cancel(Walker * walker) {
+	g_atomic_int_set(&walker->cancelled, 1);
+	walker_unref(walker);
+}
@@ -0,0 +1,24 @@
+#ifndef BANANA_WALKER_H
+#define BANANA_WALKER_H
+
+#include <glib.h>
+
+
+/* Walks a directory tree in a background thread and reports what it finds in batches, in the
+ * main context that started the walk */
+typedef struct _WalkerFile {
+	gchar *  path;      /* directories end with a '/' */
+	gboolean directory;
+	gint64   size;
+	gint64   mtime;
+} WalkerFile;
+
+typedef struct _Walker Walker;
+
+typedef void (*WalkerBatchFunc)(GPtrArray * files, gpointer user_data); /* WalkerFile *, borrowed */
+typedef void (*WalkerDoneFunc) (gpointer user_data);
+
+Walker * walker_start (const gchar * root, WalkerBatchFunc batch, WalkerDoneFunc done, gpointer user_data);
+void     walker_cancel(Walker * walker);
+
+#endif
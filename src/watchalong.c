@@ -0,0 +1,849 @@
+#include <string.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <libsoup/soup.h>
+
+#include "watchalong.h"
+#include "workers.h"
+
+
+#define WATCH_AHEAD        2                    /* segments remuxed ahead of playback */
+#define WATCH_SINK_BUFFERS 32                   /* muxer output waiting to be cut into segments */
+#define WATCH_NICE         10
+#define WATCH_IDLE_SECONDS 30                   /* the pipeline stops this long after the last request */
+#define WATCH_JUMP         (5 * GST_SECOND)     /* position changes beyond this, times the rate, are seeks */
+#define WATCH_MAX_AGE      60                   /* seconds viewers may reuse a segment */
+
+#define BOX(a, b, c, d) ((guint32)(a) << 24 | (guint32)(b) << 16 | (guint32)(c) << 8 | (guint32)(d))
+
+#if !GST_CHECK_VERSION(1, 20, 0)
+#define gst_element_request_pad_simple gst_element_get_request_pad
+#endif
+
+
+/* The header of a run, ftyp and moov, which players load before its first segment */
+typedef struct _WatchInit {
+	gint     ref_count;
+	guint    id;
+	GBytes * data;
+} WatchInit;
+
+
+typedef struct _WatchSegment {
+	guint64     sequence;
+	gint64      start;         /* from the start of the run, in nanoseconds */
+	gint64      duration;
+	gboolean    discontinuity; /* first of a run */
+	WatchInit * init;
+	GBytes *    data;          /* moof and mdat boxes */
+} WatchSegment;
+
+
+typedef struct _WatchTrack {
+	guint32  id;
+	guint32  timescale;
+	gboolean video;
+} WatchTrack;
+
+
+struct _WatchAlong {
+	guint         max_segments;
+	gint64        segment_duration;
+	GstTaskPool * task_pool;
+
+	/* What playbin plays, as of the last watch_along_follow() */
+	gchar *       uri;
+	gint64        position;
+	gboolean      broken;         /* the uri cannot be remuxed, no use trying again */
+	gint64        last_request;   /* monotonic time a viewer last asked for anything, 0 if never */
+
+	/* The remux pipeline of the current run, NULL while stopped */
+	GstElement *  pipeline;
+	GstElement *  sink;           /* NULL until the streams are linked */
+	guint         bus_watch;
+	gint64        start;          /* position the run was asked to start from */
+	gboolean      eos;
+	GMutex        lock;
+	GList *       pads;           /* of parsebin, blocked until linked, under lock */
+	gint64        origin;         /* stream time of the first buffer of the run, -1 until known, under lock */
+
+	/* Cutting the muxer output into segments */
+	GByteArray *  pending;        /* start of a box that is not complete yet */
+	GByteArray *  header;         /* ftyp, until the moov completes it */
+	GArray *      tracks;         /* WatchTrack */
+	guint32       lead_track;     /* segments start with a fragment of this track */
+	guint32       lead_timescale;
+	WatchInit *   init;
+	GByteArray *  open;           /* segment being put together, NULL if none */
+	gint64        open_start;     /* decode time of its first lead fragment, -1 if none yet */
+	gint64        run_start;      /* decode time of the first segment of the run, -1 if none yet */
+	gboolean      run_new;        /* the next segment is the first of a run */
+	GQueue        ahead;          /* complete segments playback has not reached yet */
+
+	/* What viewers get */
+	GQueue        window;
+	guint64       next_sequence;
+	guint         discontinuity_sequence;
+	guint         next_init_id;
+};
+
+
+static WatchInit * watch_init_ref(WatchInit * init) {
+	init->ref_count++;
+	return init;
+}
+
+
+static void watch_init_unref(WatchInit * init) {
+	if(--init->ref_count > 0)
+		return;
+	g_bytes_unref(init->data);
+	g_slice_free(WatchInit, init);
+}
+
+
+static void watch_segment_free(WatchSegment * segment) {
+	watch_init_unref(segment->init);
+	g_bytes_unref(segment->data);
+	g_slice_free(WatchSegment, segment);
+}
+
+
+static void watch_segments_clear(GQueue * segments) {
+	WatchSegment * segment;
+	while((segment = g_queue_pop_head(segments)) != NULL)
+		watch_segment_free(segment);
+}
+
+
+/* MP4 boxes, only as far as needed to find the tracks and the decode time of each fragment */
+
+static guint64 read_be(const guint8 * data, guint size) {
+	guint64 value = 0;
+	for(guint i = 0; i < size; i++)
+		value = value << 8 | data[i];
+	return value;
+}
+
+
+typedef struct _BoxIter {
+	const guint8 * data;
+	gsize          size;
+	gsize          offset;
+} BoxIter;
+
+
+static gboolean box_next(BoxIter * iter, guint32 * type, const guint8 ** payload, gsize * payload_size) {
+	const guint8 * box  = iter->data + iter->offset;
+	gsize          left = iter->size - iter->offset;
+	if(left < 8)
+		return FALSE;
+
+	guint64 size   = read_be(box, 4);
+	gsize   header = 8;
+	if(size == 1) {
+		if(left < 16)
+			return FALSE;
+		size   = read_be(box + 8, 8);
+		header = 16;
+	}
+	else if(size == 0)
+		size = left;
+	if(size < header || size > left)
+		return FALSE;
+
+	*type         = read_be(box + 4, 4);
+	*payload      = box + header;
+	*payload_size = size - header;
+	iter->offset += size;
+	return TRUE;
+}
+
+
+static gboolean box_find(const guint8 * data, gsize size, guint32 type, const guint8 ** payload, gsize * payload_size) {
+	BoxIter iter = { data, size, 0 };
+	guint32 found;
+	while(box_next(&iter, &found, payload, payload_size))
+		if(found == type)
+			return TRUE;
+	return FALSE;
+}
+
+
+/* A 32 bit field of a full box that follows the creation and modification times, which are 32
+ * or 64 bit wide depending on the version */
+static guint32 box_after_times(const guint8 * box, gsize size) {
+	gsize offset = size > 0 && box[0] == 1 ? 20 : 12;
+	return size >= offset + 4 ? read_be(box + offset, 4) : 0;
+}
+
+
+static void watch_parse_moov(WatchAlong * watch, const guint8 * moov, gsize size) {
+	g_array_set_size(watch->tracks, 0);
+
+	BoxIter        iter = { moov, size, 0 };
+	guint32        type;
+	const guint8 * trak;
+	gsize          trak_size;
+	while(box_next(&iter, &type, &trak, &trak_size)) {
+		if(type != BOX('t', 'r', 'a', 'k'))
+			continue;
+
+		WatchTrack     track = { 0 };
+		const guint8 * box, * mdia;
+		gsize          box_size, mdia_size;
+		if(box_find(trak, trak_size, BOX('t', 'k', 'h', 'd'), &box, &box_size))
+			track.id = box_after_times(box, box_size);
+		if(box_find(trak, trak_size, BOX('m', 'd', 'i', 'a'), &mdia, &mdia_size)) {
+			if(box_find(mdia, mdia_size, BOX('m', 'd', 'h', 'd'), &box, &box_size))
+				track.timescale = box_after_times(box, box_size);
+			if(box_find(mdia, mdia_size, BOX('h', 'd', 'l', 'r'), &box, &box_size) && box_size >= 12)
+				track.video = read_be(box + 8, 4) == BOX('v', 'i', 'd', 'e');
+		}
+		if(track.id != 0 && track.timescale != 0)
+			g_array_append_val(watch->tracks, track);
+	}
+
+	/* Segments follow the fragments of the video, or of the audio when there is none */
+	watch->lead_track = 0;
+	for(guint i = 0; i < watch->tracks->len; i++) {
+		WatchTrack * track = &g_array_index(watch->tracks, WatchTrack, i);
+		if(watch->lead_track == 0 || track->video) {
+			watch->lead_track     = track->id;
+			watch->lead_timescale = track->timescale;
+		}
+		if(track->video)
+			break;
+	}
+}
+
+
+/* Decode time of the lead track's fragment in a moof, in nanoseconds, -1 if it has none */
+static gint64 watch_moof_time(WatchAlong * watch, const guint8 * moof, gsize size) {
+	BoxIter        iter = { moof, size, 0 };
+	guint32        type;
+	const guint8 * traf, * box;
+	gsize          traf_size, box_size;
+	while(box_next(&iter, &type, &traf, &traf_size)) {
+		if(type != BOX('t', 'r', 'a', 'f'))
+			continue;
+		if(!box_find(traf, traf_size, BOX('t', 'f', 'h', 'd'), &box, &box_size) || box_size < 8 || read_be(box + 4, 4) != watch->lead_track)
+			continue;
+		if(!box_find(traf, traf_size, BOX('t', 'f', 'd', 't'), &box, &box_size))
+			return -1;
+
+		guint size = box_size > 0 && box[0] == 1 ? 8 : 4;
+		if(box_size < 4 + size)
+			return -1;
+		return gst_util_uint64_scale(read_be(box + 4, size), GST_SECOND, watch->lead_timescale);
+	}
+	return -1;
+}
+
+
+static void watch_close_segment(WatchAlong * watch, gint64 end) {
+	if(watch->open == NULL)
+		return;
+	if(watch->open_start < 0 || watch->init == NULL) {
+		g_byte_array_free(watch->open, TRUE);
+		watch->open = NULL;
+		return;
+	}
+
+	if(watch->run_start < 0)
+		watch->run_start = watch->open_start;
+	WatchSegment * segment = g_slice_new0(WatchSegment);
+	segment->start         = watch->open_start - watch->run_start;
+	segment->duration      = MAX(end - watch->open_start, 0);
+	segment->discontinuity = watch->run_new;
+	segment->init          = watch_init_ref(watch->init);
+	segment->data          = g_byte_array_free_to_bytes(watch->open);
+	g_queue_push_tail(&watch->ahead, segment);
+
+	watch->open       = NULL;
+	watch->open_start = -1;
+	watch->run_new    = FALSE;
+}
+
+
+static void watch_handle_box(WatchAlong * watch, guint32 type, const guint8 * box, gsize size, gsize header) {
+	switch(type) {
+		case BOX('f', 't', 'y', 'p'):
+			if(watch->header != NULL)
+				g_byte_array_free(watch->header, TRUE);
+			watch->header = g_byte_array_new();
+			g_byte_array_append(watch->header, box, size);
+			break;
+
+		case BOX('m', 'o', 'o', 'v'): {
+			if(watch->header == NULL)
+				watch->header = g_byte_array_new();
+			g_byte_array_append(watch->header, box, size);
+			watch_parse_moov(watch, box + header, size - header);
+
+			WatchInit * init = g_slice_new(WatchInit);
+			init->ref_count = 1;
+			init->id        = watch->next_init_id++;
+			init->data      = g_byte_array_free_to_bytes(watch->header);
+			watch->header   = NULL;
+			if(watch->init != NULL)
+				watch_init_unref(watch->init);
+			watch->init = init;
+			break;
+		}
+
+		case BOX('m', 'o', 'o', 'f'): {
+			/* A fragment of the lead track starts a new segment, unless the current one is still
+			 * much shorter than asked for */
+			gint64 time = watch_moof_time(watch, box + header, size - header);
+			if(time >= 0 && watch->open != NULL && watch->open_start >= 0 && time - watch->open_start >= watch->segment_duration / 2)
+				watch_close_segment(watch, time);
+			if(watch->open == NULL)
+				watch->open = g_byte_array_new();
+			if(time >= 0 && watch->open_start < 0)
+				watch->open_start = time;
+			g_byte_array_append(watch->open, box, size);
+			break;
+		}
+
+		case BOX('m', 'f', 'r', 'a'):
+			break;
+
+		default:
+			if(watch->open != NULL)
+				g_byte_array_append(watch->open, box, size);
+			break;
+	}
+}
+
+
+static void watch_feed(WatchAlong * watch, GstBuffer * buffer) {
+	GstMapInfo map;
+	if(!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return;
+	g_byte_array_append(watch->pending, map.data, map.size);
+	gst_buffer_unmap(buffer, &map);
+
+	gsize offset = 0;
+	while(watch->pending->len - offset >= 8) {
+		const guint8 * box  = watch->pending->data + offset;
+		gsize          left = watch->pending->len - offset;
+		guint64        size = read_be(box, 4);
+		gsize          header = 8;
+		if(size == 1) {
+			if(left < 16)
+				break;
+			size   = read_be(box + 8, 8);
+			header = 16;
+		}
+		/* Boxes of size 0 run to the end of the file, which a stream never has */
+		if(size < header) {
+			g_printerr("[LIVE] cannot parse the muxer output\n");
+			offset = watch->pending->len;
+			break;
+		}
+		if(size > left)
+			break;
+		watch_handle_box(watch, read_be(box + 4, 4), box, size, header);
+		offset += size;
+	}
+	g_byte_array_remove_range(watch->pending, 0, offset);
+}
+
+
+/* The remux pipeline */
+
+static void watch_reset_run(WatchAlong * watch) {
+	g_byte_array_set_size(watch->pending, 0);
+	g_array_set_size(watch->tracks, 0);
+	if(watch->header != NULL)
+		g_byte_array_free(watch->header, TRUE);
+	if(watch->open != NULL)
+		g_byte_array_free(watch->open, TRUE);
+	if(watch->init != NULL)
+		watch_init_unref(watch->init);
+	watch->header     = NULL;
+	watch->open       = NULL;
+	watch->init       = NULL;
+	watch->lead_track = 0;
+	watch->open_start = -1;
+	watch->run_start  = -1;
+	watch->eos        = FALSE;
+	watch_segments_clear(&watch->ahead);
+}
+
+
+static void watch_stop(WatchAlong * watch) {
+	if(watch->pipeline == NULL)
+		return;
+
+	if(watch->bus_watch != 0)
+		g_source_remove(watch->bus_watch);
+	watch->bus_watch = 0;
+	gst_element_set_state(watch->pipeline, GST_STATE_NULL);
+	gst_object_unref(watch->pipeline);
+	watch->pipeline = NULL;
+	watch->sink     = NULL;
+
+	g_mutex_lock(&watch->lock);
+	g_list_free_full(watch->pads, gst_object_unref);
+	watch->pads = NULL;
+	g_mutex_unlock(&watch->lock);
+	watch_reset_run(watch);
+}
+
+
+/* Holds the streams parsebin finds until the pipeline has been put together around them */
+static GstPadProbeReturn watch_block_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data) {
+	return GST_PAD_PROBE_OK;
+}
+
+
+static void watch_pad_added_cb(GstElement * parse, GstPad * pad, WatchAlong * watch) {
+	gulong probe = gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER, watch_block_probe, NULL, NULL);
+	g_object_set_data(G_OBJECT(pad), "watch-along-probe", GSIZE_TO_POINTER(probe));
+
+	g_mutex_lock(&watch->lock);
+	watch->pads = g_list_append(watch->pads, gst_object_ref(pad));
+	g_mutex_unlock(&watch->lock);
+}
+
+
+static void watch_no_more_pads_cb(GstElement * parse, WatchAlong * watch) {
+	GstStructure * structure = gst_structure_new_empty("watch-along-pads");
+	gst_element_post_message(parse, gst_message_new_application(GST_OBJECT(parse), structure));
+}
+
+
+/* Notes the stream time the run actually starts at, which is the keyframe before the position
+ * it was asked to start from */
+static GstPadProbeReturn watch_origin_probe(GstPad * pad, GstPadProbeInfo * info, WatchAlong * watch) {
+	GstBuffer *  buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstClockTime time   = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+	if(!GST_CLOCK_TIME_IS_VALID(time))
+		return GST_PAD_PROBE_OK;
+
+	GstEvent * event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+	if(event != NULL) {
+		const GstSegment * segment;
+		gst_event_parse_segment(event, &segment);
+		time = gst_segment_to_stream_time(segment, GST_FORMAT_TIME, time);
+		gst_event_unref(event);
+	}
+
+	g_mutex_lock(&watch->lock);
+	watch->origin = GST_CLOCK_TIME_IS_VALID(time) ? (gint64)time : watch->start;
+	g_mutex_unlock(&watch->lock);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+
+static const gchar * watch_aac_encoder(void) {
+	static const gchar * const encoders[] = { "fdkaacenc", "avenc_aac", "voaacenc" };
+	for(guint i = 0; i < G_N_ELEMENTS(encoders); i++) {
+		GstElementFactory * factory = gst_element_factory_find(encoders[i]);
+		if(factory != NULL) {
+			gst_object_unref(factory);
+			return encoders[i];
+		}
+	}
+	return NULL;
+}
+
+
+/* What a stream goes through on its way to the muxer: a parser that puts it in the form mp4mux
+ * takes, or a transcode to AAC for audio that browsers cannot play. NULL for streams left out. */
+static gchar * watch_branch(GstCaps * caps, gboolean * video) {
+	GstStructure * structure = gst_caps_get_structure(caps, 0);
+	const gchar *  name      = gst_structure_get_name(structure);
+	gint           version   = 0;
+
+	*video = g_str_has_prefix(name, "video/");
+	if(g_str_equal(name, "video/x-h264"))
+		return g_strdup("h264parse ! queue");
+	if(g_str_equal(name, "video/x-h265"))
+		return g_strdup("h265parse ! queue");
+	if(*video)
+		return NULL;
+
+	if(g_str_equal(name, "audio/mpeg") && gst_structure_get_int(structure, "mpegversion", &version))
+		return g_strdup(version == 1 ? "mpegaudioparse ! queue" : "aacparse ! queue");
+	const gchar * encoder = watch_aac_encoder();
+	if(g_str_has_prefix(name, "audio/") && encoder != NULL)
+		return g_strdup_printf("decodebin ! audioconvert ! audioresample ! %s ! aacparse ! queue", encoder);
+	return NULL;
+}
+
+
+/* Called once parsebin has found every stream: seeks to where playback is, links the first video
+ * and the first audio stream to the muxer and lets them flow */
+static gboolean watch_link(WatchAlong * watch) {
+	g_mutex_lock(&watch->lock);
+	GList * pads = watch->pads;
+	watch->pads = NULL;
+	g_mutex_unlock(&watch->lock);
+	if(pads == NULL)
+		return FALSE;
+
+	/* The seek goes upstream from a blocked pad, which unblocks for the flush and blocks again on
+	 * the first buffer from the new position */
+	if(watch->start > 0) {
+		GstEvent * seek = gst_event_new_seek(1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE,
+		                                     GST_SEEK_TYPE_SET, watch->start, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+		if(!gst_pad_send_event(pads->data, seek))
+			g_printerr("[LIVE] cannot seek, remuxing from the start\n");
+	}
+
+	GstElement * mux  = gst_element_factory_make("mp4mux", NULL);
+	GstElement * sink = gst_element_factory_make("appsink", NULL);
+	if(mux == NULL || sink == NULL) {
+		g_printerr("[LIVE] mp4mux or appsink is not available\n");
+		if(mux)
+			gst_object_unref(mux);
+		if(sink)
+			gst_object_unref(sink);
+		g_list_free_full(pads, gst_object_unref);
+		return FALSE;
+	}
+	g_object_set(mux, "fragment-duration", (guint)(watch->segment_duration / GST_MSECOND), "streamable", TRUE, NULL);
+	g_object_set(sink, "sync", FALSE, "max-buffers", WATCH_SINK_BUFFERS, "drop", FALSE, "enable-last-sample", FALSE, NULL);
+	gst_bin_add_many(GST_BIN(watch->pipeline), mux, sink, NULL);
+	gst_element_link(mux, sink);
+
+	gboolean have_video = FALSE, have_audio = FALSE;
+	GstPad * lead = NULL;
+	for(GList * l = pads; l != NULL; l = l->next) {
+		GstPad *  pad         = l->data;
+		GstCaps * caps        = gst_pad_get_current_caps(pad);
+		gboolean  video       = FALSE;
+		gchar *   description = caps ? watch_branch(caps, &video) : NULL;
+		if(description == NULL && caps != NULL) {
+			gchar * name = gst_caps_to_string(caps);
+			g_print("[LIVE] leaving out %s\n", name);
+			g_free(name);
+		}
+		if(caps != NULL)
+			gst_caps_unref(caps);
+
+		/* Only one stream of each kind, the others go nowhere */
+		GstElement * branch  = NULL;
+		GstPad *     mux_pad = NULL;
+		if(description != NULL && !(video ? have_video : have_audio))
+			branch = gst_parse_bin_from_description(description, TRUE, NULL);
+		g_free(description);
+		if(branch != NULL)
+			mux_pad = gst_element_request_pad_simple(mux, video ? "video_%u" : "audio_%u");
+		if(mux_pad == NULL) {
+			if(branch != NULL)
+				gst_object_unref(branch);
+			branch = gst_element_factory_make("fakesink", NULL);
+			g_object_set(branch, "sync", FALSE, "async", FALSE, NULL);
+		}
+		gst_bin_add(GST_BIN(watch->pipeline), branch);
+
+		GstPad * branch_sink = gst_element_get_static_pad(branch, "sink");
+		gst_pad_link(pad, branch_sink);
+		gst_object_unref(branch_sink);
+		if(mux_pad != NULL) {
+			GstPad * branch_src = gst_element_get_static_pad(branch, "src");
+			gst_pad_link(branch_src, mux_pad);
+			gst_object_unref(branch_src);
+			gst_object_unref(mux_pad);
+
+			if(video || lead == NULL)
+				lead = pad;
+			have_video |= video;
+			have_audio |= !video;
+		}
+	}
+
+	if(lead != NULL) {
+		gst_pad_add_probe(lead, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)watch_origin_probe, watch, NULL);
+		watch->sink = sink;
+		gst_element_set_state(watch->pipeline, GST_STATE_PLAYING);
+	}
+	else
+		g_printerr("[LIVE] nothing in %s can be remuxed\n", watch->uri);
+
+	for(GList * l = pads; l != NULL; l = l->next)
+		gst_pad_remove_probe(l->data, GPOINTER_TO_SIZE(g_object_get_data(l->data, "watch-along-probe")));
+	g_list_free_full(pads, gst_object_unref);
+	return lead != NULL;
+}
+
+
+static GstBusSyncReply watch_bus_sync(GstBus * bus, GstMessage * msg, GstTaskPool * task_pool) {
+	worker_task_pool_adopt(task_pool, msg);
+	return GST_BUS_PASS;
+}
+
+
+static gboolean watch_bus_cb(GstBus * bus, GstMessage * msg, WatchAlong * watch) {
+	if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_APPLICATION && gst_structure_has_name(gst_message_get_structure(msg), "watch-along-pads")) {
+		if(watch_link(watch))
+			return G_SOURCE_CONTINUE;
+	}
+	else if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+		GError * error;
+		gst_message_parse_error(msg, &error, NULL);
+		g_printerr("[LIVE] cannot remux %s: %s\n", watch->uri, error->message);
+		g_error_free(error);
+	}
+	else
+		return G_SOURCE_CONTINUE;
+
+	/* Tried again once something else plays */
+	watch->broken    = TRUE;
+	watch->bus_watch = 0;
+	watch_stop(watch);
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Starts a run from the current position. Data flows into parsebin right away; its streams stay
+ * blocked until watch_link() has seen them all. */
+static void watch_start(WatchAlong * watch) {
+	GError *     error  = NULL;
+	GstElement * source = gst_element_make_from_uri(GST_URI_SRC, watch->uri, NULL, &error);
+	GstElement * parse  = gst_element_factory_make("parsebin", NULL);
+	if(source == NULL || parse == NULL) {
+		g_printerr("[LIVE] cannot read %s: %s\n", watch->uri, error ? error->message : "parsebin is not available");
+		g_clear_error(&error);
+		if(source)
+			gst_object_unref(source);
+		if(parse)
+			gst_object_unref(parse);
+		watch->broken = TRUE;
+		return;
+	}
+
+	watch->pipeline = gst_pipeline_new("watch-along");
+	gst_bin_add_many(GST_BIN(watch->pipeline), source, parse, NULL);
+	gst_element_link(source, parse);
+	g_signal_connect(parse, "pad-added"   , (GCallback)watch_pad_added_cb   , watch);
+	g_signal_connect(parse, "no-more-pads", (GCallback)watch_no_more_pads_cb, watch);
+
+	GstBus * bus = gst_element_get_bus(watch->pipeline);
+	gst_bus_set_sync_handler(bus, (GstBusSyncHandler)watch_bus_sync, gst_object_ref(watch->task_pool), gst_object_unref);
+	watch->bus_watch = gst_bus_add_watch(bus, (GstBusFunc)watch_bus_cb, watch);
+	gst_object_unref(bus);
+
+	watch->start   = watch->position;
+	watch->origin  = -1;
+	watch->run_new = TRUE;
+	g_print("[LIVE] remuxing %s from %.1f s\n", watch->uri, (gdouble)watch->start / GST_SECOND);
+	gst_element_set_state(watch->pipeline, GST_STATE_PAUSED);
+}
+
+
+/* Cuts what the muxer has produced into segments, as long as not too many are waiting */
+static void watch_pull(WatchAlong * watch) {
+	if(watch->sink == NULL)
+		return;
+
+	while(g_queue_get_length(&watch->ahead) < WATCH_AHEAD) {
+		GstSample * sample = gst_app_sink_try_pull_sample(GST_APP_SINK(watch->sink), 0);
+		if(sample == NULL)
+			break;
+		watch_feed(watch, gst_sample_get_buffer(sample));
+		gst_sample_unref(sample);
+	}
+
+	/* The last segment ends with the file */
+	if(!watch->eos && gst_app_sink_is_eos(GST_APP_SINK(watch->sink))) {
+		watch->eos = TRUE;
+		watch_close_segment(watch, watch->open_start + watch->segment_duration);
+	}
+}
+
+
+/* Hands out the segments playback has passed */
+static void watch_publish(WatchAlong * watch) {
+	g_mutex_lock(&watch->lock);
+	gint64 origin = watch->origin >= 0 ? watch->origin : watch->start;
+	g_mutex_unlock(&watch->lock);
+
+	WatchSegment * segment;
+	while((segment = g_queue_peek_head(&watch->ahead)) != NULL && origin + segment->start + segment->duration <= watch->position) {
+		g_queue_pop_head(&watch->ahead);
+		segment->sequence = watch->next_sequence++;
+		if(segment->sequence == 0)
+			segment->discontinuity = FALSE;
+		g_queue_push_tail(&watch->window, segment);
+
+		while(g_queue_get_length(&watch->window) > watch->max_segments) {
+			WatchSegment * old = g_queue_pop_head(&watch->window);
+			if(old->discontinuity)
+				watch->discontinuity_sequence++;
+			watch_segment_free(old);
+		}
+	}
+}
+
+
+static void watch_clear_window(WatchAlong * watch) {
+	WatchSegment * segment;
+	while((segment = g_queue_pop_head(&watch->window)) != NULL) {
+		if(segment->discontinuity)
+			watch->discontinuity_sequence++;
+		watch_segment_free(segment);
+	}
+}
+
+
+WatchAlong * watch_along_new(guint segments, gint segment_seconds) {
+	WatchAlong * watch = g_slice_new0(WatchAlong);
+	watch->max_segments     = MAX(segments, 2);
+	watch->segment_duration = MAX(segment_seconds, 1) * GST_SECOND;
+	watch->task_pool        = worker_task_pool_new(WATCH_NICE);
+	watch->pending          = g_byte_array_new();
+	watch->tracks           = g_array_new(FALSE, FALSE, sizeof(WatchTrack));
+	watch->open_start       = -1;
+	watch->run_start        = -1;
+	g_mutex_init(&watch->lock);
+	g_queue_init(&watch->ahead);
+	g_queue_init(&watch->window);
+	return watch;
+}
+
+
+void watch_along_free(WatchAlong * watch) {
+	watch_stop(watch);
+	watch_reset_run(watch);
+	watch_segments_clear(&watch->window);
+	g_byte_array_free(watch->pending, TRUE);
+	g_array_free(watch->tracks, TRUE);
+	gst_object_unref(watch->task_pool);
+	g_mutex_clear(&watch->lock);
+	g_free(watch->uri);
+	g_slice_free(WatchAlong, watch);
+}
+
+
+/* Called regularly with what plays, where and how fast. A new uri or a jump in the position starts
+ * a new run from there, with the distance that counts as a jump growing with the rate. The
+ * pipeline runs only while viewers keep asking for the stream. */
+void watch_along_follow(WatchAlong * watch, const gchar * uri, gint64 position, gdouble rate) {
+	gboolean active = watch->last_request != 0 && g_get_monotonic_time() - watch->last_request < WATCH_IDLE_SECONDS * G_USEC_PER_SEC;
+	gboolean moved  = g_strcmp0(uri, watch->uri) != 0;
+	gboolean jumped = position < watch->position - GST_SECOND || position > watch->position + (gint64)(WATCH_JUMP * MAX(rate, 1.0));
+	if(moved) {
+		g_free(watch->uri);
+		watch->uri    = g_strdup(uri);
+		watch->broken = FALSE;
+	}
+	watch->position = position;
+
+	if(watch->pipeline != NULL && (moved || jumped || !active))
+		watch_stop(watch);
+	if(!active)
+		watch_clear_window(watch);
+	if(watch->pipeline == NULL && active && watch->uri != NULL && !watch->broken)
+		watch_start(watch);
+
+	watch_pull(watch);
+	watch_publish(watch);
+}
+
+
+gsize watch_along_cached(WatchAlong * watch) {
+	gsize   size    = 0;
+	GQueue * queues[] = { &watch->ahead, &watch->window };
+	for(guint i = 0; i < G_N_ELEMENTS(queues); i++)
+		for(GList * l = queues[i]->head; l != NULL; l = l->next)
+			size += g_bytes_get_size(((WatchSegment *)l->data)->data);
+	return size;
+}
+
+
+/* Live playlist of the window. A segment starting a new run is marked as a discontinuity and
+ * comes with the header of its run; the discontinuity sequence counts the marks that left the
+ * window. */
+static GBytes * watch_playlist(WatchAlong * watch) {
+	gint64 target = watch->segment_duration;
+	for(GList * l = watch->window.head; l != NULL; l = l->next)
+		target = MAX(target, ((WatchSegment *)l->data)->duration);
+
+	WatchSegment * first = g_queue_peek_head(&watch->window);
+	GString *      text  = g_string_new("#EXTM3U\n#EXT-X-VERSION:7\n");
+	g_string_append_printf(text, "#EXT-X-TARGETDURATION:%d\n", (gint)((target + GST_SECOND - 1) / GST_SECOND));
+	g_string_append_printf(text, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n", first ? first->sequence : watch->next_sequence);
+	g_string_append_printf(text, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", watch->discontinuity_sequence);
+
+	WatchInit * init = NULL;
+	for(GList * l = watch->window.head; l != NULL; l = l->next) {
+		WatchSegment * segment = l->data;
+		if(segment->discontinuity)
+			g_string_append(text, "#EXT-X-DISCONTINUITY\n");
+		if(segment->init != init) {
+			init = segment->init;
+			g_string_append_printf(text, "#EXT-X-MAP:URI=\"init-%u.mp4\"\n", init->id);
+		}
+		g_string_append_printf(text, "#EXTINF:%.3f,\n%" G_GUINT64_FORMAT ".m4s\n", (gdouble)segment->duration / GST_SECOND, segment->sequence);
+	}
+	return g_string_free_to_bytes(text);
+}
+
+
+static void watch_respond(SoupMessage * msg, const gchar * content_type, gboolean immutable, GBytes * body) {
+	gchar * cache_control = immutable ? g_strdup_printf("max-age=%d", WATCH_MAX_AGE) : g_strdup("no-cache");
+	soup_message_headers_replace(msg->response_headers, "Cache-Control", cache_control);
+	soup_message_headers_set_content_type(msg->response_headers, content_type, NULL);
+	g_free(cache_control);
+
+	/* Every viewer shares the bytes of the window */
+	SoupBuffer * buffer = soup_buffer_new_with_owner(g_bytes_get_data(body, NULL), g_bytes_get_size(body), g_bytes_ref(body), (GDestroyNotify)g_bytes_unref);
+	soup_message_body_append_buffer(msg->response_body, buffer);
+	soup_buffer_free(buffer);
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+}
+
+
+/* Only requests for the stream itself count as someone watching; the first viewer starts the
+ * remuxing right away rather than on the next follow */
+static void watch_viewed(WatchAlong * watch) {
+	watch->last_request = g_get_monotonic_time();
+	if(watch->pipeline == NULL && watch->uri != NULL && !watch->broken)
+		watch_start(watch);
+}
+
+
+/* Serves /live/index.m3u8, /live/init-ID.mp4 and /live/SEQUENCE.m4s */
+void watch_along_callback(SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, WatchAlong * watch) {
+	if(msg->method != SOUP_METHOD_GET && msg->method != SOUP_METHOD_HEAD) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+
+	const gchar * name = g_str_has_prefix(path, "/live/") ? path + strlen("/live/") : "";
+	if(g_str_equal(name, "index.m3u8")) {
+		watch_viewed(watch);
+		GBytes * playlist = watch_playlist(watch);
+		watch_respond(msg, "application/vnd.apple.mpegurl", FALSE, playlist);
+		g_bytes_unref(playlist);
+		return;
+	}
+
+	gchar *  end;
+	gboolean init   = g_str_has_prefix(name, "init-");
+	guint64  number = g_ascii_strtoull(init ? name + strlen("init-") : name, &end, 10);
+	if(end != (init ? name + strlen("init-") : name) && g_str_equal(end, init ? ".mp4" : ".m4s")) {
+		for(GList * l = watch->window.head; l != NULL; l = l->next) {
+			WatchSegment * segment = l->data;
+			if(init && segment->init->id == number) {
+				watch_viewed(watch);
+				watch_respond(msg, "video/mp4", TRUE, segment->init->data);
+				return;
+			}
+			if(!init && segment->sequence == number) {
+				watch_viewed(watch);
+				watch_respond(msg, "video/iso.segment", TRUE, segment->data);
+				return;
+			}
+		}
+	}
+	soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+}
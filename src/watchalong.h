@@ -0,0 +1,24 @@
+#ifndef BANANA_WATCHALONG_H
+#define BANANA_WATCHALONG_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+
+/* Watch-along: what the player shows, re-streamed as live HLS for phones at /live/index.m3u8.
+ * playbin never hands out the encoded streams, so a second pipeline reads the same file from the
+ * position playback is at and remuxes it into fragmented MP4 without decoding anything. Video that
+ * browsers cannot play is left out rather than re-encoded, which the board could not afford next
+ * to playback; audio is transcoded to AAC when needed. Segments are cut from the muxer output,
+ * held back until playback has passed them, and kept in a window of `segments' that every viewer
+ * shares, so memory does not grow with the number of viewers. The pipeline only runs while
+ * someone has asked for the stream recently. Must only be used from the main context. */
+typedef struct _WatchAlong WatchAlong;
+
+WatchAlong * watch_along_new      (guint segments, gint segment_seconds);
+void         watch_along_free     (WatchAlong * watch);
+void         watch_along_follow   (WatchAlong * watch, const gchar * uri, gint64 position, gdouble rate); /* NULL when nothing plays */
+gsize        watch_along_cached   (WatchAlong * watch); /* bytes of segments held */
+void         watch_along_callback (SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * context, WatchAlong * watch);
+
+#endif
@@ -0,0 +1,340 @@
+#include <string.h>
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+#include "wire.h"
+
+
+#define WIRE_MAX_DEPTH 32 /* nesting of decoded messages, commands are flat */
+
+
+WireFormat wire_format_from_protocol(const gchar * protocol) {
+	return g_strcmp0(protocol, WIRE_PROTOCOL_MSGPACK) == 0 ? WIRE_MSGPACK : WIRE_JSON;
+}
+
+
+/* Encoding, always in the smallest form MessagePack has for a value */
+
+static void put_be(GByteArray * out, guint8 tag, guint64 value, guint size) {
+	guint8 bytes[9];
+	bytes[0] = tag;
+	for(guint i = 0; i < size; i++)
+		bytes[1 + i] = value >> (8 * (size - 1 - i));
+	g_byte_array_append(out, bytes, 1 + size);
+}
+
+
+static void put_int(GByteArray * out, gint64 value) {
+	if(value >= 0) {
+		if(value < 128)                put_be(out, value, 0, 0);
+		else if(value <= G_MAXUINT8)   put_be(out, 0xcc, value, 1);
+		else if(value <= G_MAXUINT16)  put_be(out, 0xcd, value, 2);
+		else if(value <= G_MAXUINT32)  put_be(out, 0xce, value, 4);
+		else                           put_be(out, 0xcf, value, 8);
+	}
+	else {
+		if(value >= -32)               put_be(out, (guint8)value, 0, 0);
+		else if(value >= G_MININT8)    put_be(out, 0xd0, (guint64)value, 1);
+		else if(value >= G_MININT16)   put_be(out, 0xd1, (guint64)value, 2);
+		else if(value >= G_MININT32)   put_be(out, 0xd2, (guint64)value, 4);
+		else                           put_be(out, 0xd3, (guint64)value, 8);
+	}
+}
+
+
+static void put_double(GByteArray * out, gdouble value) {
+	union { gdouble d; guint64 u; } bits = { .d = value };
+	put_be(out, 0xcb, bits.u, 8);
+}
+
+
+/* Header of a string, array or map of `length' elements, with its fix, 8, 16 and 32 bit tags */
+static void put_header(GByteArray * out, guint32 length, guint8 fix, guint fix_max, guint8 tag8, guint8 tag16, guint8 tag32) {
+	if(length <= fix_max)                put_be(out, fix | length, 0, 0);
+	else if(tag8 && length <= G_MAXUINT8) put_be(out, tag8, length, 1);
+	else if(length <= G_MAXUINT16)       put_be(out, tag16, length, 2);
+	else                                 put_be(out, tag32, length, 4);
+}
+
+
+static void put_string(GByteArray * out, const gchar * string) {
+	gsize length = strlen(string);
+	put_header(out, length, 0xa0, 31, 0xd9, 0xda, 0xdb);
+	g_byte_array_append(out, (const guint8 *)string, length);
+}
+
+
+static void put_node(GByteArray * out, JsonNode * node) {
+	switch(json_node_get_node_type(node)) {
+		case JSON_NODE_OBJECT: {
+			JsonObject * object  = json_node_get_object(node);
+			GList *      members = json_object_get_members(object);
+			put_header(out, json_object_get_size(object), 0x80, 15, 0, 0xde, 0xdf);
+			for(GList * l = members; l != NULL; l = l->next) {
+				put_string(out, l->data);
+				put_node(out, json_object_get_member(object, l->data));
+			}
+			g_list_free(members);
+			break;
+		}
+		case JSON_NODE_ARRAY: {
+			JsonArray * array = json_node_get_array(node);
+			guint       n     = json_array_get_length(array);
+			put_header(out, n, 0x90, 15, 0, 0xdc, 0xdd);
+			for(guint i = 0; i < n; i++)
+				put_node(out, json_array_get_element(array, i));
+			break;
+		}
+		case JSON_NODE_VALUE:
+			switch(json_node_get_value_type(node)) {
+				case G_TYPE_BOOLEAN: put_be(out, json_node_get_boolean(node) ? 0xc3 : 0xc2, 0, 0); break;
+				case G_TYPE_INT64:   put_int(out, json_node_get_int(node)); break;
+				case G_TYPE_DOUBLE:  put_double(out, json_node_get_double(node)); break;
+				case G_TYPE_STRING:  put_string(out, json_node_get_string(node)); break;
+				default:             put_be(out, 0xc0, 0, 0); break;
+			}
+			break;
+		case JSON_NODE_NULL:
+			put_be(out, 0xc0, 0, 0);
+			break;
+	}
+}
+
+
+GBytes * wire_msgpack_encode(JsonNode * node) {
+	GByteArray * out = g_byte_array_new();
+	put_node(out, node);
+	return g_byte_array_free_to_bytes(out);
+}
+
+
+/* Decoding, into the same JsonNode trees the JSON parser produces */
+
+typedef struct _Reader {
+	const guint8 * data;
+	gsize          size;
+	gsize          offset;
+} Reader;
+
+
+static gboolean get_be(Reader * reader, guint size, guint64 * value) {
+	if(reader->size - reader->offset < size)
+		return FALSE;
+	*value = 0;
+	for(guint i = 0; i < size; i++)
+		*value = *value << 8 | reader->data[reader->offset++];
+	return TRUE;
+}
+
+
+static JsonNode * get_node(Reader * reader, guint depth);
+
+
+static gchar * get_string(Reader * reader, guint64 length) {
+	if(reader->size - reader->offset < length)
+		return NULL;
+	const gchar * start = (const gchar *)reader->data + reader->offset;
+	if(!g_utf8_validate(start, length, NULL))
+		return NULL;
+	reader->offset += length;
+	return g_strndup(start, length);
+}
+
+
+static JsonNode * get_array(Reader * reader, guint64 length, guint depth) {
+	JsonArray * array = json_array_new();
+	for(guint64 i = 0; i < length; i++) {
+		JsonNode * element = get_node(reader, depth + 1);
+		if(element == NULL) {
+			json_array_unref(array);
+			return NULL;
+		}
+		json_array_add_element(array, element);
+	}
+	JsonNode * node = json_node_alloc();
+	json_node_init_array(node, array);
+	json_array_unref(array);
+	return node;
+}
+
+
+static JsonNode * get_map(Reader * reader, guint64 length, guint depth) {
+	JsonObject * object = json_object_new();
+	for(guint64 i = 0; i < length; i++) {
+		/* Keys are strings, anything else is not a command */
+		guint64 tag, key_length;
+		gchar * key = NULL;
+		if(get_be(reader, 1, &tag)) {
+			if((tag & 0xe0) == 0xa0)
+				key = get_string(reader, tag & 0x1f);
+			else if(tag >= 0xd9 && tag <= 0xdb && get_be(reader, 1 << (tag - 0xd9), &key_length))
+				key = get_string(reader, key_length);
+		}
+		JsonNode * value = key ? get_node(reader, depth + 1) : NULL;
+		if(value == NULL) {
+			g_free(key);
+			json_object_unref(object);
+			return NULL;
+		}
+		json_object_set_member(object, key, value);
+		g_free(key);
+	}
+	JsonNode * node = json_node_alloc();
+	json_node_init_object(node, object);
+	json_object_unref(object);
+	return node;
+}
+
+
+static JsonNode * get_node(Reader * reader, guint depth) {
+	guint64 tag, value;
+	if(depth > WIRE_MAX_DEPTH || !get_be(reader, 1, &tag))
+		return NULL;
+
+	if(tag < 0x80)
+		return json_node_init_int(json_node_alloc(), tag);
+	if(tag >= 0xe0)
+		return json_node_init_int(json_node_alloc(), (gint8)tag);
+	if((tag & 0xf0) == 0x80)
+		return get_map(reader, tag & 0x0f, depth);
+	if((tag & 0xf0) == 0x90)
+		return get_array(reader, tag & 0x0f, depth);
+	if((tag & 0xe0) == 0xa0) {
+		gchar * string = get_string(reader, tag & 0x1f);
+		JsonNode * node = string ? json_node_init_string(json_node_alloc(), string) : NULL;
+		g_free(string);
+		return node;
+	}
+
+	switch(tag) {
+		case 0xc0: return json_node_init_null(json_node_alloc());
+		case 0xc2: return json_node_init_boolean(json_node_alloc(), FALSE);
+		case 0xc3: return json_node_init_boolean(json_node_alloc(), TRUE);
+
+		case 0xca: {
+			if(!get_be(reader, 4, &value))
+				return NULL;
+			union { guint32 u; gfloat f; } single = { .u = value };
+			return json_node_init_double(json_node_alloc(), single.f);
+		}
+		case 0xcb: {
+			if(!get_be(reader, 8, &value))
+				return NULL;
+			union { guint64 u; gdouble d; } bits = { .u = value };
+			return json_node_init_double(json_node_alloc(), bits.d);
+		}
+
+		case 0xcc: case 0xcd: case 0xce: case 0xcf:
+			if(!get_be(reader, 1 << (tag - 0xcc), &value))
+				return NULL;
+			return json_node_init_int(json_node_alloc(), MIN(value, (guint64)G_MAXINT64));
+		case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+			guint size = 1 << (tag - 0xd0);
+			if(!get_be(reader, size, &value))
+				return NULL;
+			/* Sign extension */
+			gint64 signed_value = size == 8 ? (gint64)value : (gint64)(value ^ (G_GUINT64_CONSTANT(1) << (8 * size - 1))) - ((gint64)1 << (8 * size - 1));
+			return json_node_init_int(json_node_alloc(), signed_value);
+		}
+
+		case 0xd9: case 0xda: case 0xdb: {
+			if(!get_be(reader, 1 << (tag - 0xd9), &value))
+				return NULL;
+			gchar * string = get_string(reader, value);
+			JsonNode * node = string ? json_node_init_string(json_node_alloc(), string) : NULL;
+			g_free(string);
+			return node;
+		}
+		case 0xdc: case 0xdd:
+			return get_be(reader, tag == 0xdc ? 2 : 4, &value) ? get_array(reader, value, depth) : NULL;
+		case 0xde: case 0xdf:
+			return get_be(reader, tag == 0xde ? 2 : 4, &value) ? get_map(reader, value, depth) : NULL;
+	}
+
+	/* Binary data and extension types have no JSON equivalent */
+	return NULL;
+}
+
+
+JsonNode * wire_msgpack_decode(GBytes * message, GError ** error) {
+	Reader reader = { 0 };
+	reader.data = g_bytes_get_data(message, &reader.size);
+
+	JsonNode * node = get_node(&reader, 0);
+	if(node == NULL || reader.offset != reader.size) {
+		g_set_error(error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_INVALID_DATA, "bad msgpack message of %" G_GSIZE_FORMAT " bytes", reader.size);
+		if(node != NULL)
+			json_node_unref(node);
+		return NULL;
+	}
+	return node;
+}
+
+
+struct _WireFrame {
+	gint       ref_count;
+	JsonNode * node;                  /* dropped once every encoding exists */
+	GBytes *   encoded[WIRE_FORMATS];
+};
+
+
+WireFrame * wire_frame_new(JsonNode * node) {
+	WireFrame * frame = g_slice_new0(WireFrame);
+	frame->ref_count = 1;
+	frame->node      = node;
+	return frame;
+}
+
+
+WireFrame * wire_frame_ref(WireFrame * frame) {
+	g_atomic_int_inc(&frame->ref_count);
+	return frame;
+}
+
+
+void wire_frame_unref(WireFrame * frame) {
+	if(!g_atomic_int_dec_and_test(&frame->ref_count))
+		return;
+
+	for(guint i = 0; i < WIRE_FORMATS; i++)
+		if(frame->encoded[i] != NULL)
+			g_bytes_unref(frame->encoded[i]);
+	if(frame->node != NULL)
+		json_node_unref(frame->node);
+	g_slice_free(WireFrame, frame);
+}
+
+
+GBytes * wire_frame_encode(WireFrame * frame, WireFormat format) {
+	if(frame->encoded[format] != NULL)
+		return frame->encoded[format];
+
+	if(format == WIRE_MSGPACK)
+		frame->encoded[format] = wire_msgpack_encode(frame->node);
+	else {
+		JsonGenerator * generator = json_generator_new();
+		json_generator_set_root(generator, frame->node);
+		gsize   length;
+		gchar * json = json_generator_to_data(generator, &length);
+		g_object_unref(generator);
+		frame->encoded[format] = g_bytes_new_take(json, length);
+	}
+
+	guint missing = 0;
+	for(guint i = 0; i < WIRE_FORMATS; i++)
+		missing += frame->encoded[i] == NULL;
+	if(missing == 0) {
+		json_node_unref(frame->node);
+		frame->node = NULL;
+	}
+	return frame->encoded[format];
+}
+
+
+/* Encodes `frame' in every format right away, which lets go of its JSON tree. For frames that are
+ * kept around, where the tree would otherwise stay alive next to the encodings that get used. */
+void wire_frame_encode_all(WireFrame * frame) {
+	for(guint i = 0; i < WIRE_FORMATS; i++)
+		wire_frame_encode(frame, i);
+}
@@ -0,0 +1,36 @@
+#ifndef BANANA_WIRE_H
+#define BANANA_WIRE_H
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+
+/* Encodings of websocket messages. Clients pick one with the subprotocol they ask for at connect
+ * time; those asking for none get JSON, like before there was a choice. */
+typedef enum {
+	WIRE_JSON,    /* text frames */
+	WIRE_MSGPACK, /* binary frames, MessagePack */
+	WIRE_FORMATS
+} WireFormat;
+
+#define WIRE_PROTOCOL_JSON    "banana.json"
+#define WIRE_PROTOCOL_MSGPACK "banana.msgpack"
+
+WireFormat   wire_format_from_protocol(const gchar * protocol);
+GBytes *     wire_msgpack_encode      (JsonNode * node);
+JsonNode *   wire_msgpack_decode      (GBytes * message, GError ** error);
+
+
+/* An outgoing message. It is encoded the first time a client needs it in its format and the
+ * encoding is kept, so a message going out to many clients is serialized once per format rather
+ * than once per client. Frames may be released from any thread, as the directory listings that
+ * keep them are, but must only be encoded from the main context. */
+typedef struct _WireFrame WireFrame;
+
+WireFrame *  wire_frame_new       (JsonNode * node); /* takes ownership of `node' */
+WireFrame *  wire_frame_ref       (WireFrame * frame);
+void         wire_frame_unref     (WireFrame * frame);
+GBytes *     wire_frame_encode    (WireFrame * frame, WireFormat format); /* borrowed */
+void         wire_frame_encode_all(WireFrame * frame); /* for frames that are kept */
+
+#endif
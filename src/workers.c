@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "workers.h"
+
+
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+
+struct _WorkerPool {
+	gchar *          name;
+	GThreadPool *    threads;
+	GMainContext *   context;
+	gint             nice;         /* niceness of the threads, 0 to leave them alone */
+
+	GCompareDataFunc compare;      /* order of queued jobs, NULL for first come first served */
+	gpointer         compare_data;
+};
+
+
+typedef struct _WorkerJob {
+	WorkerFunc func;
+	WorkerFunc done;
+	gpointer   job;
+} WorkerJob;
+
+
+static gboolean worker_job_done(WorkerJob * job) {
+	if(job->done)
+		job->done(job->job);
+	return G_SOURCE_REMOVE;
+}
+
+
+static void worker_job_free(WorkerJob * job) {
+	g_slice_free(WorkerJob, job);
+}
+
+
+/* Lowers the CPU and I/O priority of the calling thread. This cannot be undone, so it must only
+ * be used on threads that are never shared with other work. */
+void worker_thread_deprioritize(gint nice) {
+	pid_t tid = syscall(SYS_gettid);
+	if(setpriority(PRIO_PROCESS, tid, nice) != 0)
+		g_printerr("[ERR] cannot renice worker thread: %s\n", g_strerror(errno));
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+
+static GPrivate worker_niced;
+
+
+static void worker_run(WorkerJob * job, WorkerPool * pool) {
+	if(pool->nice != 0 && !g_private_get(&worker_niced)) {
+		worker_thread_deprioritize(pool->nice);
+		g_private_set(&worker_niced, GINT_TO_POINTER(TRUE));
+	}
+
+	job->func(job->job);
+	g_main_context_invoke_full(pool->context, G_PRIORITY_DEFAULT, (GSourceFunc)worker_job_done, job, (GDestroyNotify)worker_job_free);
+}
+
+
+WorkerPool * worker_pool_new(const gchar * name, gint max_threads) {
+	return worker_pool_new_full(name, max_threads, 0);
+}
+
+
+/* Creates a pool whose threads run with the given niceness and idle I/O priority, for background
+ * work that must never compete with playback. Such pools get threads of their own, since GLib
+ * would otherwise hand the niced threads to other pools later on. */
+WorkerPool * worker_pool_new_full(const gchar * name, gint max_threads, gint nice) {
+	WorkerPool * pool = g_slice_new0(WorkerPool);
+	pool->name    = g_strdup(name);
+	pool->context = g_main_context_ref_thread_default();
+	pool->nice    = nice;
+
+	GError * error = NULL;
+	pool->threads = g_thread_pool_new((GFunc)worker_run, pool, max_threads, nice != 0, &error);
+	if(pool->threads == NULL)
+		g_error("cannot create %s worker pool: %s", name, error->message);
+
+	return pool;
+}
+
+
+/* Waits for all queued jobs to finish */
+void worker_pool_free(WorkerPool * pool) {
+	g_thread_pool_free(pool->threads, FALSE, TRUE);
+	g_main_context_unref(pool->context);
+	g_free(pool->name);
+	g_slice_free(WorkerPool, pool);
+}
+
+
+void worker_pool_push(WorkerPool * pool, WorkerFunc func, WorkerFunc done, gpointer job) {
+	WorkerJob * worker_job = g_slice_new(WorkerJob);
+	worker_job->func = func;
+	worker_job->done = done;
+	worker_job->job  = job;
+	g_thread_pool_push(pool->threads, worker_job, NULL);
+}
+
+
+static gint worker_job_compare(const WorkerJob * a, const WorkerJob * b, WorkerPool * pool) {
+	return pool->compare(a->job, b->job, pool->compare_data);
+}
+
+
+/* Makes queued jobs start in the order given by `compare' instead of the order they were pushed.
+ * Call it again whenever the order may have changed, it sorts the queue anew. */
+void worker_pool_set_sort(WorkerPool * pool, GCompareDataFunc compare, gpointer user_data) {
+	pool->compare      = compare;
+	pool->compare_data = user_data;
+	g_thread_pool_set_sort_function(pool->threads, compare ? (GCompareDataFunc)worker_job_compare : NULL, pool);
+}
+
+
+/* Number of jobs waiting for a thread */
+guint worker_pool_pending(WorkerPool * pool) {
+	return g_thread_pool_unprocessed(pool->threads);
+}
+
+
+/* Streaming threads of background pipelines. GStreamer's default task pool shares its threads
+ * with the playback pipeline, so background pipelines get threads of their own which can be
+ * niced. */
+typedef struct _WorkerTaskPool {
+	GstTaskPool parent;
+	gint        nice;
+} WorkerTaskPool;
+
+typedef struct _WorkerTaskPoolClass {
+	GstTaskPoolClass parent_class;
+} WorkerTaskPoolClass;
+
+static GType worker_task_pool_get_type(void);
+G_DEFINE_TYPE(WorkerTaskPool, worker_task_pool, GST_TYPE_TASK_POOL)
+
+
+typedef struct _WorkerTask {
+	GstTaskPoolFunction func;
+	gpointer            data;
+	gint                nice;
+} WorkerTask;
+
+
+static gpointer worker_task_thread(WorkerTask * task) {
+	worker_thread_deprioritize(task->nice);
+	task->func(task->data);
+	g_slice_free(WorkerTask, task);
+	return NULL;
+}
+
+
+static void worker_task_pool_prepare(GstTaskPool * pool, GError ** error) {
+}
+
+
+static void worker_task_pool_cleanup(GstTaskPool * pool) {
+}
+
+
+static gpointer worker_task_pool_push(GstTaskPool * pool, GstTaskPoolFunction func, gpointer data, GError ** error) {
+	WorkerTask * task = g_slice_new(WorkerTask);
+	task->func = func;
+	task->data = data;
+	task->nice = ((WorkerTaskPool *)pool)->nice;
+
+	GThread * thread = g_thread_try_new("niced-stream", (GThreadFunc)worker_task_thread, task, error);
+	if(thread == NULL)
+		g_slice_free(WorkerTask, task);
+	return thread;
+}
+
+
+static void worker_task_pool_join(GstTaskPool * pool, gpointer id) {
+	g_thread_join(id);
+}
+
+
+static void worker_task_pool_class_init(WorkerTaskPoolClass * klass) {
+	GstTaskPoolClass * pool_class = GST_TASK_POOL_CLASS(klass);
+	pool_class->prepare = worker_task_pool_prepare;
+	pool_class->cleanup = worker_task_pool_cleanup;
+	pool_class->push    = worker_task_pool_push;
+	pool_class->join    = worker_task_pool_join;
+}
+
+
+static void worker_task_pool_init(WorkerTaskPool * pool) {
+}
+
+
+GstTaskPool * worker_task_pool_new(gint nice) {
+	WorkerTaskPool * pool = g_object_new(worker_task_pool_get_type(), NULL);
+	pool->nice = nice;
+	return GST_TASK_POOL(pool);
+}
+
+
+/* For the synchronous bus handler of a pipeline: moves the task a stream-status message announces
+ * to `pool' before its thread starts */
+void worker_task_pool_adopt(GstTaskPool * pool, GstMessage * msg) {
+	if(GST_MESSAGE_TYPE(msg) != GST_MESSAGE_STREAM_STATUS)
+		return;
+
+	GstStreamStatusType type;
+	GstElement *        owner;
+	gst_message_parse_stream_status(msg, &type, &owner);
+
+	const GValue * object = gst_message_get_stream_status_object(msg);
+	if(type == GST_STREAM_STATUS_TYPE_CREATE && object != NULL && G_VALUE_HOLDS(object, GST_TYPE_TASK))
+		gst_task_set_pool(GST_TASK(g_value_get_object(object)), pool);
+}
@@ -0,0 +1,30 @@
+#ifndef BANANA_WORKERS_H
+#define BANANA_WORKERS_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+
+/* A pool of threads for work that must not run on the main loop (disk access, parsing, ...).
+ * Each job runs `func' in a worker thread, then `done' back in the main context that created
+ * the pool. Jobs are started in the order they were pushed. */
+typedef struct _WorkerPool WorkerPool;
+
+typedef void (*WorkerFunc)(gpointer job);
+
+WorkerPool * worker_pool_new     (const gchar * name, gint max_threads);
+WorkerPool * worker_pool_new_full(const gchar * name, gint max_threads, gint nice);
+void         worker_pool_free    (WorkerPool * pool);
+void         worker_pool_push    (WorkerPool * pool, WorkerFunc func, WorkerFunc done, gpointer job);
+void         worker_pool_set_sort(WorkerPool * pool, GCompareDataFunc compare, gpointer user_data);
+guint        worker_pool_pending (WorkerPool * pool);
+
+void         worker_thread_deprioritize(gint nice);
+
+
+/* A GStreamer task pool whose threads are deprioritized like those of a niced worker pool, for
+ * pipelines that run next to playback. Tasks are moved to it from a synchronous bus handler. */
+GstTaskPool * worker_task_pool_new  (gint nice);
+void          worker_task_pool_adopt(GstTaskPool * pool, GstMessage * msg);
+
+#endif